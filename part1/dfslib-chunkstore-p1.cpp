@@ -0,0 +1,513 @@
+#include <set>
+#include <ctime>
+#include <chrono>
+#include <string>
+#include <memory>
+#include <vector>
+#include <random>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_set>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/time.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-chunkstore-p1.h"
+
+#define DFS_MANIFEST_MAGIC 0x4d534644 // "DFSM"
+
+/**
+ * Manifest file layout: this header, then `count` entries of a raw chunk
+ * hash followed by the chunk's 32-bit length
+ */
+struct DFSManifestHeader {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t size;
+};
+
+static std::string HexDigest(const std::string& hash) {
+    std::ostringstream hex;
+    hex << std::hex << std::setfill('0');
+    for (unsigned char c : hash) {
+        hex << std::setw(2) << static_cast<int>(c);
+    }
+    return hex.str();
+}
+
+/**
+ * Read exactly `length` bytes from `fd`
+ */
+static bool ReadFully(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t count = read(fd, data, length);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Write all of `length` bytes to `fd`
+ */
+static bool WriteFully(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t count = write(fd, data, length);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+/**
+ * Reads a deduplicated file chunk by chunk from the store, keeping its
+ * manifest pinned so that sweeps leave the chunks in place
+ */
+class DFSManifestReader : public DFSFileReader {
+
+private:
+    const DFSChunkStore* store;
+    std::string id;
+    std::vector<DFSContentChunk> chunks;
+    size_t next_chunk;
+    std::string buffer;
+    size_t position;
+
+    /** Bytes of the first chunk before the requested offset **/
+    size_t skip;
+
+public:
+    DFSManifestReader(const DFSChunkStore* store, const std::string& id,
+                      std::vector<DFSContentChunk> chunks, uint64_t offset) :
+        store(store), id(id), chunks(std::move(chunks)), next_chunk(0), position(0), skip(0) {
+        // Start at the chunk holding `offset`
+        auto after = std::upper_bound(this->chunks.begin(), this->chunks.end(), offset,
+            [](uint64_t value, const DFSContentChunk& chunk) { return value < chunk.offset; });
+        if (after != this->chunks.begin() && offset < (after - 1)->offset + (after - 1)->length) {
+            this->next_chunk = after - 1 - this->chunks.begin();
+            this->skip = offset - this->chunks[this->next_chunk].offset;
+        } else {
+            this->next_chunk = this->chunks.size();
+        }
+    }
+
+    ~DFSManifestReader() {
+        this->store->Unpin(this->id);
+    }
+
+    ssize_t Next(size_t length, const char** data) override {
+        if (this->position >= this->buffer.size()) {
+            if (this->next_chunk >= this->chunks.size()) {
+                return 0;
+            }
+            const DFSContentChunk& chunk = this->chunks[this->next_chunk++];
+            if (!this->store->Read(chunk.hash, &this->buffer) || this->buffer.size() != chunk.length) {
+                dfs_log(LL_ERROR) << "Missing or damaged chunk " << HexDigest(chunk.hash);
+                return -1;
+            }
+            this->position = this->skip;
+            this->skip = 0;
+        }
+
+        size_t count = std::min(length, this->buffer.size() - this->position);
+        *data = this->buffer.data() + this->position;
+        this->position += count;
+        return count;
+    }
+
+};
+
+DFSChunkStore::DFSChunkStore(const std::string& mount_path, dfs_durability_e durability) :
+    mount_path(mount_path), durability(durability), sweeper_stopping(false) {
+
+    std::string chunk_dir = this->mount_path + DFS_CHUNK_DIR;
+    std::string manifest_dir = this->mount_path + DFS_MANIFEST_DIR;
+    for (const std::string& dir : {chunk_dir, manifest_dir}) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            dfs_log(LL_ERROR) << "Could not create chunk store directory: " << dir;
+        }
+    }
+
+    // Fan chunks out over 256 directories by their first hash byte
+    for (int prefix = 0; prefix < 256; prefix++) {
+        std::string dir = chunk_dir + HexDigest(std::string(1, static_cast<char>(prefix)));
+        mkdir(dir.c_str(), 0755);
+    }
+}
+
+DFSChunkStore::~DFSChunkStore() {
+    {
+        std::lock_guard<std::mutex> lock(this->sweeper_mutex);
+        this->sweeper_stopping = true;
+    }
+    this->sweeper_cv.notify_all();
+    if (this->sweeper.joinable()) {
+        this->sweeper.join();
+    }
+}
+
+const std::string DFSChunkStore::ChunkPath(const std::string& hash) const {
+    std::string hex = HexDigest(hash);
+    return this->mount_path + DFS_CHUNK_DIR + hex.substr(0, 2) + "/" + hex;
+}
+
+const std::string DFSChunkStore::ManifestPath(const std::string& id) const {
+    return this->mount_path + DFS_MANIFEST_DIR + id;
+}
+
+bool DFSChunkStore::Has(const std::string& hash) const {
+    return hash.size() == DFS_CHUNK_HASH_SIZE && Reuse(hash);
+}
+
+bool DFSChunkStore::Reuse(const std::string& hash) const {
+    // Under the chunk mutex a sweep either dropped the chunk already or
+    // will see the fresh mtime
+    std::lock_guard<std::mutex> lock(this->chunk_mutex);
+    return utimes(ChunkPath(hash).c_str(), nullptr) == 0;
+}
+
+bool DFSChunkStore::Recent(const std::string& path, time_t now) const {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && st.st_mtime > now - DFS_CHUNK_GRACE;
+}
+
+void DFSChunkStore::Pin(const std::string& id) const {
+    std::lock_guard<std::mutex> lock(this->pin_mutex);
+    this->pinned_manifests[id]++;
+}
+
+void DFSChunkStore::Unpin(const std::string& id) const {
+    std::lock_guard<std::mutex> lock(this->pin_mutex);
+    auto pin = this->pinned_manifests.find(id);
+    if (pin != this->pinned_manifests.end() && --pin->second == 0) {
+        this->pinned_manifests.erase(pin);
+    }
+}
+
+bool DFSChunkStore::Read(const std::string& hash, std::string* data) const {
+    if (hash.size() != DFS_CHUNK_HASH_SIZE) {
+        return false;
+    }
+    int fd = open(ChunkPath(hash).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size <= DFS_CDC_MAX_CHUNK;
+    if (ok) {
+        data->resize(st.st_size);
+        ok = ReadFully(fd, &(*data)[0], data->size());
+    }
+    close(fd);
+    return ok;
+}
+
+bool DFSChunkStore::Put(const std::string& hash, const char* data, size_t length, bool* created) {
+    std::string chunk_path = ChunkPath(hash);
+    *created = false;
+    {
+        std::lock_guard<std::mutex> lock(this->chunk_mutex);
+        this->held_chunks[HexDigest(hash)]++;
+        if (utimes(chunk_path.c_str(), nullptr) == 0) {
+            return true;
+        }
+    }
+
+    // Publish complete chunks only; a racing upload of the same chunk
+    // renames identical bytes over it
+    std::string staging = chunk_path + ".XXXXXX";
+    int fd = mkstemp(&staging[0]);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = WriteFully(fd, data, length) &&
+        (this->durability == DURABILITY_NONE || fdatasync(fd) == 0);
+    close(fd);
+    if (!written || rename(staging.c_str(), chunk_path.c_str()) != 0) {
+        unlink(staging.c_str());
+        return false;
+    }
+    *created = true;
+    return true;
+}
+
+void DFSChunkStore::Release(const std::vector<std::string>& hashes) {
+    std::lock_guard<std::mutex> lock(this->chunk_mutex);
+    for (const std::string& hex : hashes) {
+        auto held = this->held_chunks.find(hex);
+        if (held != this->held_chunks.end() && --held->second == 0) {
+            this->held_chunks.erase(held);
+        }
+    }
+}
+
+std::string DFSChunkStore::ManifestId(const std::string& path) const {
+    char id[65];
+    ssize_t length = getxattr(path.c_str(), DFS_MANIFEST_XATTR, id, sizeof(id) - 1);
+    if (length <= 0) {
+        return "";
+    }
+    std::string manifest_id(id, length);
+    return DFSValidTransferId(manifest_id) ? manifest_id : "";
+}
+
+std::string DFSChunkStore::ManifestId(int fd) const {
+    char id[65];
+    ssize_t length = fgetxattr(fd, DFS_MANIFEST_XATTR, id, sizeof(id) - 1);
+    if (length <= 0) {
+        return "";
+    }
+    std::string manifest_id(id, length);
+    return DFSValidTransferId(manifest_id) ? manifest_id : "";
+}
+
+bool DFSChunkStore::LoadManifest(const std::string& id, uint64_t* size, std::vector<DFSContentChunk>* chunks) const {
+    std::ifstream in(ManifestPath(id), std::ios::binary);
+    DFSManifestHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != DFS_MANIFEST_MAGIC) {
+        return false;
+    }
+
+    chunks->clear();
+    chunks->reserve(header.count);
+    uint64_t offset = 0;
+    char hash[DFS_CHUNK_HASH_SIZE];
+    for (uint32_t i = 0; i < header.count; i++) {
+        DFSContentChunk chunk;
+        if (!in.read(hash, sizeof(hash)) || !in.read(reinterpret_cast<char*>(&chunk.length), sizeof(chunk.length))) {
+            return false;
+        }
+        chunk.offset = offset;
+        chunk.hash.assign(hash, sizeof(hash));
+        offset += chunk.length;
+        chunks->push_back(std::move(chunk));
+    }
+    *size = header.size;
+    return offset == header.size;
+}
+
+bool DFSChunkStore::Deduplicate(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    if (st.st_size < DFS_DEDUP_MIN_FILE) {
+        return true;
+    }
+
+    // Chunks stay held until the manifest, new enough to be spared by
+    // sweeps, refers to them
+    std::vector<std::string> held;
+    bool stored_manifest = StoreManifest(path, st, &held);
+    Release(held);
+    return stored_manifest;
+}
+
+bool DFSChunkStore::StoreManifest(const std::string& path, const struct stat& st, std::vector<std::string>* held) {
+    std::vector<DFSContentChunk> chunks;
+    std::set<std::string> new_chunk_dirs;
+    size_t stored = 0;
+    bool chunked = DFSChunkFile(path, &chunks, [&](const DFSContentChunk& chunk, const char* data) {
+        bool created;
+        held->push_back(HexDigest(chunk.hash));
+        if (!Put(chunk.hash, data, chunk.length, &created)) {
+            return false;
+        }
+        if (created) {
+            stored += chunk.length;
+            new_chunk_dirs.insert(HexDigest(chunk.hash).substr(0, 2));
+        }
+        return true;
+    });
+    if (!chunked) {
+        dfs_log(LL_ERROR) << "Could not move " << path << " into the chunk store";
+        return false;
+    }
+
+    // Put synced each new chunk's data; sync the directories naming them
+    // before the manifest refers to them
+    if (this->durability != DURABILITY_NONE) {
+        for (const std::string& prefix : new_chunk_dirs) {
+            int dir_fd = open((this->mount_path + DFS_CHUNK_DIR + prefix).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dir_fd >= 0) {
+                fsync(dir_fd);
+                close(dir_fd);
+            }
+        }
+    }
+
+    std::random_device random;
+    std::ostringstream id_stream;
+    id_stream << std::hex << std::setfill('0') << std::setw(8) << random() << std::setw(8) << random();
+    std::string id = id_stream.str();
+
+    std::string manifest;
+    DFSManifestHeader header = {DFS_MANIFEST_MAGIC, static_cast<uint32_t>(chunks.size()),
+                                static_cast<uint64_t>(st.st_size)};
+    manifest.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (const DFSContentChunk& chunk : chunks) {
+        manifest.append(chunk.hash);
+        manifest.append(reinterpret_cast<const char*>(&chunk.length), sizeof(chunk.length));
+    }
+
+    std::string manifest_path = ManifestPath(id);
+    int manifest_fd = open(manifest_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (manifest_fd < 0) {
+        return false;
+    }
+    bool written = WriteFully(manifest_fd, manifest.data(), manifest.size()) &&
+        (this->durability == DURABILITY_NONE || fdatasync(manifest_fd) == 0);
+    close(manifest_fd);
+
+    // Mark the file before dropping its blocks so that it is always
+    // readable one way or the other
+    int fd = written ? open(path.c_str(), O_WRONLY | O_CLOEXEC) : -1;
+    if (fd < 0 || fsetxattr(fd, DFS_MANIFEST_XATTR, id.data(), id.size(), 0) != 0) {
+        dfs_log(LL_ERROR) << "Could not mark " << path << " as deduplicated: " << strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(manifest_path.c_str());
+        return false;
+    }
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, st.st_size) != 0) {
+        dfs_log(LL_ERROR) << "Could not release the blocks of " << path;
+    }
+    close(fd);
+
+    dfs_log(LL_DEBUG) << "Deduplicated " << path << ": " << chunks.size() << " chunks, "
+                      << stored << " of " << st.st_size << " bytes new";
+    return true;
+}
+
+std::unique_ptr<DFSFileReader> DFSChunkStore::OpenRead(int fd, uint64_t offset) const {
+    std::string id = ManifestId(fd);
+    if (id.empty()) {
+        return nullptr;
+    }
+
+    // Pin before loading: a sweep either dropped the manifest already, and
+    // the load fails, or keeps it and its chunks for as long as we read
+    Pin(id);
+    uint64_t size;
+    std::vector<DFSContentChunk> chunks;
+    if (!LoadManifest(id, &size, &chunks)) {
+        Unpin(id);
+        return nullptr;
+    }
+    return std::unique_ptr<DFSFileReader>(new DFSManifestReader(this, id, std::move(chunks), offset));
+}
+
+void DFSChunkStore::Sweep() {
+    std::set<std::string> live_manifests;
+    DIR* dir = opendir(this->mount_path.c_str());
+    if (!dir) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG) {
+            std::string id = ManifestId(this->mount_path + entry->d_name);
+            if (!id.empty()) {
+                live_manifests.insert(id);
+            }
+        }
+    }
+    closedir(dir);
+
+    // Mark every chunk a live, pinned or new manifest refers to; new ones
+    // may belong to a commit that happened after the scan above
+    time_t now = time(nullptr);
+    std::unordered_set<std::string> referenced;
+    size_t dropped_manifests = 0;
+    std::string manifest_dir = this->mount_path + DFS_MANIFEST_DIR;
+    dir = opendir(manifest_dir.c_str());
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type != DT_REG) {
+            continue;
+        }
+        std::string manifest_path = manifest_dir + entry->d_name;
+        bool keep = live_manifests.count(entry->d_name) > 0 || Recent(manifest_path, now);
+        if (!keep) {
+            std::lock_guard<std::mutex> lock(this->pin_mutex);
+            keep = this->pinned_manifests.count(entry->d_name) > 0;
+            if (!keep) {
+                unlink(manifest_path.c_str());
+                dropped_manifests++;
+                continue;
+            }
+        }
+        uint64_t size;
+        std::vector<DFSContentChunk> chunks;
+        if (!LoadManifest(entry->d_name, &size, &chunks)) {
+            continue;
+        }
+        for (const DFSContentChunk& chunk : chunks) {
+            referenced.insert(HexDigest(chunk.hash));
+        }
+    }
+    closedir(dir);
+
+    // Sweep the rest, along with chunks left half-written by a crash. Chunks
+    // touched within the grace period may belong to an upload in flight.
+    size_t dropped_chunks = 0;
+    for (int prefix = 0; prefix < 256; prefix++) {
+        std::string chunk_dir = this->mount_path + DFS_CHUNK_DIR + HexDigest(std::string(1, static_cast<char>(prefix))) + "/";
+        dir = opendir(chunk_dir.c_str());
+        if (!dir) {
+            continue;
+        }
+        while ((entry = readdir(dir)) != nullptr) {
+            if (entry->d_type != DT_REG || referenced.count(entry->d_name) > 0) {
+                continue;
+            }
+            std::string chunk_path = chunk_dir + entry->d_name;
+            std::lock_guard<std::mutex> lock(this->chunk_mutex);
+            std::string hex(entry->d_name, strcspn(entry->d_name, "."));
+            if (this->held_chunks.count(hex) == 0 && !Recent(chunk_path, now)) {
+                unlink(chunk_path.c_str());
+                dropped_chunks++;
+            }
+        }
+        closedir(dir);
+    }
+
+    dfs_log(LL_SYSINFO) << "Chunk store holds " << referenced.size() << " chunks for "
+                        << live_manifests.size() << " files; dropped " << dropped_chunks
+                        << " chunks and " << dropped_manifests << " manifests";
+}
+
+void DFSChunkStore::SweepEvery(int seconds) {
+    this->sweeper = std::thread([this, seconds]() {
+        std::unique_lock<std::mutex> lock(this->sweeper_mutex);
+        while (!this->sweeper_cv.wait_for(lock, std::chrono::seconds(seconds),
+                                          [this]() { return this->sweeper_stopping; })) {
+            lock.unlock();
+            Sweep();
+            lock.lock();
+        }
+    });
+}
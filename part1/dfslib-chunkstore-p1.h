@@ -0,0 +1,207 @@
+#ifndef _DFSLIB_CHUNKSTORE_H
+#define _DFSLIB_CHUNKSTORE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include <sys/stat.h>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-fileio-p1.h"
+
+#define DFS_CHUNK_DIR ".dfs-chunks/"            // unique chunks, named by the hex of their hash
+#define DFS_MANIFEST_DIR ".dfs-manifests/"      // per-file chunk lists
+#define DFS_MANIFEST_XATTR "user.dfs.manifest"  // manifest id of a deduplicated file
+#define DFS_DEDUP_MIN_FILE (64 * 1024)          // smaller files are kept flat
+#define DFS_CHUNK_SWEEP_INTERVAL 300            // seconds between sweeps while the server runs
+#define DFS_CHUNK_GRACE 600                     // seconds a new or reused chunk or manifest is safe from sweeps
+
+/**
+ * Content-addressed chunk store for deduplicating stored files.
+ *
+ * A deduplicated file keeps its name, size and times in the mount path
+ * as a sparse placeholder whose DFS_MANIFEST_XATTR names a manifest in
+ * DFS_MANIFEST_DIR. The manifest lists the file's content-defined chunks,
+ * and each unique chunk is stored once in DFS_CHUNK_DIR. Since List, Stat
+ * and the commit rename only look at the placeholder, they work unchanged.
+ * Only reads have to go through OpenRead.
+ *
+ * Sweep collects manifests no file refers to, once their file has been
+ * replaced or deleted, and then chunks no manifest refers to. It runs when
+ * the server starts and then every DFS_CHUNK_SWEEP_INTERVAL seconds, so
+ * it never races the commit that replaces a file. A sweep spares:
+ *  - chunks of uploads still being deduplicated;
+ *  - manifests and chunks written or reused within DFS_CHUNK_GRACE
+ *    seconds, so a just-committed file and chunks a client was just told
+ *    about are safe;
+ *  - manifests an open reader is streaming, along with their chunks.
+ */
+class DFSChunkStore {
+
+private:
+    std::string mount_path;
+    dfs_durability_e durability;
+
+    /** Orders chunk reuse against a sweep deciding whether to drop the chunk **/
+    mutable std::mutex chunk_mutex;
+
+    /** Chunks of uploads being deduplicated, which have no manifest yet **/
+    std::map<std::string, int> held_chunks;
+
+    /** Open readers of each manifest, which a sweep must keep **/
+    mutable std::mutex pin_mutex;
+    mutable std::map<std::string, int> pinned_manifests;
+
+    /** Runs Sweep periodically until the store is destroyed **/
+    std::thread sweeper;
+    std::mutex sweeper_mutex;
+    std::condition_variable sweeper_cv;
+    bool sweeper_stopping;
+
+    const std::string ChunkPath(const std::string& hash) const;
+    const std::string ManifestPath(const std::string& id) const;
+
+    /**
+     * Store a chunk unless it is already present, and hold it against
+     * sweeps until Release
+     *
+     * @param hash
+     * @param data
+     * @param length
+     * @param created set if the chunk was new
+     * @return
+     */
+    bool Put(const std::string& hash, const char* data, size_t length, bool* created);
+
+    /**
+     * Chunk a flat file into the store and write its manifest, marking
+     * the file as deduplicated
+     *
+     * @param path
+     * @param st the file's attributes
+     * @param held set to the chunks Put holds
+     * @return
+     */
+    bool StoreManifest(const std::string& path, const struct stat& st, std::vector<std::string>* held);
+
+    /**
+     * Let sweeps collect chunks again once a manifest refers to them
+     *
+     * @param hashes hex digests
+     */
+    void Release(const std::vector<std::string>& hashes);
+
+    /**
+     * Touch a stored chunk so that sweeps spare it for DFS_CHUNK_GRACE seconds
+     *
+     * @param hash
+     * @return false if the chunk isn't stored
+     */
+    bool Reuse(const std::string& hash) const;
+
+    /**
+     * Keep a manifest and its chunks through sweeps while a reader has it open
+     *
+     * @param id
+     */
+    void Pin(const std::string& id) const;
+    void Unpin(const std::string& id) const;
+
+    /**
+     * Whether a manifest or chunk was written or reused within DFS_CHUNK_GRACE seconds
+     *
+     * @param path
+     * @param now
+     * @return
+     */
+    bool Recent(const std::string& path, time_t now) const;
+
+    /**
+     * Read a manifest's chunk list
+     *
+     * @param id
+     * @param size set to the file's size
+     * @param chunks
+     * @return
+     */
+    bool LoadManifest(const std::string& id, uint64_t* size, std::vector<DFSContentChunk>* chunks) const;
+
+    friend class DFSManifestReader;
+
+public:
+    DFSChunkStore(const std::string& mount_path, dfs_durability_e durability);
+    ~DFSChunkStore();
+
+    /**
+     * Whether a chunk is stored. A stored chunk is spared by sweeps for
+     * DFS_CHUNK_GRACE seconds, so an upload can refer to it.
+     *
+     * @param hash raw digest
+     * @return
+     */
+    bool Has(const std::string& hash) const;
+
+    /**
+     * Read a stored chunk
+     *
+     * @param hash raw digest
+     * @param data
+     * @return false if the chunk isn't stored
+     */
+    bool Read(const std::string& hash, std::string* data) const;
+
+    /**
+     * The manifest id of a deduplicated file
+     *
+     * @param path
+     * @return empty if the file is stored flat
+     */
+    std::string ManifestId(const std::string& path) const;
+
+    /**
+     * The manifest id of an open file
+     *
+     * @param fd
+     * @return empty if the file is stored flat
+     */
+    std::string ManifestId(int fd) const;
+
+    /**
+     * Move a flat file's contents into the store, leaving a placeholder
+     * at `path`. Files below DFS_DEDUP_MIN_FILE are left as they are.
+     *
+     * @param path
+     * @return false if the file is unchanged because the store failed
+     */
+    bool Deduplicate(const std::string& path);
+
+    /**
+     * Open a deduplicated file for reading from `offset`. The manifest is
+     * taken from the open file, so it belongs to the version opened.
+     *
+     * @param fd
+     * @param offset
+     * @return nullptr if the file isn't deduplicated or its manifest is gone
+     */
+    std::unique_ptr<DFSFileReader> OpenRead(int fd, uint64_t offset) const;
+
+    /**
+     * Drop manifests without a placeholder and chunks without a manifest
+     */
+    void Sweep();
+
+    /**
+     * Sweep every `seconds` on a background thread until destroyed
+     *
+     * @param seconds
+     */
+    void SweepEvery(int seconds);
+
+};
+
+#endif
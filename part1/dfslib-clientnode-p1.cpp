@@ -1,9 +1,14 @@
 #include <regex>
+#include <set>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <thread>
 #include <cstdio>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <errno.h>
 #include <csignal>
 #include <iostream>
@@ -11,9 +16,12 @@
 #include <fstream>
 #include <iomanip>
 #include <getopt.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 #include <grpcpp/grpcpp.h>
 
 #include "dfslib-shared-p1.h"
@@ -29,8 +37,18 @@ using grpc::ClientContext;
 
 using dfs_service::FileChunk;
 using dfs_service::FileName;
+using dfs_service::FileRange;
 using dfs_service::FileStatus;
+using dfs_service::FileStatuses;
 using dfs_service::FileList;
+using dfs_service::ListRequest;
+using dfs_service::FileListPage;
+using dfs_service::FileNames;
+using dfs_service::BatchChunk;
+using dfs_service::BatchStatus;
+using dfs_service::ChunkList;
+using dfs_service::TransferRequest;
+using dfs_service::TransferStatus;
 using dfs_service::Empty;
 
 //
@@ -45,8 +63,193 @@ using dfs_service::Empty;
 //      using dfs_service::MyMethod
 //
 
+/**
+ * The chunk ceiling a server advertised in its initial metadata
+ *
+ * @param context a call whose initial metadata has arrived
+ * @param limit set to the advertised ceiling
+ * @return false if none was advertised or the value is malformed
+ */
+static bool ServerChunkLimit(const ClientContext& context, size_t* limit) {
+    auto metadata = context.GetServerInitialMetadata().find(DFS_CHUNK_SIZE_METADATA);
+    if (metadata == context.GetServerInitialMetadata().end()) {
+        return false;
+    }
+    std::string value(metadata->second.data(), metadata->second.size());
+    char* end = nullptr;
+    errno = 0;
+    unsigned long parsed = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || value[0] == '-' || *end != '\0' || errno == ERANGE || parsed == 0) {
+        dfs_log(LL_ERROR) << "Ignoring malformed chunk size from the server: " << value;
+        return false;
+    }
+    *limit = parsed;
+    return true;
+}
+
+/**
+ * The server version an interrupted fetch's sidecar holds a prefix of,
+ * kept in the sidecar's DFS_PARTIAL_XATTR
+ */
+struct DFSPartialVersion {
+    int64_t mtime_ns;
+    uint64_t generation;
+    uint64_t size;
+
+    DFSPartialVersion() : mtime_ns(0), generation(0), size(0) {}
+
+    bool Known() const {
+        return this->generation != 0;
+    }
+
+    bool Matches(const FileStatus& status) const {
+        return Known() && this->mtime_ns == status.mtime_ns() && this->generation == status.generation() &&
+            this->size == static_cast<uint64_t>(status.size());
+    }
+
+    bool Load(const std::string& path) {
+        char value[96];
+        ssize_t length = getxattr(path.c_str(), DFS_PARTIAL_XATTR, value, sizeof(value) - 1);
+        if (length <= 0) {
+            return false;
+        }
+        value[length] = '\0';
+        long long mtime_ns;
+        unsigned long long generation, size;
+        if (sscanf(value, "%lld:%llu:%llu", &mtime_ns, &generation, &size) != 3) {
+            return false;
+        }
+        this->mtime_ns = mtime_ns;
+        this->generation = generation;
+        this->size = size;
+        return Known();
+    }
+
+    bool Save(const std::string& path) const {
+        std::ostringstream value;
+        value << this->mtime_ns << ':' << this->generation << ':' << this->size;
+        std::string text = value.str();
+        return setxattr(path.c_str(), DFS_PARTIAL_XATTR, text.data(), text.size(), 0) == 0;
+    }
+};
+
+/**
+ * Reads a file on its own thread into a ring of chunk buffers so that
+ * disk reads overlap the gRPC writes draining the ring.
+ *
+ * The reader fills at most `depth` buffers ahead of the writer, each
+ * sized to the chunk size the writer last asked for. Buffers are reused
+ * as the writer releases them. The final buffer is flagged as the last;
+ * it may be empty so that empty files still produce one chunk.
+ */
+class DFSReadPipeline {
+
+private:
+    struct Slot {
+        std::vector<char> data;
+        size_t length;
+        bool last;
+    };
+
+    std::ifstream& infile;
+    std::vector<Slot> slots;
+    std::atomic<size_t> chunk_size;
+
+    std::mutex mutex;
+    std::condition_variable filled;
+    std::condition_variable released;
+
+    /** Buffers handed to the writer and buffers filled by the reader **/
+    size_t head;
+    size_t tail;
+    bool stopped;
+
+    std::thread reader;
+
+    void Run() {
+        bool last = false;
+        while (!last) {
+            Slot* slot;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->released.wait(lock, [this] { return this->stopped || this->tail - this->head < this->slots.size(); });
+                if (this->stopped) {
+                    return;
+                }
+                slot = &this->slots[this->tail % this->slots.size()];
+            }
+
+            size_t length = this->chunk_size.load();
+            if (slot->data.size() < length) {
+                slot->data.resize(length);
+            }
+            this->infile.read(slot->data.data(), length);
+            slot->length = this->infile.gcount();
+            slot->last = last = !this->infile;
+
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->tail++;
+            this->filled.notify_one();
+        }
+    }
+
+public:
+    DFSReadPipeline(std::ifstream& infile, size_t depth, size_t chunk_size) :
+        infile(infile), slots(std::max<size_t>(depth, 1)), chunk_size(chunk_size),
+        head(0), tail(0), stopped(false) {
+        this->reader = std::thread(&DFSReadPipeline::Run, this);
+    }
+
+    ~DFSReadPipeline() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopped = true;
+        }
+        this->released.notify_one();
+        this->reader.join();
+    }
+
+    /**
+     * Size the buffers read from now on
+     *
+     * @param chunk_size
+     */
+    void SetChunkSize(size_t chunk_size) {
+        this->chunk_size.store(chunk_size);
+    }
+
+    /**
+     * Wait for the next filled buffer. The view stays valid until Release.
+     *
+     * @param data
+     * @param length
+     * @return true if this is the last buffer of the file
+     */
+    bool Next(const char** data, size_t* length) {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->filled.wait(lock, [this] { return this->tail > this->head; });
+        const Slot& slot = this->slots[this->head % this->slots.size()];
+        *data = slot.data.data();
+        *length = slot.length;
+        return slot.last;
+    }
+
+    /**
+     * Hand the buffer returned by Next back to the reader
+     */
+    void Release() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->head++;
+        this->released.notify_one();
+    }
+
+};
+
 
-DFSClientNodeP1::DFSClientNodeP1() : DFSClientNode() {
+DFSClientNodeP1::DFSClientNodeP1() : DFSClientNode(),
+    max_chunk_size(DFS_MAX_CHUNK_SIZE), zero_copy_fetch(false), fetch_streams(DFS_FETCH_STREAMS), compress(false),
+    store_pipeline_depth(DFS_STORE_PIPELINE_DEPTH), dedup(false), list_page_size(DFS_LIST_PAGE_SIZE),
+    list_mtime_since(0) {
     // Default server address
     std::string server_address = "localhost:50051";
     auto channel = grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
@@ -86,7 +289,31 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename) {
         dfs_log(LL_ERROR) << "Could not open file for reading: " << filepath;
         return StatusCode::NOT_FOUND;
     }
+
+    // Pick up an interrupted upload of this exact file version where the
+    // server's partial copy ends
+    struct stat file_stat;
+    std::string transfer_id;
+    uint64_t offset = 0;
+    if (stat(filepath.c_str(), &file_stat) == 0) {
+        transfer_id = DFSTransferId(filename, file_stat);
+        offset = this->CommittedOffset(transfer_id);
+        if (offset > static_cast<uint64_t>(file_stat.st_size)) {
+            offset = 0;
+        }
+        if (offset > 0) {
+            dfs_log(LL_DEBUG) << "Resuming store of " << filename << " at offset " << offset;
+            infile.seekg(offset);
+        }
+    }
     
+    // A fresh upload can skip the chunks the server already holds
+    std::vector<DFSContentChunk> plan;
+    std::vector<bool> present;
+    if (this->dedup && offset == 0 && file_stat.st_size > 0) {
+        this->PlanDeduplicatedStore(filepath, &plan, &present);
+    }
+
     ClientContext context;
     // Set a deadline for this RPC call
     std::chrono::system_clock::time_point deadline = 
@@ -96,23 +323,115 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename) {
     FileStatus response;
     
     // Create a writer for streaming
+    auto stream_start = std::chrono::steady_clock::now();
     auto writer = this->service_stub->Store(&context, &response);
-    
-    // Read file in chunks and stream to server
-    char buffer[DFS_CHUNK_SIZE];
+
+    // The server advertises its chunk ceiling in the initial metadata; the
+    // time it takes to arrive doubles as our round trip estimate
+    DFSChunkSizer sizer(this->max_chunk_size);
+    writer->WaitForInitialMetadata();
+    sizer.RecordRoundTrip(std::chrono::steady_clock::now() - stream_start);
+    size_t server_limit;
+    if (ServerChunkLimit(context, &server_limit)) {
+        sizer.LimitCeiling(server_limit);
+    }
+
+    // Compress only if the server can decode it; the codec is settled on the first chunk
+    auto codecs = context.GetServerInitialMetadata().find(DFS_CODECS_METADATA);
+    bool compress = this->compress && codecs != context.GetServerInitialMetadata().end() &&
+        codecs->second.find("deflate") != grpc::string_ref::npos;
+    dfs_service::Codec codec = dfs_service::CODEC_NONE;
+    uint64_t start_offset = offset;
+
     FileChunk chunk;
     chunk.set_filename(filename);
-    
-    while (infile.read(buffer, DFS_CHUNK_SIZE) || infile.gcount() > 0) {
-        chunk.set_data(buffer, infile.gcount());
+    chunk.set_transfer_id(transfer_id);
+    if (!transfer_id.empty()) {
+        chunk.set_expected_size(file_stat.st_size);
+    }
+
+    // Runs of chunks the server holds go out as references and the rest
+    // as data, read straight from the file
+    bool codec_selected = false;
+    size_t next = 0;
+    while (next < plan.size()) {
+        uint64_t length = 0;
+        if (present[next]) {
+            while (next < plan.size() && present[next] && chunk.chunk_refs_size() < DFS_CHUNK_REFS_PER_MESSAGE) {
+                chunk.add_chunk_refs(plan[next].hash);
+                length += plan[next++].length;
+            }
+            chunk.clear_data();
+            chunk.set_codec(dfs_service::CODEC_NONE);
+            chunk.set_raw_size(0);
+        } else {
+            while (next < plan.size() && !present[next] &&
+                    (length == 0 || length + plan[next].length <= sizer.ChunkSize())) {
+                length += plan[next++].length;
+            }
+            std::string* data = chunk.mutable_data();
+            data->resize(length);
+            if (!infile.seekg(offset) || !infile.read(&(*data)[0], length)) {
+                dfs_log(LL_ERROR) << "Could not read file: " << filepath;
+                context.TryCancel();
+                break;
+            }
+            if (compress && !codec_selected) {
+                codec = DFSSelectCodec(filename, data->data(), length);
+                codec_selected = true;
+            }
+            DFSCompressChunk(&chunk, codec);
+        }
+        chunk.set_chunk_size(sizer.ChunkSize());
+        chunk.set_offset(offset);
+
+        auto write_start = std::chrono::steady_clock::now();
         if (!writer->Write(chunk)) {
             dfs_log(LL_ERROR) << "Failed to write chunk to server";
-            infile.close();
-            return StatusCode::CANCELLED;
+            break;
+        }
+        if (chunk.chunk_refs_size() == 0) {
+            sizer.RecordWrite(length, std::chrono::steady_clock::now() - write_start);
         }
+        offset += length;
+        chunk.clear_transfer_id();
+        chunk.clear_expected_size();
+        chunk.clear_chunk_refs();
+    }
+
+    // Otherwise read the file in adaptively sized chunks on a separate
+    // thread and stream them to the server as they fill. The first chunk
+    // always goes out so that empty files are created on the server.
+    std::unique_ptr<DFSReadPipeline> pipeline;
+    if (plan.empty()) {
+        pipeline.reset(new DFSReadPipeline(infile, this->store_pipeline_depth, sizer.ChunkSize()));
+    }
+
+    bool last = !plan.empty();
+    while (!last) {
+        const char* data;
+        size_t raw_size;
+        last = pipeline->Next(&data, &raw_size);
+        if (compress && offset == start_offset) {
+            codec = DFSSelectCodec(filename, data, raw_size);
+        }
+        chunk.set_data(data, raw_size);
+        chunk.set_chunk_size(sizer.ChunkSize());
+        chunk.set_offset(offset);
+        pipeline->Release();
+        DFSCompressChunk(&chunk, codec);
+
+        auto write_start = std::chrono::steady_clock::now();
+        if (!writer->Write(chunk)) {
+            dfs_log(LL_ERROR) << "Failed to write chunk to server";
+            break;
+        }
+        sizer.RecordWrite(raw_size, std::chrono::steady_clock::now() - write_start);
+        pipeline->SetChunkSize(sizer.ChunkSize());
+        offset += raw_size;
+        chunk.clear_transfer_id();
+        chunk.clear_expected_size();
     }
-    
-    infile.close();
     
     // Close the writer and get the response
     writer->WritesDone();
@@ -127,7 +446,7 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename) {
         return StatusCode::CANCELLED;
     }
     
-    dfs_log(LL_DEBUG) << "File stored successfully: " << filename;
+    dfs_log(LL_DEBUG) << "File stored successfully: " << filename << " (chunk size " << response.chunk_size() << ")";
     return StatusCode::OK;
 }
 
@@ -154,55 +473,321 @@ StatusCode DFSClientNodeP1::Fetch(const std::string &filename) {
     //
     //
 
+    // The server's copy decides both whether a partial download can be
+    // resumed and whether the file is large enough to split into ranges
+    FileStatus file_status;
+    StatusCode stat_code = this->Stat(filename, &file_status);
+    if (stat_code == StatusCode::NOT_FOUND || stat_code == StatusCode::DEADLINE_EXCEEDED) {
+        return stat_code;
+    }
+    bool resumable = stat_code == StatusCode::OK;
+
+    // Large files are split into byte ranges that download concurrently
+    if (resumable && this->fetch_streams > 1 && file_status.size() >= DFS_PARALLEL_FETCH_THRESHOLD) {
+        return this->FetchRanges(filename, file_status);
+    }
+
     ClientContext context;
     // Set a deadline for this RPC call
     std::chrono::system_clock::time_point deadline = 
         std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);  // ✅ Use this->deadline_timeout
     context.set_deadline(deadline);
-    
-    FileName request;
-    request.set_name(filename);
-    
-    dfs_log(LL_DEBUG) << "Fetching file: " << filename;
-    
-    // Open file for writing
+
+    // Download into a sidecar that is renamed over the file once complete.
+    // A sidecar tagged with the server's current version holds a prefix of
+    // it and is resumed rather than downloaded again; the server refuses the
+    // range if the file changes before it is opened.
     std::string filepath = this->MountPath() + filename;
-    std::ofstream outfile(filepath, std::ios::binary);
+    std::string partial_path = filepath + DFS_PARTIAL_SUFFIX;
+    uint64_t offset = 0;
+    DFSPartialVersion version;
+    struct stat partial_stat;
+    if (resumable && version.Load(partial_path) && version.Matches(file_status) &&
+            stat(partial_path.c_str(), &partial_stat) == 0 &&
+            static_cast<uint64_t>(partial_stat.st_size) <= version.size) {
+        offset = partial_stat.st_size;
+    } else {
+        version = DFSPartialVersion();
+    }
+
+    std::ofstream outfile(partial_path, std::ios::binary | (offset > 0 ? std::ios::app : std::ios::trunc));
     if (!outfile.is_open()) {
-        dfs_log(LL_ERROR) << "Could not open file for writing: " << filepath;
+        dfs_log(LL_ERROR) << "Could not open file for writing: " << partial_path;
         return StatusCode::CANCELLED;
     }
+
+    std::unique_ptr<grpc::ClientReader<FileChunk>> reader;
+    if (offset > 0) {
+        dfs_log(LL_DEBUG) << "Resuming fetch of " << filename << " at offset " << offset;
+        FileRange request;
+        request.set_name(filename);
+        request.set_offset(offset);
+        request.set_chunk_size(this->max_chunk_size);
+        request.set_codec(this->compress ? dfs_service::CODEC_DEFLATE : dfs_service::CODEC_NONE);
+        request.set_mtime_ns(version.mtime_ns);
+        request.set_generation(version.generation);
+        reader = this->service_stub->FetchRange(&context, request);
+    } else {
+        dfs_log(LL_DEBUG) << "Fetching file: " << filename;
+        FileName request;
+        request.set_name(filename);
+        request.set_chunk_size(this->max_chunk_size);
+        request.set_codec(this->compress ? dfs_service::CODEC_DEFLATE : dfs_service::CODEC_NONE);
+        // FetchMapped sends the same chunks, always raw
+        reader = this->zero_copy_fetch ?
+            this->service_stub->FetchMapped(&context, request) :
+            this->service_stub->Fetch(&context, request);
+    }
     
-    // Create a reader for streaming
-    auto reader = this->service_stub->Fetch(&context, request);
-    
+    // The first chunk names the version the stream comes from, which may
+    // be newer than the one Stat saw
     FileChunk chunk;
+    uint32_t chunk_size = 0;
+    uint64_t received = offset;
+    bool first = true;
     while (reader->Read(&chunk)) {
+        if (first) {
+            first = false;
+            if (chunk.generation() != 0) {
+                DFSPartialVersion sent;
+                sent.mtime_ns = chunk.mtime_ns();
+                sent.generation = chunk.generation();
+                sent.size = chunk.file_size();
+                if (offset > 0 && (sent.mtime_ns != version.mtime_ns || sent.generation != version.generation)) {
+                    dfs_log(LL_ERROR) << "Server sent a different version of " << filename << " to resume";
+                    context.TryCancel();
+                    break;
+                }
+                version = sent;
+            }
+        }
+        if (!DFSDecompressChunk(&chunk, this->max_chunk_size)) {
+            dfs_log(LL_ERROR) << "Could not decode chunk of " << filename;
+            context.TryCancel();
+            break;
+        }
         if (!chunk.data().empty()) {
             outfile.write(chunk.data().data(), chunk.data().size());
+            received += chunk.data().size();
         }
+        chunk_size = std::max(chunk_size, chunk.chunk_size());
     }
     
     outfile.close();
     
     Status status = reader->Finish();
+    if (status.error_code() == StatusCode::FAILED_PRECONDITION && offset > 0) {
+        // The file changed since the sidecar was started; the prefix is useless
+        dfs_log(LL_DEBUG) << filename << " changed on the server, restarting its fetch";
+        unlink(partial_path.c_str());
+        return Fetch(filename);
+    }
     if (!status.ok()) {
+        // Keep what arrived for the next attempt, tagged with the version it belongs to
+        if (!version.Known() || outfile.fail() || !version.Save(partial_path)) {
+            unlink(partial_path.c_str());
+        }
+
         if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
             dfs_log(LL_ERROR) << "Deadline exceeded for fetch operation";
             return StatusCode::DEADLINE_EXCEEDED;
         }
         if (status.error_code() == StatusCode::NOT_FOUND) {
             dfs_log(LL_ERROR) << "File not found on server: " << filename;
+            unlink(partial_path.c_str());
             return StatusCode::NOT_FOUND;
         }
         dfs_log(LL_ERROR) << "Fetch failed: " << status.error_message();
         return StatusCode::CANCELLED;
     }
+
+    uint64_t expected_size = version.Known() ? version.size : static_cast<uint64_t>(file_status.size());
+    if (outfile.fail() || ((resumable || version.Known()) && received != expected_size)) {
+        dfs_log(LL_ERROR) << "Fetch of " << filename << " ended with " << received << " of "
+                          << expected_size << " bytes";
+        unlink(partial_path.c_str());
+        return StatusCode::CANCELLED;
+    }
+    removexattr(partial_path.c_str(), DFS_PARTIAL_XATTR);
+    if (rename(partial_path.c_str(), filepath.c_str()) != 0) {
+        dfs_log(LL_ERROR) << "Could not move fetched file into place: " << filepath;
+        return StatusCode::CANCELLED;
+    }
     
-    dfs_log(LL_DEBUG) << "File fetched successfully: " << filename;
+    dfs_log(LL_DEBUG) << "File fetched successfully: " << filename << " (chunk size " << chunk_size << ")";
     return StatusCode::OK;
 }
 
+StatusCode DFSClientNodeP1::StoreMany(const std::vector<std::string>& filenames,
+                                      std::map<std::string, StatusCode>* results) {
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    dfs_log(LL_DEBUG) << "Storing batch of " << filenames.size() << " files";
+
+    BatchStatus response;
+    auto writer = this->service_stub->StoreMany(&context, &response);
+
+    size_t chunk_limit = this->max_chunk_size;
+    writer->WaitForInitialMetadata();
+    size_t server_limit;
+    if (ServerChunkLimit(context, &server_limit)) {
+        chunk_limit = std::min(chunk_limit, server_limit);
+    }
+
+    // Small files make for small messages; let gRPC coalesce them
+    grpc::WriteOptions options;
+    options.set_buffer_hint();
+
+    bool all_ok = true;
+    BatchChunk chunk;
+    for (const std::string& filename : filenames) {
+        std::ifstream infile(this->MountPath() + filename, std::ios::binary);
+        if (!infile.is_open()) {
+            dfs_log(LL_ERROR) << "Could not open file for reading: " << this->MountPath() + filename;
+            if (results) {
+                (*results)[filename] = StatusCode::NOT_FOUND;
+            }
+            all_ok = false;
+            continue;
+        }
+
+        // Each file goes out whole in one message unless it exceeds the chunk limit
+        chunk.set_filename(filename);
+        do {
+            std::string* data = chunk.mutable_data();
+            data->resize(chunk_limit);
+            infile.read(&(*data)[0], chunk_limit);
+            data->resize(infile.gcount());
+            chunk.set_last(!infile);
+            if (!writer->Write(chunk, options)) {
+                break;
+            }
+            chunk.clear_filename();
+        } while (infile);
+        if (infile) {
+            dfs_log(LL_ERROR) << "Failed to write batch to server";
+            break;
+        }
+    }
+
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            dfs_log(LL_ERROR) << "Deadline exceeded for store-many operation";
+            return StatusCode::DEADLINE_EXCEEDED;
+        }
+        dfs_log(LL_ERROR) << "Store-many failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    for (const auto& result : response.results()) {
+        StatusCode code = static_cast<StatusCode>(result.code());
+        if (code != StatusCode::OK) {
+            dfs_log(LL_ERROR) << "Could not store " << result.status().filename() << " (code " << code << ")";
+            all_ok = false;
+        }
+        if (results) {
+            (*results)[result.status().filename()] = code;
+        }
+    }
+
+    dfs_log(LL_DEBUG) << "Stored " << response.results_size() << " of " << filenames.size() << " files";
+    return all_ok ? StatusCode::OK : StatusCode::CANCELLED;
+}
+
+StatusCode DFSClientNodeP1::FetchMany(const std::vector<std::string>& filenames,
+                                      std::map<std::string, StatusCode>* results) {
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    dfs_log(LL_DEBUG) << "Fetching batch of " << filenames.size() << " files";
+
+    FileNames request;
+    for (const std::string& filename : filenames) {
+        request.add_names(filename);
+    }
+    request.set_chunk_size(this->max_chunk_size);
+    auto reader = this->service_stub->FetchMany(&context, request);
+
+    // Each file is downloaded into its sidecar and renamed into place once
+    // its last message arrives
+    bool all_ok = true;
+    size_t fetched = 0;
+    std::string filename;
+    std::ofstream outfile;
+    BatchChunk chunk;
+    while (reader->Read(&chunk)) {
+        if (!chunk.filename().empty()) {
+            filename = chunk.filename();
+            if (chunk.code() == StatusCode::OK) {
+                outfile.open(this->MountPath() + filename + DFS_PARTIAL_SUFFIX, std::ios::binary | std::ios::trunc);
+            }
+        }
+        if (outfile.is_open() && !chunk.data().empty()) {
+            outfile.write(chunk.data().data(), chunk.data().size());
+        }
+        if (!chunk.last()) {
+            continue;
+        }
+
+        StatusCode code = static_cast<StatusCode>(chunk.code());
+        std::string filepath = this->MountPath() + filename;
+        std::string partial_path = filepath + DFS_PARTIAL_SUFFIX;
+        if (outfile.is_open()) {
+            outfile.close();
+            if (code == StatusCode::OK && (outfile.fail() || rename(partial_path.c_str(), filepath.c_str()) != 0)) {
+                dfs_log(LL_ERROR) << "Could not write fetched file: " << filepath;
+                code = StatusCode::CANCELLED;
+            }
+            if (code != StatusCode::OK) {
+                unlink(partial_path.c_str());
+            }
+        } else if (code == StatusCode::OK) {
+            dfs_log(LL_ERROR) << "Could not open file for writing: " << partial_path;
+            code = StatusCode::CANCELLED;
+        }
+        outfile.clear();
+
+        if (code == StatusCode::OK) {
+            fetched++;
+        } else {
+            dfs_log(LL_ERROR) << "Could not fetch " << filename << " (code " << code << ")";
+            all_ok = false;
+        }
+        if (results) {
+            (*results)[filename] = code;
+        }
+    }
+
+    // A file cut off by a failed stream is not renamed into place
+    if (outfile.is_open()) {
+        outfile.close();
+        unlink((this->MountPath() + filename + DFS_PARTIAL_SUFFIX).c_str());
+    }
+
+    Status status = reader->Finish();
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            dfs_log(LL_ERROR) << "Deadline exceeded for fetch-many operation";
+            return StatusCode::DEADLINE_EXCEEDED;
+        }
+        dfs_log(LL_ERROR) << "Fetch-many failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    dfs_log(LL_DEBUG) << "Fetched " << fetched << " of " << filenames.size() << " files";
+    return all_ok ? StatusCode::OK : StatusCode::CANCELLED;
+}
+
 StatusCode DFSClientNodeP1::Delete(const std::string& filename) {
 
     //
@@ -273,19 +858,39 @@ StatusCode DFSClientNodeP1::List(std::map<std::string,int>* file_map, bool displ
     // StatusCode::CANCELLED otherwise
     //
     //
-        ClientContext context;
-    // Set a deadline for this RPC call
-    std::chrono::system_clock::time_point deadline = 
-        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);  // ✅ Use this->deadline_timeout
-    context.set_deadline(deadline);
-    
-    Empty request;
-    FileList response;
-    
+    // The listing arrives as a stream of pages, so a large directory is
+    // never held in one message and is shown as it is read.
+    //
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout));
+
+    ListRequest request;
+    FillListRequest(&request);
+
     dfs_log(LL_DEBUG) << "Listing files from server";
-    
-    Status status = service_stub->List(&context, request, &response);
-    
+
+    if (file_map != nullptr) {
+        file_map->clear();
+    }
+    if (display) {
+        std::cout << "File Listing:" << std::endl;
+    }
+
+    std::unique_ptr<ClientReader<FileListPage>> reader(this->service_stub->ListStream(&context, request));
+    FileListPage page;
+    while (reader->Read(&page)) {
+        for (const auto& file_info : page.files()) {
+            if (file_map != nullptr) {
+                (*file_map)[file_info.name()] = file_info.mtime();
+            }
+            if (display) {
+                std::cout << "  " << file_info.name() << " (mtime: " << file_info.mtime() << ")" << std::endl;
+            }
+            dfs_log(LL_DEBUG) << "  Listed file: " << file_info.name() << " (mtime: " << file_info.mtime() << ")";
+        }
+    }
+
+    Status status = reader->Finish();
     if (!status.ok()) {
         if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
             dfs_log(LL_ERROR) << "Deadline exceeded for list operation";
@@ -294,25 +899,51 @@ StatusCode DFSClientNodeP1::List(std::map<std::string,int>* file_map, bool displ
         dfs_log(LL_ERROR) << "List failed: " << status.error_message();
         return StatusCode::CANCELLED;
     }
-    
-    // Fill the file_map with results
+
+    dfs_log(LL_DEBUG) << "File listing retrieved successfully";
+    return StatusCode::OK;
+}
+
+void DFSClientNodeP1::FillListRequest(ListRequest* request) const {
+    request->set_page_size(static_cast<uint32_t>(this->list_page_size));
+    request->set_prefix(this->list_prefix);
+    request->set_pattern(this->list_pattern);
+    request->set_mtime_since(this->list_mtime_since);
+}
+
+StatusCode DFSClientNodeP1::ListPage(const std::string& cursor, std::map<std::string,int>* file_map,
+                                     std::string* next_cursor) {
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout));
+
+    ListRequest request;
+    FillListRequest(&request);
+    request.set_cursor(cursor);
+
+    FileListPage response;
+    Status status = this->service_stub->ListPage(&context, request, &response);
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            dfs_log(LL_ERROR) << "Deadline exceeded for list operation";
+            return StatusCode::DEADLINE_EXCEEDED;
+        }
+        if (status.error_code() == StatusCode::NOT_FOUND || status.error_code() == StatusCode::INVALID_ARGUMENT) {
+            dfs_log(LL_ERROR) << "Listing cursor rejected: " << status.error_message();
+            return status.error_code();
+        }
+        dfs_log(LL_ERROR) << "List failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
     if (file_map != nullptr) {
-        file_map->clear();
         for (const auto& file_info : response.files()) {
             (*file_map)[file_info.name()] = file_info.mtime();
-            dfs_log(LL_DEBUG) << "  Listed file: " << file_info.name() << " (mtime: " << file_info.mtime() << ")";
         }
     }
-    
-    // Optionally display the listing
-    if (display) {
-        std::cout << "File Listing:" << std::endl;
-        for (const auto& file_info : response.files()) {
-            std::cout << "  " << file_info.name() << " (mtime: " << file_info.mtime() << ")" << std::endl;
-        }
+    if (next_cursor != nullptr) {
+        *next_cursor = response.next_cursor();
     }
-    
-    dfs_log(LL_DEBUG) << "File listing retrieved successfully";
+    dfs_log(LL_DEBUG) << "Listed page of " << response.files_size() << " files";
     return StatusCode::OK;
 }
 
@@ -383,6 +1014,41 @@ StatusCode DFSClientNodeP1::Stat(const std::string &filename, void* file_status)
     return StatusCode::OK;
 }
 
+StatusCode DFSClientNodeP1::StatMany(const std::vector<std::string>& filenames,
+                                     std::map<std::string, FileStatus>* statuses) {
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout));
+
+    FileNames request;
+    for (const std::string& filename : filenames) {
+        request.add_names(filename);
+    }
+
+    FileStatuses response;
+    dfs_log(LL_DEBUG) << "Getting status for " << filenames.size() << " files";
+    Status status = this->service_stub->StatMany(&context, request, &response);
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            dfs_log(LL_ERROR) << "Deadline exceeded for stat operation";
+            return StatusCode::DEADLINE_EXCEEDED;
+        }
+        dfs_log(LL_ERROR) << "Stat failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    for (const FileStatus& file_status : response.files()) {
+        dfs_log(LL_DEBUG) << "  " << file_status.filename() << ": " << file_status.size() << " bytes, mtime "
+                          << file_status.mtime_ns() << "ns, generation " << file_status.generation();
+        if (statuses != nullptr) {
+            (*statuses)[file_status.filename()] = file_status;
+        }
+    }
+    for (const std::string& missing : response.missing()) {
+        dfs_log(LL_ERROR) << "File not found on server: " << missing;
+    }
+    return response.missing_size() > 0 ? StatusCode::NOT_FOUND : StatusCode::OK;
+}
+
 //
 // STUDENT INSTRUCTION:
 //
@@ -390,4 +1056,224 @@ StatusCode DFSClientNodeP1::Stat(const std::string &filename, void* file_status)
 // implementations of your client methods
 //
 
+void DFSClientNodeP1::SetMaxChunkSize(size_t max_chunk_size) {
+    this->max_chunk_size = std::max<size_t>(max_chunk_size, DFS_MIN_CHUNK_SIZE);
+}
+
+void DFSClientNodeP1::SetZeroCopyFetch(bool zero_copy) {
+    this->zero_copy_fetch = zero_copy;
+}
+
+void DFSClientNodeP1::SetFetchStreams(int streams) {
+    this->fetch_streams = std::max(streams, 1);
+}
+
+void DFSClientNodeP1::SetStorePipelineDepth(int depth) {
+    this->store_pipeline_depth = std::max(depth, 1);
+}
+
+void DFSClientNodeP1::SetDeduplication(bool dedup) {
+    this->dedup = dedup;
+}
+
+void DFSClientNodeP1::SetListFilter(const std::string& prefix, const std::string& pattern, int mtime_since) {
+    this->list_prefix = prefix;
+    this->list_pattern = pattern;
+    this->list_mtime_since = mtime_since;
+}
+
+void DFSClientNodeP1::SetListPageSize(size_t page_size) {
+    this->list_page_size = std::min<size_t>(std::max<size_t>(page_size, 1), DFS_LIST_MAX_PAGE_SIZE);
+}
+
+void DFSClientNodeP1::PlanDeduplicatedStore(const std::string& filepath, std::vector<DFSContentChunk>* plan,
+                                            std::vector<bool>* present) {
+    if (!DFSChunkFile(filepath, plan)) {
+        plan->clear();
+        return;
+    }
+
+    std::set<std::string> missing;
+    for (size_t start = 0; start < plan->size(); start += DFS_CHUNK_QUERY_BATCH) {
+        ClientContext context;
+        context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout));
+        ChunkList request;
+        ChunkList response;
+        size_t end = std::min<size_t>(start + DFS_CHUNK_QUERY_BATCH, plan->size());
+        for (size_t i = start; i < end; i++) {
+            request.add_hashes((*plan)[i].hash);
+        }
+        Status status = this->service_stub->MissingChunks(&context, request, &response);
+        if (!status.ok()) {
+            dfs_log(LL_DEBUG) << "Sending all chunks: " << status.error_message();
+            plan->clear();
+            return;
+        }
+        missing.insert(response.hashes().begin(), response.hashes().end());
+    }
+
+    present->resize(plan->size());
+    size_t skipped = 0;
+    for (size_t i = 0; i < plan->size(); i++) {
+        (*present)[i] = missing.count((*plan)[i].hash) == 0;
+        skipped += (*present)[i] ? (*plan)[i].length : 0;
+    }
+    dfs_log(LL_DEBUG) << "Server already holds " << skipped << " bytes of " << filepath;
+    if (skipped == 0) {
+        plan->clear();
+    }
+}
+
+void DFSClientNodeP1::SetCompression(bool compress) {
+    this->compress = compress;
+}
+
+uint64_t DFSClientNodeP1::CommittedOffset(const std::string &transfer_id) {
+
+    ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout));
+
+    TransferRequest request;
+    request.set_transfer_id(transfer_id);
+    TransferStatus response;
+
+    // Any failure just means the upload starts from the beginning
+    Status status = this->service_stub->QueryTransfer(&context, request, &response);
+    return status.ok() ? response.committed_offset() : 0;
+}
+
+StatusCode DFSClientNodeP1::FetchRanges(const std::string &filename, const FileStatus& file_status) {
+
+    uint64_t file_size = file_status.size();
+    std::string filepath = this->MountPath() + filename;
+
+    // Download into the sidecar and rename it over the file once every
+    // range has arrived, so a failed fetch leaves the cached copy alone.
+    // Ranges aren't a prefix, so any sidecar an interrupted single-stream
+    // fetch left is started over.
+    std::string partial_path = filepath + DFS_PARTIAL_SUFFIX;
+    int fd = open(partial_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        dfs_log(LL_ERROR) << "Could not open file for writing: " << partial_path;
+        return StatusCode::CANCELLED;
+    }
+    fremovexattr(fd, DFS_PARTIAL_XATTR);
+
+    // Preallocate the sidecar so ranges can be written in any order
+    if (posix_fallocate(fd, 0, file_size) != 0 && ftruncate(fd, file_size) != 0) {
+        dfs_log(LL_ERROR) << "Could not preallocate " << file_size << " bytes for " << partial_path;
+        close(fd);
+        unlink(partial_path.c_str());
+        return StatusCode::CANCELLED;
+    }
+
+    uint64_t streams = static_cast<uint64_t>(this->fetch_streams);
+    uint64_t range_size = (file_size + streams - 1) / streams;
+    range_size = (range_size + DFS_RANGE_ALIGNMENT - 1) / DFS_RANGE_ALIGNMENT * DFS_RANGE_ALIGNMENT;
+
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+
+    dfs_log(LL_DEBUG) << "Fetching file: " << filename << " as " << ((file_size + range_size - 1) / range_size)
+                      << " ranges of " << range_size << " bytes";
+
+    std::vector<std::thread> workers;
+    std::vector<Status> statuses;
+    std::vector<uint64_t> received;
+    for (uint64_t offset = 0; offset < file_size; offset += range_size) {
+        statuses.emplace_back();
+        received.push_back(0);
+    }
+
+    for (size_t i = 0; i < statuses.size(); i++) {
+        workers.emplace_back([&, i] {
+            FileRange request;
+            request.set_name(filename);
+            request.set_offset(i * range_size);
+            request.set_length(std::min(range_size, file_size - i * range_size));
+            request.set_chunk_size(this->max_chunk_size);
+            request.set_codec(this->compress ? dfs_service::CODEC_DEFLATE : dfs_service::CODEC_NONE);
+            // Every range must come from the version that sized the file
+            request.set_mtime_ns(file_status.mtime_ns());
+            request.set_generation(file_status.generation());
+
+            ClientContext context;
+            context.set_deadline(deadline);
+
+            auto reader = this->service_stub->FetchRange(&context, request);
+            FileChunk chunk;
+            while (reader->Read(&chunk)) {
+                if (!DFSDecompressChunk(&chunk, this->max_chunk_size)) {
+                    dfs_log(LL_ERROR) << "Could not decode range data for " << filepath;
+                    context.TryCancel();
+                    break;
+                }
+                const std::string& data = chunk.data();
+                if (pwrite(fd, data.data(), data.size(), chunk.offset()) != static_cast<ssize_t>(data.size())) {
+                    dfs_log(LL_ERROR) << "Failed to write range data to " << filepath;
+                    context.TryCancel();
+                    break;
+                }
+                received[i] += data.size();
+            }
+            statuses[i] = reader->Finish();
+        });
+    }
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    uint64_t total = 0;
+    for (uint64_t bytes : received) {
+        total += bytes;
+    }
+    StatusCode code = FetchRangesResult(filename, statuses, total, file_size);
+    if (code == StatusCode::OK && fsync(fd) != 0) {
+        dfs_log(LL_ERROR) << "Could not flush fetched file: " << partial_path;
+        code = StatusCode::CANCELLED;
+    }
+    close(fd);
+    if (code == StatusCode::OK && rename(partial_path.c_str(), filepath.c_str()) != 0) {
+        dfs_log(LL_ERROR) << "Could not move fetched file into place: " << filepath;
+        code = StatusCode::CANCELLED;
+    }
+    if (code != StatusCode::OK) {
+        unlink(partial_path.c_str());
+        return code;
+    }
+
+    dfs_log(LL_DEBUG) << "File fetched successfully: " << filename;
+    return StatusCode::OK;
+}
+
+StatusCode DFSClientNodeP1::FetchRangesResult(const std::string &filename, const std::vector<Status>& statuses,
+                                              uint64_t total, uint64_t file_size) {
+
+    for (const Status& status : statuses) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            dfs_log(LL_ERROR) << "Deadline exceeded for fetch operation";
+            return StatusCode::DEADLINE_EXCEEDED;
+        }
+        if (status.error_code() == StatusCode::NOT_FOUND) {
+            dfs_log(LL_ERROR) << "File not found on server: " << filename;
+            return StatusCode::NOT_FOUND;
+        }
+        if (status.error_code() == StatusCode::FAILED_PRECONDITION) {
+            dfs_log(LL_ERROR) << filename << " changed on the server during its fetch";
+            return StatusCode::CANCELLED;
+        }
+        if (!status.ok()) {
+            dfs_log(LL_ERROR) << "Fetch failed: " << status.error_message();
+            return StatusCode::CANCELLED;
+        }
+    }
+
+    if (total != file_size) {
+        dfs_log(LL_ERROR) << "Fetch of " << filename << " returned " << total << " of " << file_size << " bytes";
+        return StatusCode::CANCELLED;
+    }
+    return StatusCode::OK;
+}
+
 
@@ -10,6 +10,7 @@
 
 #include <grpcpp/grpcpp.h>
 #include "src/dfslibx-clientnode-p1.h"
+#include "dfslib-shared-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 class DFSClientNodeP1 : public DFSClientNode {
@@ -92,5 +93,184 @@ public:
         // Add your additional declarations here
         //
 
+        /**
+         * Store many files from the mount path over a single StoreMany call
+         *
+         * @param filenames
+         * @param results if given, filled with the outcome for each file
+         * @return OK if every file was stored, DEADLINE_EXCEEDED, or CANCELLED
+         */
+        grpc::StatusCode StoreMany(const std::vector<std::string>& filenames,
+                                   std::map<std::string, grpc::StatusCode>* results = nullptr);
+
+        /**
+         * Fetch many files into the mount path over a single FetchMany call
+         *
+         * @param filenames
+         * @param results if given, filled with the outcome for each file
+         * @return OK if every file was fetched, DEADLINE_EXCEEDED, or CANCELLED
+         */
+        grpc::StatusCode FetchMany(const std::vector<std::string>& filenames,
+                                   std::map<std::string, grpc::StatusCode>* results = nullptr);
+
+        /**
+         * Get the status of many files from the RPC server in one call
+         *
+         * @param filenames
+         * @param statuses filled with the status of each file that exists
+         * @return OK if every file exists, NOT_FOUND if some don't,
+         *         DEADLINE_EXCEEDED, or CANCELLED
+         */
+        grpc::StatusCode StatMany(const std::vector<std::string>& filenames,
+                                  std::map<std::string, dfs_service::FileStatus>* statuses);
+
+        /**
+         * Sets the largest chunk size used when streaming files
+         *
+         * @param max_chunk_size
+         */
+        void SetMaxChunkSize(size_t max_chunk_size);
+
+        /**
+         * Fetch through the server's mmap-backed FetchMapped stream
+         *
+         * @param zero_copy
+         */
+        void SetZeroCopyFetch(bool zero_copy);
+
+        /**
+         * Sets the number of concurrent range streams used to fetch large files
+         *
+         * @param streams
+         */
+        void SetFetchStreams(int streams);
+
+        /**
+         * Compress compressible files on Store and accept compressed Fetch streams
+         *
+         * @param compress
+         */
+        void SetCompression(bool compress);
+
+        /**
+         * Sets how many chunk buffers Store reads ahead of the network
+         *
+         * @param depth
+         */
+        void SetStorePipelineDepth(int depth);
+
+        /**
+         * Send chunks the server already holds as references on Store
+         *
+         * @param dedup
+         */
+        void SetDeduplication(bool dedup);
+
+        /**
+         * Fetch one page of a name-ordered listing. Pass an empty cursor for
+         * the first page, then the returned next_cursor until it comes back
+         * empty. The page's files are added to `file_map`.
+         *
+         * @param cursor
+         * @param file_map
+         * @param next_cursor set to the cursor of the following page
+         * @return OK, NOT_FOUND if the cursor expired, INVALID_ARGUMENT if it
+         *         is malformed, DEADLINE_EXCEEDED, or CANCELLED
+         */
+        grpc::StatusCode ListPage(const std::string& cursor, std::map<std::string,int>* file_map,
+                                  std::string* next_cursor);
+
+        /**
+         * Restrict List and ListPage to matching files; empty or zero
+         * arguments match everything
+         *
+         * @param prefix the name must start with this
+         * @param pattern shell glob the name must match
+         * @param mtime_since only files modified at or after this time
+         */
+        void SetListFilter(const std::string& prefix, const std::string& pattern, int mtime_since);
+
+        /**
+         * Sets the files per listing page
+         *
+         * @param page_size
+         */
+        void SetListPageSize(size_t page_size);
+
+private:
+
+        /**
+         * Fill a listing request with this client's filters and page size
+         *
+         * @param request
+         */
+        void FillListRequest(dfs_service::ListRequest* request) const;
+
+        /**
+         * Split a file into content-defined chunks and ask the server which
+         * of them it already holds
+         *
+         * @param filepath
+         * @param plan set to the file's chunks, or left empty if none can be skipped
+         * @param present set to whether the server holds each chunk
+         */
+        void PlanDeduplicatedStore(const std::string& filepath, std::vector<DFSContentChunk>* plan,
+                                   std::vector<bool>* present);
+
+        /**
+         * Ask the server how much of a resumable upload it already holds
+         *
+         * @param transfer_id
+         * @return the offset to resume from, or 0 to start over
+         */
+        uint64_t CommittedOffset(const std::string& transfer_id);
+
+        /**
+         * Fetch a large file as `fetch_streams` concurrent FetchRange calls,
+         * each written with pwrite into a preallocated sidecar that replaces
+         * the file only once every range has arrived
+         *
+         * @param filename
+         * @param file_status the server's status; every range must come from this version
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode FetchRanges(const std::string& filename, const dfs_service::FileStatus& file_status);
+
+        /**
+         * The outcome of a ranged fetch from the status of each range
+         *
+         * @param filename
+         * @param statuses
+         * @param total bytes received over all ranges
+         * @param file_size
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode FetchRangesResult(const std::string& filename, const std::vector<grpc::Status>& statuses,
+                                           uint64_t total, uint64_t file_size);
+
+        /** The largest chunk size this client will send or accept **/
+        size_t max_chunk_size;
+
+        /** Whether Fetch uses the FetchMapped RPC **/
+        bool zero_copy_fetch;
+
+        /** Number of parallel range streams for large fetches **/
+        int fetch_streams;
+
+        /** Whether transfers negotiate compression **/
+        bool compress;
+
+        /** Chunk buffers in the ring between Store's reader thread and the stream **/
+        int store_pipeline_depth;
+
+        /** Whether Store skips chunks the server already holds **/
+        bool dedup;
+
+        /** Files per listing page, and the filters listings apply **/
+        size_t list_page_size;
+        std::string list_prefix;
+        std::string list_pattern;
+        int list_mtime_since;
+
 };
 #endif
@@ -0,0 +1,849 @@
+#include <string>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <mutex>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-fileio-p1.h"
+
+//
+// Stream backend
+//
+
+class DFSStreamReader : public DFSFileReader {
+
+private:
+    std::ifstream in;
+    std::vector<char> buffer;
+
+public:
+    DFSStreamReader(const std::string& path, uint64_t offset) : in(path, std::ios::binary) {
+        if (this->in.is_open() && offset > 0) {
+            this->in.seekg(offset);
+        }
+    }
+
+    bool IsOpen() const {
+        return this->in.is_open() && !this->in.fail();
+    }
+
+    ssize_t Next(size_t length, const char** data) override {
+        if (this->buffer.size() < length) {
+            this->buffer.resize(length);
+        }
+        this->in.read(this->buffer.data(), length);
+        *data = this->buffer.data();
+        return this->in.bad() ? -1 : this->in.gcount();
+    }
+
+};
+
+/**
+ * Reserve extents for [start, expected_size) without changing the file
+ * size, so a large upload lands in few extents and an interrupted one
+ * still reports only what was written
+ */
+static void Preallocate(int fd, uint64_t start, uint64_t expected_size) {
+    if (expected_size > start && fallocate(fd, FALLOC_FL_KEEP_SIZE, start, expected_size - start) != 0) {
+        dfs_log(LL_DEBUG2) << "Preallocation skipped: " << strerror(errno);
+    }
+}
+
+/**
+ * Release extents preallocated past what was actually written
+ */
+static void TrimPreallocation(int fd, uint64_t end, uint64_t expected_size) {
+    if (expected_size > end && ftruncate(fd, end) != 0) {
+        dfs_log(LL_DEBUG2) << "Could not trim preallocation: " << strerror(errno);
+    }
+}
+
+/**
+ * Open a file for a writer: created if missing, truncated unless
+ * appending, preallocated to the expected size, and with O_DIRECT when
+ * requested and the starting offset allows it. `position` receives the
+ * offset writing starts at and `direct` whether O_DIRECT took effect.
+ */
+static int OpenForWrite(const std::string& path, bool append, const DFSWriteOptions& options,
+                        uint64_t* position, bool* direct) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC);
+    int fd = open(path.c_str(), flags, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    *position = append ? st.st_size : 0;
+    *direct = false;
+    if (options.direct && *position % DFS_DIRECT_ALIGNMENT == 0) {
+        // Filesystems without O_DIRECT support (e.g. tmpfs) reject the flag
+        *direct = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0;
+    }
+    Preallocate(fd, *position, options.expected_size);
+    return fd;
+}
+
+/**
+ * Aligned DFS_DIRECT_BLOCK buffers shared by every direct writer, so
+ * concurrent large uploads recycle a bounded set of buffers
+ */
+class DFSAlignedBufferPool {
+
+private:
+    std::mutex pool_mutex;
+    std::vector<char*> free_buffers;
+
+public:
+    ~DFSAlignedBufferPool() {
+        for (char* buffer : this->free_buffers) {
+            free(buffer);
+        }
+    }
+
+    char* Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(this->pool_mutex);
+            if (!this->free_buffers.empty()) {
+                char* buffer = this->free_buffers.back();
+                this->free_buffers.pop_back();
+                return buffer;
+            }
+        }
+        void* buffer;
+        return posix_memalign(&buffer, DFS_DIRECT_ALIGNMENT, DFS_DIRECT_BLOCK) == 0 ?
+            static_cast<char*>(buffer) : nullptr;
+    }
+
+    void Release(char* buffer) {
+        std::lock_guard<std::mutex> lock(this->pool_mutex);
+        if (this->free_buffers.size() < DFS_DIRECT_POOL) {
+            this->free_buffers.push_back(buffer);
+        } else {
+            free(buffer);
+        }
+    }
+
+};
+
+static DFSAlignedBufferPool direct_buffers;
+
+class DFSStreamWriter : public DFSFileWriter {
+
+private:
+    std::ofstream out;
+    std::string path;
+    uint64_t end;
+    uint64_t expected_size;
+
+public:
+    DFSStreamWriter(const std::string& path, bool append, uint64_t expected_size) :
+        path(path), end(0), expected_size(expected_size) {
+
+        // ofstream has no descriptor to preallocate through, so reserve first
+        DFSWriteOptions options;
+        options.expected_size = expected_size;
+        bool direct;
+        int fd = OpenForWrite(path, append, options, &this->end, &direct);
+        if (fd >= 0) {
+            close(fd);
+            this->out.open(path, std::ios::binary | std::ios::app);
+        }
+    }
+
+    bool IsOpen() const {
+        return this->out.is_open();
+    }
+
+    bool Write(const char* data, size_t length) override {
+        this->out.write(data, length);
+        this->end += length;
+        return this->out.good();
+    }
+
+    bool Close() override {
+        if (this->out.is_open()) {
+            this->out.close();
+            if (this->expected_size > this->end) {
+                truncate(this->path.c_str(), this->end);
+            }
+        }
+        return !this->out.fail();
+    }
+
+};
+
+/**
+ * Writes through O_DIRECT from a pooled aligned buffer, issuing only full
+ * DFS_DIRECT_BLOCK writes; the unaligned tail is written with O_DIRECT
+ * switched off
+ */
+class DFSDirectWriter : public DFSFileWriter {
+
+private:
+    int fd;
+    char* buffer;
+    size_t fill;
+    uint64_t position;
+    uint64_t expected_size;
+    bool failed;
+
+    bool Flush() {
+        size_t written = 0;
+        while (written < this->fill) {
+            ssize_t count = pwrite(this->fd, this->buffer + written, this->fill - written, this->position + written);
+            if (count <= 0) {
+                dfs_log(LL_ERROR) << "Direct write failed: " << strerror(errno);
+                return false;
+            }
+            written += count;
+        }
+        this->position += this->fill;
+        this->fill = 0;
+        return true;
+    }
+
+public:
+    DFSDirectWriter(int fd, uint64_t position, uint64_t expected_size) :
+        fd(fd), buffer(direct_buffers.Acquire()), fill(0), position(position),
+        expected_size(expected_size), failed(buffer == nullptr) {}
+
+    ~DFSDirectWriter() {
+        Close();
+    }
+
+    bool Write(const char* data, size_t length) override {
+        while (length > 0 && !this->failed) {
+            size_t count = std::min(length, DFS_DIRECT_BLOCK - this->fill);
+            memcpy(this->buffer + this->fill, data, count);
+            this->fill += count;
+            data += count;
+            length -= count;
+            if (this->fill == DFS_DIRECT_BLOCK && !Flush()) {
+                this->failed = true;
+            }
+        }
+        return !this->failed;
+    }
+
+    bool Close() override {
+        if (this->fd < 0) {
+            return !this->failed;
+        }
+        if (!this->failed && this->fill > 0) {
+            if (this->fill % DFS_DIRECT_ALIGNMENT != 0) {
+                fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) & ~O_DIRECT);
+            }
+            this->failed = !Flush();
+        }
+        TrimPreallocation(this->fd, this->position, this->expected_size);
+        if (close(this->fd) != 0) {
+            this->failed = true;
+        }
+        this->fd = -1;
+        if (this->buffer) {
+            direct_buffers.Release(this->buffer);
+            this->buffer = nullptr;
+        }
+        return !this->failed;
+    }
+
+};
+
+class DFSStreamFileIO : public DFSFileIO {
+
+public:
+    std::unique_ptr<DFSFileReader> OpenRead(const std::string& path, uint64_t offset) override {
+        std::unique_ptr<DFSStreamReader> reader(new DFSStreamReader(path, offset));
+        if (!reader->IsOpen()) {
+            return nullptr;
+        }
+        return std::move(reader);
+    }
+
+    std::unique_ptr<DFSFileWriter> OpenWrite(const std::string& path, bool append,
+                                             const DFSWriteOptions& options) override {
+        if (options.direct) {
+            uint64_t position;
+            bool direct;
+            int fd = OpenForWrite(path, append, options, &position, &direct);
+            if (fd < 0) {
+                return nullptr;
+            }
+            if (direct) {
+                return std::unique_ptr<DFSFileWriter>(new DFSDirectWriter(fd, position, options.expected_size));
+            }
+            close(fd);
+            append = true;
+        }
+
+        std::unique_ptr<DFSStreamWriter> writer(new DFSStreamWriter(path, append, options.expected_size));
+        if (!writer->IsOpen()) {
+            return nullptr;
+        }
+        return std::move(writer);
+    }
+
+    const char* Name() const override {
+        return "stream";
+    }
+
+};
+
+//
+// io_uring backend
+//
+
+/**
+ * A minimal io_uring submission/completion ring driven through the raw
+ * syscalls, with DFS_URING_DEPTH buffers of DFS_URING_BLOCK bytes
+ * registered as fixed buffers. Slot i of a reader or writer always uses
+ * buffer i, and the slot index travels as the request's user_data.
+ */
+class DFSUring {
+
+private:
+    int ring_fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    std::vector<char*> buffers;
+    bool registered;
+    unsigned to_submit;
+
+    int Enter(unsigned submit, unsigned wait) {
+        int ret;
+        do {
+            ret = syscall(__NR_io_uring_enter, this->ring_fd, submit, wait,
+                          wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret;
+    }
+
+public:
+    /** Set while a reader or writer on this thread owns the ring **/
+    bool busy;
+
+    DFSUring() : ring_fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED), cq_ring_size(0),
+        sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)), sqes_size(0), registered(false),
+        to_submit(0), busy(false) {}
+
+    ~DFSUring() {
+        for (char* buffer : this->buffers) {
+            free(buffer);
+        }
+        if (this->sqes != MAP_FAILED) {
+            munmap(this->sqes, this->sqes_size);
+        }
+        if (this->cq_ring != MAP_FAILED && this->cq_ring != this->sq_ring) {
+            munmap(this->cq_ring, this->cq_ring_size);
+        }
+        if (this->sq_ring != MAP_FAILED) {
+            munmap(this->sq_ring, this->sq_ring_size);
+        }
+        if (this->ring_fd >= 0) {
+            close(this->ring_fd);
+        }
+    }
+
+    bool Init() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        this->ring_fd = syscall(__NR_io_uring_setup, DFS_URING_DEPTH, &params);
+        if (this->ring_fd < 0) {
+            return false;
+        }
+
+        this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+        }
+
+        this->sq_ring = mmap(nullptr, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             this->ring_fd, IORING_OFF_SQ_RING);
+        if (this->sq_ring == MAP_FAILED) {
+            return false;
+        }
+        this->cq_ring = single_mmap ? this->sq_ring :
+            mmap(nullptr, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 this->ring_fd, IORING_OFF_CQ_RING);
+        if (this->cq_ring == MAP_FAILED) {
+            return false;
+        }
+        this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        this->sqes = static_cast<struct io_uring_sqe*>(
+            mmap(nullptr, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 this->ring_fd, IORING_OFF_SQES));
+        if (this->sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char* sq = static_cast<char*>(this->sq_ring);
+        char* cq = static_cast<char*>(this->cq_ring);
+        this->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        this->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        this->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        this->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        this->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        this->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        this->cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        std::vector<struct iovec> iovecs;
+        for (unsigned i = 0; i < DFS_URING_DEPTH; i++) {
+            void* buffer;
+            if (posix_memalign(&buffer, 4096, DFS_URING_BLOCK) != 0) {
+                return false;
+            }
+            this->buffers.push_back(static_cast<char*>(buffer));
+            iovecs.push_back({buffer, DFS_URING_BLOCK});
+        }
+
+        // Pinning can fail under a tight RLIMIT_MEMLOCK; plain reads and writes still work
+        this->registered = syscall(__NR_io_uring_register, this->ring_fd, IORING_REGISTER_BUFFERS,
+                                   iovecs.data(), iovecs.size()) == 0;
+        dfs_log(LL_DEBUG2) << "io_uring ring ready (" << (this->registered ? "registered" : "unregistered")
+                           << " buffers)";
+        return true;
+    }
+
+    char* Buffer(unsigned slot) {
+        return this->buffers[slot];
+    }
+
+    /**
+     * Queue a read or write of `length` bytes between `slot`'s buffer
+     * and `offset` in `fd`; nothing is submitted until Submit or Wait
+     */
+    void Prepare(bool write, int fd, unsigned slot, size_t length, uint64_t offset) {
+        unsigned tail = *this->sq_tail;
+        unsigned index = tail & *this->sq_mask;
+        struct io_uring_sqe* sqe = &this->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+
+        if (this->registered) {
+            sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->buf_index = slot;
+        } else {
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        }
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(this->buffers[slot]);
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = slot;
+
+        this->sq_array[index] = index;
+        __atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        this->to_submit++;
+    }
+
+    /** Submit everything queued since the last submission in one call **/
+    bool Submit() {
+        if (this->to_submit == 0) {
+            return true;
+        }
+        int submitted = Enter(this->to_submit, 0);
+        if (submitted < 0) {
+            return false;
+        }
+        this->to_submit -= submitted;
+        return true;
+    }
+
+    /** Take a completion if one is ready **/
+    bool Peek(struct io_uring_cqe* cqe) {
+        unsigned head = *this->cq_head;
+        if (head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        *cqe = this->cqes[head & *this->cq_mask];
+        __atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    /** Submit anything queued and block for the next completion **/
+    bool Wait(struct io_uring_cqe* cqe) {
+        while (!Peek(cqe)) {
+            int submitted = Enter(this->to_submit, 1);
+            if (submitted < 0) {
+                return false;
+            }
+            this->to_submit -= submitted;
+        }
+        return true;
+    }
+
+};
+
+/**
+ * The calling thread's ring, or nullptr if io_uring is unavailable or the
+ * ring is already owned by another reader or writer on this thread
+ */
+static DFSUring* AcquireThreadRing() {
+    thread_local std::unique_ptr<DFSUring> ring;
+    thread_local bool unavailable = false;
+
+    if (!ring && !unavailable) {
+        ring.reset(new DFSUring());
+        if (!ring->Init()) {
+            dfs_log(LL_ERROR) << "io_uring unavailable on this thread; using stream I/O";
+            ring.reset();
+            unavailable = true;
+        }
+    }
+    if (!ring || ring->busy) {
+        return nullptr;
+    }
+    ring->busy = true;
+    return ring.get();
+}
+
+/**
+ * Reads ahead of the caller by keeping every slot's block in flight;
+ * blocks are consumed in file order as their completions arrive, and a
+ * consumed block is resubmitted when the caller asks for the next view
+ */
+class DFSUringReader : public DFSFileReader {
+
+private:
+    enum SlotState {IDLE, IN_FLIGHT, DONE};
+
+    struct Slot {
+        SlotState state;
+        uint64_t offset;
+        size_t length;
+        ssize_t result;
+        size_t consumed;
+    };
+
+    DFSUring* ring;
+    int fd;
+    uint64_t file_size;
+    uint64_t next_offset;
+    Slot slots[DFS_URING_DEPTH];
+    unsigned head;
+    unsigned in_flight;
+    bool eof;
+    bool refill_head;
+
+    void Issue(unsigned slot) {
+        Slot& s = this->slots[slot];
+        if (this->eof || this->next_offset >= this->file_size) {
+            s.state = IDLE;
+            return;
+        }
+        s.state = IN_FLIGHT;
+        s.offset = this->next_offset;
+        s.length = std::min<uint64_t>(DFS_URING_BLOCK, this->file_size - this->next_offset);
+        s.result = 0;
+        s.consumed = 0;
+        this->ring->Prepare(false, this->fd, slot, s.length, s.offset);
+        this->next_offset += s.length;
+        this->in_flight++;
+    }
+
+    bool Complete() {
+        struct io_uring_cqe cqe;
+        if (!this->ring->Wait(&cqe)) {
+            return false;
+        }
+        Slot& s = this->slots[cqe.user_data];
+        s.state = DONE;
+        s.result = cqe.res;
+        this->in_flight--;
+        return true;
+    }
+
+public:
+    DFSUringReader(DFSUring* ring, int fd, uint64_t file_size, uint64_t offset) :
+        ring(ring), fd(fd), file_size(file_size), next_offset(offset), head(0), in_flight(0), eof(false),
+        refill_head(false) {
+
+        for (unsigned slot = 0; slot < DFS_URING_DEPTH; slot++) {
+            Issue(slot);
+        }
+        this->ring->Submit();
+    }
+
+    ~DFSUringReader() {
+        // The kernel may still be filling our buffers
+        while (this->in_flight > 0 && Complete()) {}
+        close(this->fd);
+        this->ring->busy = false;
+    }
+
+    ssize_t Next(size_t length, const char** data) override {
+        // The block handed out last time is no longer referenced
+        if (this->refill_head) {
+            this->refill_head = false;
+            Issue(this->head);
+            this->head = (this->head + 1) % DFS_URING_DEPTH;
+        }
+
+        Slot& s = this->slots[this->head];
+        if (this->eof || s.state == IDLE) {
+            return this->ring->Submit() ? 0 : -1;
+        }
+        while (s.state == IN_FLIGHT) {
+            if (!Complete()) {
+                return -1;
+            }
+        }
+        if (s.result < 0) {
+            dfs_log(LL_ERROR) << "io_uring read failed: " << strerror(-s.result);
+            return -1;
+        }
+
+        size_t count = std::min<size_t>(s.result - s.consumed, length);
+        *data = this->ring->Buffer(this->head) + s.consumed;
+        s.consumed += count;
+
+        if (s.consumed == static_cast<size_t>(s.result)) {
+            // A short read means the file shrank; stop at what we have
+            this->eof = static_cast<size_t>(s.result) < s.length;
+            this->refill_head = true;
+        }
+
+        // Refills queued since the last call go out together
+        if (!this->ring->Submit()) {
+            return -1;
+        }
+        return count;
+    }
+
+};
+
+/**
+ * Copies writes into the slot being filled and submits each block once
+ * it is full, without waiting, so up to DFS_URING_DEPTH blocks are being
+ * written at once. With O_DIRECT only whole blocks are written until the
+ * tail, which goes out with O_DIRECT switched off.
+ */
+class DFSUringWriter : public DFSFileWriter {
+
+private:
+    struct Slot {
+        bool in_flight;
+        uint64_t offset;
+        size_t length;
+    };
+
+    DFSUring* ring;
+    int fd;
+    uint64_t position;
+    uint64_t expected_size;
+    bool direct;
+    Slot slots[DFS_URING_DEPTH];
+    int filling;
+    unsigned in_flight;
+    bool failed;
+
+    void Handle(const struct io_uring_cqe& cqe) {
+        Slot& s = this->slots[cqe.user_data];
+        s.in_flight = false;
+        this->in_flight--;
+
+        if (cqe.res < 0) {
+            dfs_log(LL_ERROR) << "io_uring write failed: " << strerror(-cqe.res);
+            this->failed = true;
+        } else if (static_cast<size_t>(cqe.res) < s.length) {
+            // Finish a short write synchronously before the buffer is reused
+            size_t rest = s.length - cqe.res;
+            if (pwrite(this->fd, this->ring->Buffer(cqe.user_data) + cqe.res, rest, s.offset + cqe.res) !=
+                    static_cast<ssize_t>(rest)) {
+                this->failed = true;
+            }
+        }
+    }
+
+    bool WaitOne() {
+        struct io_uring_cqe cqe;
+        if (!this->ring->Wait(&cqe)) {
+            this->failed = true;
+            return false;
+        }
+        Handle(cqe);
+        return true;
+    }
+
+    void Dispatch() {
+        Slot& s = this->slots[this->filling];
+        s.in_flight = true;
+        this->ring->Prepare(true, this->fd, this->filling, s.length, s.offset);
+        this->in_flight++;
+        this->filling = -1;
+    }
+
+public:
+    DFSUringWriter(DFSUring* ring, int fd, uint64_t position, uint64_t expected_size, bool direct) :
+        ring(ring), fd(fd), position(position), expected_size(expected_size), direct(direct),
+        filling(-1), in_flight(0), failed(false) {
+        for (Slot& s : this->slots) {
+            s.in_flight = false;
+        }
+    }
+
+    ~DFSUringWriter() {
+        Close();
+    }
+
+    bool Write(const char* data, size_t length) override {
+        while (length > 0 && !this->failed) {
+            if (this->filling < 0) {
+                while (this->in_flight == DFS_URING_DEPTH) {
+                    if (!WaitOne()) {
+                        return false;
+                    }
+                }
+                unsigned slot = 0;
+                while (this->slots[slot].in_flight) {
+                    slot++;
+                }
+                this->filling = slot;
+                this->slots[slot].offset = this->position;
+                this->slots[slot].length = 0;
+            }
+
+            Slot& s = this->slots[this->filling];
+            size_t count = std::min<size_t>(length, DFS_URING_BLOCK - s.length);
+            memcpy(this->ring->Buffer(this->filling) + s.length, data, count);
+            s.length += count;
+            this->position += count;
+            data += count;
+            length -= count;
+
+            if (s.length == DFS_URING_BLOCK) {
+                Dispatch();
+            }
+        }
+
+        // Every block filled by this call goes out in one submission
+        if (!this->ring->Submit()) {
+            this->failed = true;
+        }
+        struct io_uring_cqe cqe;
+        while (this->ring->Peek(&cqe)) {
+            Handle(cqe);
+        }
+        return !this->failed;
+    }
+
+    bool Close() override {
+        if (this->fd < 0) {
+            return !this->failed;
+        }
+        if (this->filling >= 0 && !this->failed) {
+            if (this->direct && this->slots[this->filling].length % DFS_DIRECT_ALIGNMENT != 0) {
+                // Let in-flight direct writes land before the tail goes through the page cache
+                while (this->in_flight > 0 && WaitOne()) {}
+                fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL) & ~O_DIRECT);
+            }
+            Dispatch();
+        }
+        while (this->in_flight > 0 && WaitOne()) {}
+        TrimPreallocation(this->fd, this->position, this->expected_size);
+        if (close(this->fd) != 0) {
+            this->failed = true;
+        }
+        this->fd = -1;
+        this->ring->busy = false;
+        return !this->failed;
+    }
+
+};
+
+class DFSUringFileIO : public DFSFileIO {
+
+private:
+    DFSStreamFileIO fallback;
+
+public:
+    std::unique_ptr<DFSFileReader> OpenRead(const std::string& path, uint64_t offset) override {
+        DFSUring* ring = AcquireThreadRing();
+        if (!ring) {
+            return this->fallback.OpenRead(path, offset);
+        }
+
+        struct stat st;
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            ring->busy = false;
+            return nullptr;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return std::unique_ptr<DFSFileReader>(new DFSUringReader(ring, fd, st.st_size, offset));
+    }
+
+    std::unique_ptr<DFSFileWriter> OpenWrite(const std::string& path, bool append,
+                                             const DFSWriteOptions& options) override {
+        DFSUring* ring = AcquireThreadRing();
+        if (!ring) {
+            return this->fallback.OpenWrite(path, append, options);
+        }
+
+        // Writes carry explicit offsets, so appending starts at the current end
+        // rather than relying on O_APPEND ordering between in-flight requests
+        uint64_t position;
+        bool direct;
+        int fd = OpenForWrite(path, append, options, &position, &direct);
+        if (fd < 0) {
+            ring->busy = false;
+            return nullptr;
+        }
+        return std::unique_ptr<DFSFileWriter>(
+            new DFSUringWriter(ring, fd, position, options.expected_size, direct));
+    }
+
+    const char* Name() const override {
+        return "uring";
+    }
+
+};
+
+std::unique_ptr<DFSFileIO> DFSCreateFileIO(const std::string& backend) {
+    if (backend == "uring") {
+        // Probe once so an unsupported kernel is reported up front
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int probe = syscall(__NR_io_uring_setup, 1, &params);
+        if (probe >= 0) {
+            close(probe);
+            return std::unique_ptr<DFSFileIO>(new DFSUringFileIO());
+        }
+        dfs_log(LL_ERROR) << "io_uring not supported (" << strerror(errno) << "); using stream I/O";
+    } else if (backend != "stream") {
+        dfs_log(LL_ERROR) << "Unknown I/O backend " << backend << "; using stream I/O";
+    }
+    return std::unique_ptr<DFSFileIO>(new DFSStreamFileIO());
+}
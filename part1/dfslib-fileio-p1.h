@@ -0,0 +1,121 @@
+#ifndef _DFSLIB_FILEIO_H
+#define _DFSLIB_FILEIO_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <sys/types.h>
+
+#define DFS_URING_DEPTH 8                   // reads or writes kept in flight per file
+#define DFS_URING_BLOCK (512 * 1024)        // size of each registered buffer
+#define DFS_DIRECT_ALIGNMENT 4096           // O_DIRECT buffer, offset and length alignment
+#define DFS_DIRECT_BLOCK (1024 * 1024)      // write size of the stream backend's direct writer
+#define DFS_DIRECT_POOL 32                  // aligned buffers kept for reuse between uploads
+
+/**
+ * Hints for opening a writer
+ */
+struct DFSWriteOptions {
+    /** Final size of the file if known, used to preallocate its extents (0 = unknown) **/
+    uint64_t expected_size;
+
+    /** Bypass the page cache with O_DIRECT where the filesystem allows it **/
+    bool direct;
+
+    DFSWriteOptions() : expected_size(0), direct(false) {}
+};
+
+/**
+ * Sequential reader used by the server's streaming handlers
+ */
+class DFSFileReader {
+
+public:
+    virtual ~DFSFileReader() {}
+
+    /**
+     * Read up to `length` of the next bytes without copying them out of
+     * the backend's buffer. The view stays valid until the next call.
+     *
+     * @param length
+     * @param data
+     * @return bytes in the view, 0 at the end of the file, or -1 on error
+     */
+    virtual ssize_t Next(size_t length, const char** data) = 0;
+
+};
+
+/**
+ * Sequential writer used by the server's streaming handlers
+ */
+class DFSFileWriter {
+
+public:
+    virtual ~DFSFileWriter() {}
+
+    /**
+     * Queue `length` bytes for writing. The data is copied before returning.
+     *
+     * @param data
+     * @param length
+     * @return false once any write has failed
+     */
+    virtual bool Write(const char* data, size_t length) = 0;
+
+    /**
+     * Wait for queued writes and close the file
+     *
+     * @return false if any write failed
+     */
+    virtual bool Close() = 0;
+
+};
+
+/**
+ * A file I/O backend for the server data path.
+ *
+ * "stream" uses std::ifstream/std::ofstream. "uring" drives io_uring
+ * directly: each server thread owns a ring with DFS_URING_DEPTH registered
+ * buffers, reads run ahead of the stream by up to that many blocks, and
+ * every Read or Write call submits its batch with one io_uring_enter.
+ * Files that can't get a ring fall back to the stream backend.
+ */
+class DFSFileIO {
+
+public:
+    virtual ~DFSFileIO() {}
+
+    /**
+     * Open a file for reading from `offset`
+     *
+     * @param path
+     * @param offset
+     * @return nullptr if the file can't be opened
+     */
+    virtual std::unique_ptr<DFSFileReader> OpenRead(const std::string& path, uint64_t offset) = 0;
+
+    /**
+     * Open a file for writing, truncating it unless `append` is set
+     *
+     * @param path
+     * @param append
+     * @param options
+     * @return nullptr if the file can't be opened
+     */
+    virtual std::unique_ptr<DFSFileWriter> OpenWrite(const std::string& path, bool append,
+                                                     const DFSWriteOptions& options) = 0;
+
+    virtual const char* Name() const = 0;
+
+};
+
+/**
+ * Create a backend by name, falling back to "stream" when the
+ * requested one is unknown or unsupported by the kernel
+ *
+ * @param backend
+ * @return
+ */
+std::unique_ptr<DFSFileIO> DFSCreateFileIO(const std::string& backend);
+
+#endif
@@ -0,0 +1,134 @@
+#include <map>
+#include <string>
+#include <vector>
+#include <iterator>
+#include <cstring>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-metadata-p1.h"
+
+#define DFS_INDEX_EVENT_BUFFER (1024 * (sizeof(struct inotify_event) + 16))
+
+DFSMetadataIndex::DFSMetadataIndex(const std::string& mount_path) :
+    mount_path(mount_path), stopping(false) {}
+
+DFSMetadataIndex::~DFSMetadataIndex() {
+    Stop();
+}
+
+void DFSMetadataIndex::Start() {
+    Scan();
+    this->watcher = std::thread(&DFSMetadataIndex::Watch, this);
+}
+
+void DFSMetadataIndex::Stop() {
+    this->stopping = true;
+    if (this->watcher.joinable()) {
+        this->watcher.join();
+    }
+}
+
+void DFSMetadataIndex::Scan() {
+    DIR* dir = opendir(this->mount_path.c_str());
+    if (!dir) {
+        dfs_log(LL_ERROR) << "Could not open directory: " << this->mount_path;
+        return;
+    }
+    std::map<std::string, DFSFileAttributes> scanned;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        DFSFileAttributes attributes;
+        if (entry->d_type == DT_REG && DFSGetFileAttributes(this->mount_path + entry->d_name, &attributes)) {
+            scanned[entry->d_name] = attributes;
+        }
+    }
+    closedir(dir);
+
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    this->records = std::move(scanned);
+    dfs_log(LL_SYSINFO) << "Indexed " << this->records.size() << " files";
+}
+
+void DFSMetadataIndex::Watch() {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, this->mount_path.c_str(),
+                                    IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM |
+                                    IN_DELETE | IN_ONLYDIR) < 0) {
+        dfs_log(LL_ERROR) << "Could not watch " << this->mount_path << ": " << strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    std::vector<char> buffer(DFS_INDEX_EVENT_BUFFER);
+    while (!this->stopping) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, DFS_INDEX_POLL) <= 0) {
+            continue;
+        }
+
+        ssize_t length = read(fd, buffer.data(), buffer.size());
+        for (ssize_t index = 0; index < length;) {
+            inotify_event* event = reinterpret_cast<inotify_event*>(&buffer[index]);
+            index += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                dfs_log(LL_ERROR) << "Metadata watch overflowed, rescanning " << this->mount_path;
+                Scan();
+                continue;
+            }
+            if (event->len == 0 || (event->mask & IN_ISDIR)) {
+                continue;
+            }
+            // Refresh removals too: by now the name may hold a new file
+            // the server already indexed
+            Refresh(event->name);
+        }
+    }
+    close(fd);
+}
+
+bool DFSMetadataIndex::Get(const std::string& name, DFSFileAttributes* attributes) const {
+    std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+    auto found = this->records.find(name);
+    if (found == this->records.end()) {
+        return false;
+    }
+    *attributes = found->second;
+    return true;
+}
+
+bool DFSMetadataIndex::Refresh(const std::string& name) {
+    // Stat under the lock, so that two refreshes of one file can't
+    // install their results out of order
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    DFSFileAttributes attributes;
+    if (!DFSGetFileAttributes(this->mount_path + name, &attributes)) {
+        this->records.erase(name);
+        return false;
+    }
+    this->records[name] = attributes;
+    return true;
+}
+
+void DFSMetadataIndex::Remove(const std::string& name) {
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    this->records.erase(name);
+}
+
+bool DFSMetadataIndex::ForEach(const std::string& after,
+                               const std::function<bool(const std::string&, const DFSFileAttributes&)>& visit) const {
+    std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+    auto record = after.empty() ? this->records.begin() : this->records.upper_bound(after);
+    for (; record != this->records.end(); ++record) {
+        if (!visit(record->first, record->second)) {
+            return std::next(record) != this->records.end();
+        }
+    }
+    return false;
+}
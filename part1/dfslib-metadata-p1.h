@@ -0,0 +1,100 @@
+#ifndef _DFSLIB_METADATA_H
+#define _DFSLIB_METADATA_H
+
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <shared_mutex>
+
+#include "dfslib-shared-p1.h"
+
+#define DFS_INDEX_POLL 1000                     // ms the watcher waits before checking for Stop
+
+/**
+ * In-memory index of the files in the server's mount path, so that List,
+ * ListPage, ListStream and Stat answer without reading the directory or
+ * stat'ing each file.
+ *
+ * The index is built with one scan when the server starts. After that,
+ * the server refreshes a file's record as it commits or deletes it, and
+ * an inotify watch on the mount path catches changes made outside the
+ * server. The index holds attributes only, so a restart costs the same
+ * single stat per file as loading a snapshot would; there is none.
+ */
+class DFSMetadataIndex {
+
+private:
+    std::string mount_path;
+
+    /** Guards records **/
+    mutable std::shared_timed_mutex index_mutex;
+    std::map<std::string, DFSFileAttributes> records;
+
+    std::atomic<bool> stopping;
+    std::thread watcher;
+
+    /**
+     * Keep the records current until Stop
+     */
+    void Watch();
+
+public:
+    DFSMetadataIndex(const std::string& mount_path);
+    ~DFSMetadataIndex();
+
+    /**
+     * Build the index and start watching the mount path
+     */
+    void Start();
+
+    /**
+     * Stop watching the mount path
+     */
+    void Stop();
+
+    /**
+     * Rebuild the records from the mount path
+     */
+    void Scan();
+
+    /**
+     * Look up a file without touching the disk
+     *
+     * @param name
+     * @param attributes
+     * @return false if the file isn't indexed
+     */
+    bool Get(const std::string& name, DFSFileAttributes* attributes) const;
+
+    /**
+     * Re-read a file's attributes, dropping its record if it is gone
+     *
+     * @param name
+     * @return false if the file doesn't exist
+     */
+    bool Refresh(const std::string& name);
+
+    /**
+     * Drop a deleted file
+     *
+     * @param name
+     */
+    void Remove(const std::string& name);
+
+    /**
+     * Visit the records after `after` in name order, until `visit`
+     * returns false. The index is locked meanwhile, so `visit` shouldn't
+     * block.
+     *
+     * @param after empty to start from the first record
+     * @param visit
+     * @return false if the walk reached the last record
+     */
+    bool ForEach(const std::string& after,
+                 const std::function<bool(const std::string&, const DFSFileAttributes&)>& visit) const;
+
+};
+
+#endif
@@ -1,18 +1,35 @@
 #include <map>
+#include <set>
+#include <list>
+#include <mutex>
+#include <memory>
+#include <vector>
 #include <chrono>
+#include <random>
+#include <sstream>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
 #include <thread>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <getopt.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <grpcpp/grpcpp.h>
+#include <google/protobuf/io/coded_stream.h>
 
 #include "src/dfs-utils.h"
 #include "dfslib-shared-p1.h"
+#include "dfslib-fileio-p1.h"
+#include "dfslib-chunkstore-p1.h"
+#include "dfslib-metadata-p1.h"
 #include "dfslib-servernode-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
@@ -23,9 +40,538 @@ using grpc::ServerReader;
 using grpc::ServerWriter;
 using grpc::ServerContext;
 using grpc::ServerBuilder;
+using grpc::ByteBuffer;
+using grpc::CallbackServerContext;
+using grpc::ServerWriteReactor;
 
 using dfs_service::DFSService;
 
+#define DFS_MMAP_CACHE_ENTRIES 64
+#define DFS_COMPRESSED_MAGIC 0x5a534644 // "DFSZ"
+#define DFS_OPEN_ATTEMPTS 3             // opens retried while commits keep replacing a file
+
+/**
+ * The set of resumable uploads currently being written, so that a
+ * transfer id is only ever appended to by one Store stream at a time.
+ */
+class DFSTransferRegistry {
+
+private:
+    std::mutex registry_mutex;
+    std::set<std::string> active;
+
+public:
+    bool Claim(const std::string& transfer_id) {
+        std::lock_guard<std::mutex> lock(this->registry_mutex);
+        return this->active.insert(transfer_id).second;
+    }
+
+    void Release(const std::string& transfer_id) {
+        std::lock_guard<std::mutex> lock(this->registry_mutex);
+        this->active.erase(transfer_id);
+    }
+
+};
+
+/**
+ * Server-side cursors for paginated listings.
+ *
+ * The first ListPage call takes a sorted snapshot of the matching names.
+ * Later pages walk that snapshot, so a listing stays consistent while
+ * files come and go. A cursor is "<listing id>:<position>", so a retried
+ * page request returns the same page. Listings idle for longer than
+ * DFS_LIST_CURSOR_TTL are dropped, and so is the least recently used one
+ * once DFS_LIST_CURSORS are open.
+ */
+class DFSListCursors {
+
+private:
+    struct Listing {
+        std::shared_ptr<const std::vector<std::string>> names;
+        std::chrono::steady_clock::time_point used;
+    };
+
+    std::mutex cursor_mutex;
+    std::map<uint64_t, Listing> listings;
+    std::mt19937_64 ids{std::random_device{}()};
+
+    void Expire(std::chrono::steady_clock::time_point now) {
+        for (auto listing = this->listings.begin(); listing != this->listings.end();) {
+            if (now - listing->second.used > std::chrono::seconds(DFS_LIST_CURSOR_TTL)) {
+                listing = this->listings.erase(listing);
+            } else {
+                ++listing;
+            }
+        }
+        while (this->listings.size() >= DFS_LIST_CURSORS) {
+            auto oldest = std::min_element(this->listings.begin(), this->listings.end(),
+                [](const std::pair<const uint64_t, Listing>& a, const std::pair<const uint64_t, Listing>& b) {
+                    return a.second.used < b.second.used;
+                });
+            this->listings.erase(oldest);
+        }
+    }
+
+public:
+    /**
+     * Keep a listing for later pages
+     *
+     * @param names
+     * @return the listing id
+     */
+    uint64_t Open(std::shared_ptr<const std::vector<std::string>> names) {
+        std::lock_guard<std::mutex> lock(this->cursor_mutex);
+        auto now = std::chrono::steady_clock::now();
+        Expire(now);
+        uint64_t id;
+        do {
+            id = this->ids();
+        } while (id == 0 || this->listings.count(id) > 0);
+        this->listings[id] = Listing{std::move(names), now};
+        return id;
+    }
+
+    /**
+     * Look up an open listing
+     *
+     * @param id
+     * @return nullptr if the listing expired or never existed
+     */
+    std::shared_ptr<const std::vector<std::string>> Find(uint64_t id) {
+        std::lock_guard<std::mutex> lock(this->cursor_mutex);
+        auto listing = this->listings.find(id);
+        if (listing == this->listings.end()) {
+            return nullptr;
+        }
+        listing->second.used = std::chrono::steady_clock::now();
+        return listing->second.names;
+    }
+
+    /**
+     * Drop a listing once its last page has been served
+     *
+     * @param id
+     */
+    void Close(uint64_t id) {
+        std::lock_guard<std::mutex> lock(this->cursor_mutex);
+        this->listings.erase(id);
+    }
+
+    static std::string Format(uint64_t id, size_t position) {
+        std::ostringstream cursor;
+        cursor << std::hex << id << ':' << std::dec << position;
+        return cursor.str();
+    }
+
+    static bool Parse(const std::string& cursor, uint64_t* id, size_t* position) {
+        size_t colon = cursor.find(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == cursor.size() ||
+            cursor.find_first_not_of("0123456789abcdef:") != std::string::npos) {
+            return false;
+        }
+        try {
+            *id = std::stoull(cursor.substr(0, colon), nullptr, 16);
+            *position = std::stoull(cursor.substr(colon + 1), nullptr, 10);
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+};
+
+/**
+ * A compressed copy of a stored file, kept under DFS_COMPRESSED_DIR so
+ * compressed fetches are answered from disk without recompressing.
+ *
+ * The copy is a header naming the raw file version it was built from
+ * (inode, size and mtime), followed by each chunk as a length-prefixed
+ * serialized FileChunk. A copy whose header no longer matches the raw
+ * file is ignored.
+ */
+class DFSCompressedCopy {
+
+private:
+    struct Header {
+        uint32_t magic;
+        uint32_t largest_chunk;
+        uint64_t inode;
+        uint64_t size;
+        int64_t mtime_ns;
+    };
+
+    std::string staging_path;
+    std::ofstream out;
+    Header header;
+    bool compressed;
+
+    static bool Matches(const Header& header, const struct stat& raw_stat) {
+        return header.magic == DFS_COMPRESSED_MAGIC &&
+            header.inode == static_cast<uint64_t>(raw_stat.st_ino) &&
+            header.size == static_cast<uint64_t>(raw_stat.st_size) &&
+            header.mtime_ns == raw_stat.st_mtim.tv_sec * 1000000000LL + raw_stat.st_mtim.tv_nsec;
+    }
+
+public:
+    DFSCompressedCopy() : header{DFS_COMPRESSED_MAGIC, 0, 0, 0, 0}, compressed(false) {}
+
+    ~DFSCompressedCopy() {
+        Abandon();
+    }
+
+    /**
+     * Start recording chunks into a staging file
+     *
+     * @param staging_dir
+     * @return
+     */
+    bool Begin(const std::string& staging_dir) {
+        this->staging_path = staging_dir + DFS_STAGING_TEMPLATE;
+        int fd = mkstemp(&this->staging_path[0]);
+        if (fd < 0) {
+            this->staging_path.clear();
+            return false;
+        }
+        close(fd);
+
+        // The header is rewritten once the raw file version is known
+        this->out.open(this->staging_path, std::ios::binary | std::ios::trunc);
+        this->out.write(reinterpret_cast<const char*>(&this->header), sizeof(this->header));
+        return this->out.good();
+    }
+
+    bool Recording() const {
+        return !this->staging_path.empty();
+    }
+
+    /**
+     * Record a chunk as it goes over the wire
+     *
+     * @param chunk
+     */
+    void Append(const dfs_service::FileChunk& chunk) {
+        if (!Recording()) {
+            return;
+        }
+        std::string record = chunk.SerializeAsString();
+        uint32_t length = record.size();
+        this->out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        this->out.write(record.data(), record.size());
+        this->header.largest_chunk = std::max(this->header.largest_chunk, chunk.raw_size());
+        this->compressed = this->compressed || chunk.codec() != dfs_service::CODEC_NONE;
+    }
+
+    /**
+     * Publish the recording as the compressed copy of the raw file version
+     * described by `raw_stat`. Recordings that saved nothing are dropped.
+     *
+     * @param copy_path
+     * @param raw_stat
+     * @return
+     */
+    bool Commit(const std::string& copy_path, const struct stat& raw_stat) {
+        if (!Recording() || !this->compressed) {
+            Abandon();
+            return false;
+        }
+
+        this->header.inode = raw_stat.st_ino;
+        this->header.size = raw_stat.st_size;
+        this->header.mtime_ns = raw_stat.st_mtim.tv_sec * 1000000000LL + raw_stat.st_mtim.tv_nsec;
+        this->out.seekp(0);
+        this->out.write(reinterpret_cast<const char*>(&this->header), sizeof(this->header));
+        this->out.close();
+
+        if (this->out.fail() || rename(this->staging_path.c_str(), copy_path.c_str()) != 0) {
+            Abandon();
+            return false;
+        }
+        this->staging_path.clear();
+        return true;
+    }
+
+    void Abandon() {
+        if (Recording()) {
+            this->out.close();
+            unlink(this->staging_path.c_str());
+            this->staging_path.clear();
+        }
+    }
+
+    /**
+     * Stream the compressed copy of a file. Returns false without writing
+     * anything if there is no current copy or its chunks exceed `chunk_limit`;
+     * otherwise `status` holds the outcome of the stream.
+     *
+     * @param copy_path
+     * @param raw_path
+     * @param filename
+     * @param chunk_limit
+     * @param context
+     * @param writer
+     * @param status
+     * @return
+     */
+    static bool Stream(const std::string& copy_path, const std::string& raw_path,
+                       const std::string& filename, uint32_t chunk_limit,
+                       ServerContext* context, ServerWriter<dfs_service::FileChunk>* writer, Status* status) {
+
+        std::ifstream in(copy_path, std::ios::binary);
+        Header header;
+        struct stat raw_stat;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+                stat(raw_path.c_str(), &raw_stat) != 0 || !Matches(header, raw_stat) ||
+                (chunk_limit > 0 && header.largest_chunk > chunk_limit)) {
+            return false;
+        }
+
+        dfs_log(LL_DEBUG) << "Serving stored compressed copy of " << filename;
+
+        dfs_service::FileChunk chunk;
+        std::string record;
+        uint32_t length;
+        while (in.read(reinterpret_cast<char*>(&length), sizeof(length))) {
+            if (context->IsCancelled()) {
+                *status = Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+                return true;
+            }
+            record.resize(length);
+            if (!in.read(&record[0], length) || !chunk.ParseFromString(record)) {
+                dfs_log(LL_ERROR) << "Corrupt compressed copy: " << copy_path;
+                *status = Status(StatusCode::DATA_LOSS, "Corrupt compressed copy");
+                return true;
+            }
+            chunk.set_filename(filename);
+            chunk.clear_transfer_id();
+            if (!writer->Write(chunk)) {
+                *status = Status(StatusCode::INTERNAL, "Failed to write chunk");
+                return true;
+            }
+        }
+
+        *status = grpc::Status::OK;
+        return true;
+    }
+
+};
+
+/**
+ * A read-only mapping of a file in the mount path.
+ *
+ * Mappings are shared between concurrent FetchMapped streams and the
+ * slices handed to gRPC; the last reference unmaps the file.
+ */
+struct DFSMappedFile {
+    void* data;
+    size_t size;
+    ino_t inode;
+    struct timespec mtime;
+    /** The version mapped, as reported to clients **/
+    DFSFileAttributes attributes;
+
+    DFSMappedFile() : data(nullptr), size(0), inode(0), mtime{0, 0}, attributes() {}
+
+    ~DFSMappedFile() {
+        if (this->data != nullptr) {
+            munmap(this->data, this->size);
+        }
+    }
+
+    /** Whether the mapping still describes the file behind `st` **/
+    bool Matches(const struct stat& st) const {
+        return this->inode == st.st_ino && this->size == static_cast<size_t>(st.st_size) &&
+            this->mtime.tv_sec == st.st_mtim.tv_sec && this->mtime.tv_nsec == st.st_mtim.tv_nsec;
+    }
+};
+
+/**
+ * LRU cache of file mappings so hot files are mapped once and then
+ * served to every reader straight from the page cache.
+ */
+class DFSMappedFileCache {
+
+private:
+    std::mutex cache_mutex;
+    std::list<std::string> lru;
+    std::map<std::string, std::pair<std::shared_ptr<DFSMappedFile>, std::list<std::string>::iterator>> entries;
+
+public:
+    /**
+     * Return a current mapping for the file, mapping it if needed.
+     * Returns nullptr with errno set if the file can't be mapped.
+     * A deduplicated file is assembled into an anonymous mapping.
+     *
+     * @param filepath
+     * @param chunk_store nullptr unless deduplication is enabled
+     * @return
+     */
+    std::shared_ptr<DFSMappedFile> Acquire(const std::string& filepath, const DFSChunkStore* chunk_store) {
+        int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(this->cache_mutex);
+        auto entry = this->entries.find(filepath);
+        if (entry != this->entries.end()) {
+            if (entry->second.first->Matches(st)) {
+                this->lru.splice(this->lru.begin(), this->lru, entry->second.second);
+                close(fd);
+                return entry->second.first;
+            }
+            this->lru.erase(entry->second.second);
+            this->entries.erase(entry);
+        }
+
+        auto mapped = std::make_shared<DFSMappedFile>();
+        mapped->size = st.st_size;
+        mapped->inode = st.st_ino;
+        mapped->mtime = st.st_mtim;
+        DFSFileAttributesFromStat(st, &mapped->attributes);
+        bool deduplicated = chunk_store && !chunk_store->ManifestId(fd).empty();
+        std::unique_ptr<DFSFileReader> chunks = deduplicated ? chunk_store->OpenRead(fd, 0) : nullptr;
+        if (deduplicated && !chunks) {
+            close(fd);
+            return nullptr;
+        }
+        if (mapped->size > 0 && chunks) {
+            void* data = mmap(nullptr, mapped->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                return nullptr;
+            }
+            mapped->data = data;
+            size_t filled = 0;
+            const char* view;
+            ssize_t count;
+            while (filled < mapped->size && (count = chunks->Next(mapped->size - filled, &view)) > 0) {
+                memcpy(static_cast<char*>(data) + filled, view, count);
+                filled += count;
+            }
+            if (filled != mapped->size) {
+                close(fd);
+                return nullptr;
+            }
+            mprotect(data, mapped->size, PROT_READ);
+        } else if (mapped->size > 0) {
+            void* data = mmap(nullptr, mapped->size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                return nullptr;
+            }
+            mapped->data = data;
+            madvise(data, mapped->size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+
+        this->lru.push_front(filepath);
+        this->entries[filepath] = std::make_pair(mapped, this->lru.begin());
+        if (this->entries.size() > DFS_MMAP_CACHE_ENTRIES) {
+            this->entries.erase(this->lru.back());
+            this->lru.pop_back();
+        }
+        return mapped;
+    }
+
+};
+
+/**
+ * Server-streaming reactor for FetchMapped.
+ *
+ * Each FileChunk is written as a raw ByteBuffer of two slices: a few
+ * bytes of protobuf framing, and a slice that aliases the mapping. The
+ * slice holds a reference to the mapping, so the bytes go from the page
+ * cache to the transport without being copied into a message first.
+ */
+class DFSMappedFetchReactor : public ServerWriteReactor<ByteBuffer> {
+
+private:
+    std::shared_ptr<DFSMappedFile> file;
+    std::string filename;
+    DFSChunkSizer sizer;
+    size_t offset;
+    ByteBuffer buffer;
+    std::chrono::steady_clock::time_point write_start;
+
+    static void ReleaseMapping(void* user_data) {
+        delete static_cast<std::shared_ptr<DFSMappedFile>*>(user_data);
+    }
+
+    void NextWrite() {
+        if (this->offset >= this->file->size) {
+            dfs_log(LL_DEBUG) << "File fetched successfully: " << this->filename;
+            Finish(Status::OK);
+            return;
+        }
+
+        size_t chunk_size = this->sizer.ChunkSize();
+        size_t length = std::min(chunk_size, this->file->size - this->offset);
+
+        // Everything but the data field is serialized normally; the data
+        // field's tag and length are appended by hand so its payload can be
+        // a separate slice
+        dfs_service::FileChunk header;
+        header.set_filename(this->filename);
+        header.set_chunk_size(chunk_size);
+        header.set_offset(this->offset);
+        if (this->offset == 0) {
+            header.set_mtime_ns(this->file->attributes.mtime_ns);
+            header.set_generation(this->file->attributes.generation);
+            header.set_file_size(this->file->size);
+        }
+        std::string framing = header.SerializeAsString();
+        uint8_t prefix[16];
+        uint8_t* end = google::protobuf::io::CodedOutputStream::WriteTagToArray(
+            (dfs_service::FileChunk::kDataFieldNumber << 3) | 2, prefix);
+        end = google::protobuf::io::CodedOutputStream::WriteVarint32ToArray(
+            static_cast<uint32_t>(length), end);
+        framing.append(reinterpret_cast<char*>(prefix), end - prefix);
+
+        grpc::Slice slices[2] = {
+            grpc::Slice(framing),
+            grpc::Slice(static_cast<char*>(this->file->data) + this->offset, length,
+                        &DFSMappedFetchReactor::ReleaseMapping,
+                        new std::shared_ptr<DFSMappedFile>(this->file))
+        };
+        this->buffer = ByteBuffer(slices, 2);
+        this->offset += length;
+
+        this->write_start = std::chrono::steady_clock::now();
+        StartWrite(&this->buffer);
+    }
+
+public:
+    DFSMappedFetchReactor(std::shared_ptr<DFSMappedFile> file, const std::string& filename, size_t max_chunk_size) :
+        file(file), filename(filename), sizer(max_chunk_size), offset(0) {
+        NextWrite();
+    }
+
+    DFSMappedFetchReactor(const Status& status) : offset(0) {
+        Finish(status);
+    }
+
+    void OnWriteDone(bool ok) override {
+        if (!ok) {
+            dfs_log(LL_ERROR) << "Failed to write chunk";
+            Finish(Status(StatusCode::CANCELLED, "Failed to write chunk"));
+            return;
+        }
+        this->sizer.RecordWrite(this->buffer.Length(), std::chrono::steady_clock::now() - this->write_start);
+        NextWrite();
+    }
+
+    void OnDone() override {
+        delete this;
+    }
+
+};
+
 
 //
 // STUDENT INSTRUCTION:
@@ -57,27 +603,405 @@ using dfs_service::DFSService;
 //          /** code implementation here **/
 //      }
 //
-class DFSServiceImpl final : public DFSService::Service {
+class DFSServiceImpl final : public DFSService::WithRawCallbackMethod_FetchMapped<DFSService::Service> {
+
+private:
+
+    /** The mount path for the server **/
+    std::string mount_path;
+
+    /** Mappings of recently fetched files for FetchMapped **/
+    DFSMappedFileCache mapped_files;
+
+    /** Resumable uploads with an active Store stream **/
+    DFSTransferRegistry transfers;
+
+    /** Open paginated listings **/
+    DFSListCursors list_cursors;
+
+    /** The largest chunk size this server will send or accept **/
+    size_t max_chunk_size;
+
+    /** How stored files are flushed before they are renamed into place **/
+    dfs_durability_e durability;
+
+    /** Backend for reading and writing file contents **/
+    std::unique_ptr<DFSFileIO> file_io;
+
+    /** Uploads expected to be at least this large are written with O_DIRECT (0 = never) **/
+    uint64_t direct_io_threshold;
+
+    /** Deduplicating store for committed files, or nullptr to keep them flat **/
+    std::unique_ptr<DFSChunkStore> chunk_store;
+
+    /** Attributes of the files in the mount path, for listings and Stat **/
+    DFSMetadataIndex index;
+
+    /**
+     * Prepend the mount path to the filename.
+     *
+     * @param filepath
+     * @return
+     */
+    const std::string WrapPath(const std::string &filepath) {
+        return this->mount_path + filepath;
+    }
+
+    /**
+     * Path of the partial upload for a transfer id
+     *
+     * @param transfer_id
+     * @return
+     */
+    const std::string TransferPath(const std::string &transfer_id) {
+        return this->mount_path + DFS_TRANSFER_DIR + transfer_id;
+    }
+
+    /**
+     * Path of the compressed copy of a file
+     *
+     * @param filename
+     * @return
+     */
+    const std::string CompressedPath(const std::string &filename) {
+        return this->mount_path + DFS_COMPRESSED_DIR + filename;
+    }
+
+    /**
+     * Open a stored file for reading, through the chunk store if it has
+     * been deduplicated. The manifest comes from the opened file, so a
+     * commit replacing the file at the same time can't pair one version's
+     * placeholder with another's manifest.
+     *
+     * @param full_path
+     * @param offset
+     * @return nullptr if the file can't be opened or was replaced meanwhile
+     */
+    std::unique_ptr<DFSFileReader> OpenStored(const std::string &full_path, uint64_t offset) {
+        if (!this->chunk_store) {
+            return this->file_io->OpenRead(full_path, offset);
+        }
+
+        int fd = open(full_path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat opened;
+        if (fd < 0 || fstat(fd, &opened) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return nullptr;
+        }
+        std::unique_ptr<DFSFileReader> reader;
+        if (!this->chunk_store->ManifestId(fd).empty()) {
+            reader = this->chunk_store->OpenRead(fd, offset);
+        } else {
+            // The backend opens by path; make sure it got the flat file we checked
+            reader = this->file_io->OpenRead(full_path, offset);
+            struct stat current;
+            if (stat(full_path.c_str(), &current) != 0 || current.st_ino != opened.st_ino) {
+                reader.reset();
+            }
+        }
+        close(fd);
+        return reader;
+    }
+
+    /**
+     * Create an empty staging file for an upload. Staging next to the
+     * mount keeps the final rename on one filesystem, and the committed
+     * file is a fresh inode, so an mmap'd view held by FetchMapped keeps
+     * the old contents.
+     *
+     * @param staged_path set to the new file's path
+     * @return an open descriptor for the file, or -1
+     */
+    int StageUpload(std::string* staged_path) {
+        std::string staging = this->mount_path + DFS_TRANSFER_DIR + DFS_STAGING_TEMPLATE;
+        int fd = mkstemp(&staging[0]);
+        if (fd < 0) {
+            return -1;
+        }
+        fchmod(fd, 0644);
+        *staged_path = staging;
+        return fd;
+    }
+
+    /**
+     * Make renames into the mount path durable
+     */
+    void SyncMountPath() {
+        int dir_fd = open(this->mount_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+    }
+
+    /**
+     * Flush a staged upload according to the durability policy and
+     * atomically rename it over its final path. Readers see either the
+     * previous version or the complete new one, never a torn file.
+     *
+     * @param staged_path
+     * @param full_path
+     * @param sync_dir whether to sync the directory entry now, or leave it
+     *                 to the caller to sync once for a batch of commits
+     * @return
+     */
+    bool CommitUpload(const std::string &staged_path, const std::string &full_path, bool sync_dir = true) {
+        // A failed move into the chunk store leaves the upload flat, which
+        // is still correct. The replaced version's manifest is left to the
+        // chunk store's sweep, which keeps it while readers still stream it.
+        if (this->chunk_store) {
+            this->chunk_store->Deduplicate(staged_path);
+        }
+
+        if (this->durability != DURABILITY_NONE) {
+            int fd = open(staged_path.c_str(), O_RDONLY | O_CLOEXEC);
+            int synced = fd < 0 ? -1 : (this->durability == DURABILITY_FULL ? fsync(fd) : fdatasync(fd));
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (synced != 0) {
+                dfs_log(LL_ERROR) << "Could not flush staged upload: " << staged_path;
+                return false;
+            }
+        }
+
+        if (rename(staged_path.c_str(), full_path.c_str()) != 0) {
+            dfs_log(LL_ERROR) << "Could not rename " << staged_path << " to " << full_path;
+            return false;
+        }
+        this->index.Refresh(full_path.substr(this->mount_path.size()));
+
+        // Make the new directory entry itself durable
+        if (this->durability == DURABILITY_FULL && sync_dir) {
+            SyncMountPath();
+        }
+        return true;
+    }
+
+    /**
+     * Create the transfer directory and drop partial uploads that
+     * haven't been resumed within DFS_TRANSFER_TTL
+     */
+    void SweepTransfers() {
+        std::string transfer_dir = this->mount_path + DFS_TRANSFER_DIR;
+        if (mkdir(transfer_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            dfs_log(LL_ERROR) << "Could not create transfer directory: " << transfer_dir;
+            return;
+        }
+
+        DIR* dir = opendir(transfer_dir.c_str());
+        if (!dir) {
+            return;
+        }
+        time_t now = time(nullptr);
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            struct stat st;
+            std::string partial_path = transfer_dir + entry->d_name;
+            // Staged uploads left by a crash can never be committed
+            bool staged = strncmp(entry->d_name, DFS_STAGING_TEMPLATE, strlen(DFS_STAGING_TEMPLATE) - 6) == 0;
+            if (entry->d_type == DT_REG && stat(partial_path.c_str(), &st) == 0 &&
+                    (staged || now - st.st_mtime > DFS_TRANSFER_TTL)) {
+                dfs_log(LL_DEBUG) << "Removing abandoned partial upload: " << entry->d_name;
+                unlink(partial_path.c_str());
+            }
+        }
+        closedir(dir);
+    }
+
+    /**
+     * Stream `length` bytes of a file starting at `offset` (0 = to the end)
+     * in adaptively sized chunks no larger than the client's `chunk_limit`.
+     *
+     * Chunks are compressed when the client accepts `codec` and the data
+     * looks compressible. Whole-file compressed fetches are served from, or
+     * recorded into, the file's compressed copy.
+     *
+     * The first chunk names the version being sent, and a caller resuming a
+     * download can insist on the version it already holds part of.
+     *
+     * @param context
+     * @param filename
+     * @param offset
+     * @param length
+     * @param chunk_limit
+     * @param codec
+     * @param expected_mtime_ns with `expected_generation`, the version required (0 = any)
+     * @param expected_generation
+     * @param writer
+     * @return FAILED_PRECONDITION if the file is no longer the expected version
+     */
+    Status StreamFile(ServerContext* context,
+                      const std::string& filename,
+                      uint64_t offset,
+                      uint64_t length,
+                      uint32_t chunk_limit,
+                      dfs_service::Codec codec,
+                      int64_t expected_mtime_ns,
+                      uint64_t expected_generation,
+                      ServerWriter<dfs_service::FileChunk>* writer) {
+
+        std::string full_path = WrapPath(filename);
+
+        dfs_log(LL_DEBUG) << "Fetching file: " << full_path << " [" << offset << ", +" << length << "]";
+
+        bool whole_file = offset == 0 && length == 0;
+        bool versioned = expected_mtime_ns != 0 || expected_generation != 0;
+        Status copy_status;
+        if (codec != dfs_service::CODEC_NONE && whole_file && !versioned &&
+                DFSCompressedCopy::Stream(CompressedPath(filename), full_path, filename,
+                                          chunk_limit, context, writer, &copy_status)) {
+            return copy_status;
+        }
+
+        // Commits rename a fresh inode into place, so the same attributes
+        // before and after the open mean the reader has that version
+        struct stat raw_stat;
+        bool have_stat = false;
+        std::unique_ptr<DFSFileReader> infile;
+        for (int attempt = 0; attempt < DFS_OPEN_ATTEMPTS && !have_stat; attempt++) {
+            struct stat opened_stat;
+            infile.reset();
+            if (stat(full_path.c_str(), &raw_stat) != 0) {
+                break;
+            }
+            infile = OpenStored(full_path, offset);
+            have_stat = infile && stat(full_path.c_str(), &opened_stat) == 0 &&
+                opened_stat.st_ino == raw_stat.st_ino && opened_stat.st_size == raw_stat.st_size &&
+                opened_stat.st_mtim.tv_sec == raw_stat.st_mtim.tv_sec &&
+                opened_stat.st_mtim.tv_nsec == raw_stat.st_mtim.tv_nsec &&
+                opened_stat.st_ctim.tv_sec == raw_stat.st_ctim.tv_sec &&
+                opened_stat.st_ctim.tv_nsec == raw_stat.st_ctim.tv_nsec;
+        }
+        if (!infile) {
+            dfs_log(LL_ERROR) << "Could not open file: " << full_path;
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        if (!have_stat) {
+            return Status(StatusCode::UNAVAILABLE, "File is being replaced");
+        }
+
+        DFSFileAttributes version;
+        DFSFileAttributesFromStat(raw_stat, &version);
+        if (versioned && (version.mtime_ns != expected_mtime_ns || version.generation != expected_generation)) {
+            dfs_log(LL_DEBUG) << "Refusing range of " << filename << ": the file changed";
+            return Status(StatusCode::FAILED_PRECONDITION, "File changed");
+        }
+
+        // Check for deadline exceeded
+        if (context->IsCancelled()) {
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+        }
+
+        if (have_stat && offset > static_cast<uint64_t>(raw_stat.st_size)) {
+            return Status(StatusCode::OUT_OF_RANGE, "Offset past end of file");
+        }
+        uint64_t remaining = length > 0 ? length : UINT64_MAX;
+
+        // Read file in adaptively sized chunks and stream to client,
+        // never exceeding what the client said it can receive
+        DFSChunkSizer sizer(this->max_chunk_size);
+        sizer.LimitCeiling(chunk_limit);
+
+        dfs_service::FileChunk chunk;
+        chunk.set_filename(filename);
+        size_t largest_chunk = 0;
+        bool first_chunk = true;
+        DFSCompressedCopy copy;
+
+        while (remaining > 0) {
+            size_t chunk_size = sizer.ChunkSize();
+            size_t read_size = std::min<uint64_t>(chunk_size, remaining);
+
+            // Gather the chunk straight from the backend's buffers
+            std::string* data = chunk.mutable_data();
+            data->clear();
+            while (data->size() < read_size) {
+                const char* view;
+                ssize_t count = infile->Next(read_size - data->size(), &view);
+                if (count < 0) {
+                    dfs_log(LL_ERROR) << "Could not read file: " << full_path;
+                    return Status(StatusCode::INTERNAL, "Could not read file");
+                }
+                if (count == 0) {
+                    break;
+                }
+                data->append(view, count);
+            }
+            size_t raw_size = data->size();
+            if (raw_size == 0) {
+                break;
+            }
+
+            if (first_chunk) {
+                first_chunk = false;
+                chunk.set_mtime_ns(version.mtime_ns);
+                chunk.set_generation(version.generation);
+                chunk.set_file_size(version.size);
+                if (codec != dfs_service::CODEC_NONE) {
+                    codec = DFSSelectCodec(filename, data->data(), raw_size);
+                }
+                if (codec != dfs_service::CODEC_NONE && whole_file && have_stat) {
+                    copy.Begin(this->mount_path + DFS_TRANSFER_DIR);
+                }
+            }
+
+            chunk.set_chunk_size(chunk_size);
+            chunk.set_offset(offset);
+            DFSCompressChunk(&chunk, codec);
+            copy.Append(chunk);
+
+            auto write_start = std::chrono::steady_clock::now();
+            if (!writer->Write(chunk)) {
+                dfs_log(LL_ERROR) << "Failed to write chunk";
+                return Status(StatusCode::INTERNAL, "Failed to write chunk");
+            }
+            sizer.RecordWrite(raw_size, std::chrono::steady_clock::now() - write_start);
+            largest_chunk = std::max(largest_chunk, chunk_size);
+            offset += raw_size;
+            remaining -= raw_size;
+            chunk.clear_data();
+            chunk.clear_mtime_ns();
+            chunk.clear_generation();
+            chunk.clear_file_size();
+        }
 
-private:
+        infile.reset();
 
-    /** The mount path for the server **/
-    std::string mount_path;
+        // Keep the compressed stream if the file didn't change underneath us
+        struct stat end_stat;
+        if (copy.Recording() && stat(full_path.c_str(), &end_stat) == 0 &&
+                end_stat.st_ino == raw_stat.st_ino && end_stat.st_size == raw_stat.st_size &&
+                end_stat.st_mtim.tv_sec == raw_stat.st_mtim.tv_sec &&
+                end_stat.st_mtim.tv_nsec == raw_stat.st_mtim.tv_nsec) {
+            copy.Commit(CompressedPath(filename), raw_stat);
+        }
 
-    /**
-     * Prepend the mount path to the filename.
-     *
-     * @param filepath
-     * @return
-     */
-    const std::string WrapPath(const std::string &filepath) {
-        return this->mount_path + filepath;
+        dfs_log(LL_DEBUG) << "File fetched successfully: " << filename << " (chunk size " << largest_chunk << ")";
+        return grpc::Status::OK;
     }
 
 
 public:
 
-    DFSServiceImpl(const std::string &mount_path): mount_path(mount_path) {
+    DFSServiceImpl(const std::string &mount_path, size_t max_chunk_size, dfs_durability_e durability,
+                   const std::string &io_backend, uint64_t direct_io_threshold, bool deduplicate):
+        mount_path(mount_path), max_chunk_size(max_chunk_size), durability(durability),
+        file_io(DFSCreateFileIO(io_backend)), direct_io_threshold(direct_io_threshold), index(mount_path) {
+        dfs_log(LL_SYSINFO) << "Using " << this->file_io->Name() << " file I/O";
+        SweepTransfers();
+        if (deduplicate) {
+            this->chunk_store.reset(new DFSChunkStore(this->mount_path, this->durability));
+            this->chunk_store->Sweep();
+            this->chunk_store->SweepEvery(DFS_CHUNK_SWEEP_INTERVAL);
+        }
+        std::string compressed_dir = this->mount_path + DFS_COMPRESSED_DIR;
+        if (mkdir(compressed_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            dfs_log(LL_ERROR) << "Could not create compressed copy directory: " << compressed_dir;
+        }
+        this->index.Start();
     }
 
     ~DFSServiceImpl() {}
@@ -98,96 +1022,442 @@ public:
 
         dfs_service::FileChunk chunk;
         std::string filename;
-        std::ofstream outfile;
+        std::string transfer_id;
+        std::string write_path;
+        std::unique_ptr<DFSFileWriter> outfile;
+        size_t largest_chunk = 0;
+        DFSCompressedCopy copy;
+
+        // Advertise our ceiling and codecs so the client can prepare its chunks before the first write
+        context->AddInitialMetadata(DFS_CHUNK_SIZE_METADATA, std::to_string(this->max_chunk_size));
+        context->AddInitialMetadata(DFS_CODECS_METADATA, "deflate");
+        reader->SendInitialMetadata();
+
+        // Release our claim on the transfer id and drop an uncommitted
+        // staging file however the stream ends
+        std::string staged_path;
+        std::shared_ptr<void> release_transfer(nullptr, [&](void*) {
+            if (!transfer_id.empty()) {
+                this->transfers.Release(transfer_id);
+            }
+            if (!staged_path.empty()) {
+                unlink(staged_path.c_str());
+            }
+        });
 
         // Read all chunks and write to file
         while (reader->Read(&chunk)){
             if (context->IsCancelled()) {
-                if (outfile.is_open()) {
-                    outfile.close();
-                }
-                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+                break;
             }
 
             if (filename.empty()){
                 filename = chunk.filename();
                 std::string full_path = WrapPath(filename);
 
-                // Open file for writing (binary mode)
-                outfile.open(full_path, std::ios::binary);
-                if (!outfile.is_open()){
-                    dfs_log(LL_ERROR) << "Could not open file: " << full_path;
+                // Reserve the whole file up front, and keep very large
+                // uploads out of the page cache when configured to
+                DFSWriteOptions options;
+                options.expected_size = chunk.expected_size();
+                options.direct = this->direct_io_threshold > 0 &&
+                    chunk.expected_size() >= this->direct_io_threshold;
+
+                if (!chunk.transfer_id().empty()) {
+                    // Resumable upload: append to the partial file from the
+                    // client's offset, discarding anything after it
+                    if (!DFSValidTransferId(chunk.transfer_id())) {
+                        return Status(StatusCode::INVALID_ARGUMENT, "Malformed transfer id");
+                    }
+                    if (!this->transfers.Claim(chunk.transfer_id())) {
+                        return Status(StatusCode::ABORTED, "Transfer already in progress");
+                    }
+                    transfer_id = chunk.transfer_id();
+                    write_path = TransferPath(transfer_id);
+
+                    int64_t committed = std::max<int64_t>(GetFileSize(write_path), 0);
+                    if (chunk.offset() > static_cast<uint64_t>(committed)) {
+                        return Status(StatusCode::FAILED_PRECONDITION, "Resume offset past committed data");
+                    }
+                    if (committed > 0 && truncate(write_path.c_str(), chunk.offset()) != 0) {
+                        return Status(StatusCode::INTERNAL, "Could not rewind partial upload");
+                    }
+                    outfile = this->file_io->OpenWrite(write_path, true, options);
+                    dfs_log(LL_DEBUG) << "Storing file: " << full_path << " (transfer " << transfer_id
+                                      << " from offset " << chunk.offset() << ")";
+                } else {
+                    int fd = StageUpload(&staged_path);
+                    if (fd < 0) {
+                        dfs_log(LL_ERROR) << "Could not create staging file for: " << full_path;
+                        return Status(StatusCode::INTERNAL, "Could not stage upload");
+                    }
+                    close(fd);
+                    write_path = staged_path;
+                    outfile = this->file_io->OpenWrite(write_path, false, options);
+                    dfs_log(LL_DEBUG) << "Storing file: " << full_path << " (staged as " << write_path << ")";
+                }
+
+                if (!outfile){
+                    dfs_log(LL_ERROR) << "Could not open file: " << write_path;
                     return Status(StatusCode::INTERNAL, "Could not open file for writing");
                 }
-                dfs_log(LL_DEBUG) << "Storing file: " << full_path;
+
+                // A compressed upload of the whole file is kept as-is for compressed fetches
+                if (chunk.codec() != dfs_service::CODEC_NONE && chunk.offset() == 0) {
+                    copy.Begin(this->mount_path + DFS_TRANSFER_DIR);
+                }
+            }
+
+            // Chunks the client knows we hold are copied from the chunk store
+            if (chunk.chunk_refs_size() > 0) {
+                copy.Abandon();
+                std::string data;
+                for (const std::string& hash : chunk.chunk_refs()) {
+                    if (!this->chunk_store || !this->chunk_store->Read(hash, &data)) {
+                        return Status(StatusCode::FAILED_PRECONDITION, "Unknown chunk reference");
+                    }
+                    if (!outfile->Write(data.data(), data.size())) {
+                        dfs_log(LL_ERROR) << "Could not write to file: " << write_path;
+                        return Status(StatusCode::INTERNAL, "Could not write file");
+                    }
+                }
+                continue;
+            }
+
+            copy.Append(chunk);
+            if (!DFSDecompressChunk(&chunk, this->max_chunk_size)) {
+                dfs_log(LL_ERROR) << "Could not decode chunk of " << filename;
+                return Status(StatusCode::DATA_LOSS, "Corrupt compressed chunk");
             }
 
             // Write chunk to file
             if (!chunk.data().empty()){
-                outfile.write(chunk.data().data(), chunk.data().size());
+                if (!outfile->Write(chunk.data().data(), chunk.data().size())) {
+                    dfs_log(LL_ERROR) << "Could not write to file: " << write_path;
+                    return Status(StatusCode::INTERNAL, "Could not write file");
+                }
+                largest_chunk = std::max(largest_chunk, chunk.data().size());
             }
         }
 
-        if (outfile.is_open()){
-            outfile.close();
+        bool written = true;
+        if (outfile){
+            written = outfile->Close();
+        }
+
+        // An interrupted resumable upload keeps its partial file so that
+        // the client can pick up where it left off
+        if (context->IsCancelled()) {
+            if (!transfer_id.empty()) {
+                dfs_log(LL_DEBUG) << "Store of " << filename << " interrupted; transfer " << transfer_id
+                                  << " holds " << GetFileSize(write_path) << " bytes";
+            }
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
 
+        if (!written) {
+            dfs_log(LL_ERROR) << "Could not write upload of " << filename << " to " << write_path;
+            return Status(StatusCode::INTERNAL, "Could not write file");
+        }
+        struct stat raw_stat;
+        if (filename.empty() || !CommitUpload(write_path, WrapPath(filename))) {
+            return Status(StatusCode::INTERNAL, "Could not commit upload");
+        }
+        staged_path.clear();
+        if (stat(WrapPath(filename).c_str(), &raw_stat) != 0) {
+            unlink(CompressedPath(filename).c_str());
+            return Status(StatusCode::INTERNAL, "Stored file vanished");
+        }
+        if (!copy.Commit(CompressedPath(filename), raw_stat)) {
+            unlink(CompressedPath(filename).c_str());
+        }
 
-        // return file status
-        std::string full_path = WrapPath(filename);
-        response->set_filename(filename);
-        response->set_size(GetFileSize(full_path));
-        response->set_mtime(GetFileModTime(full_path));
-        response->set_ctime(GetFileCreateTime(full_path));
+        // return file status, from the stat the compressed copy was keyed on
+        DFSFileAttributes attributes;
+        DFSFileAttributesFromStat(raw_stat, &attributes);
+        DFSFillFileStatus(filename, attributes, response);
+        response->set_chunk_size(largest_chunk);
 
-        dfs_log(LL_DEBUG) << "File stored successfully: " << filename;
+        dfs_log(LL_DEBUG) << "File stored successfully: " << filename << " (chunk size " << largest_chunk << ")";
         return grpc::Status::OK;
     }
 
     /*
-     * Fetch: Read file from disk and stream chunks to client
+     * StoreMany: Receive many files over one stream, committing each as
+     * soon as its last message arrives
      */
-    Status Fetch(ServerContext* context,
-                 const dfs_service::FileName* request,
-                 ServerWriter<dfs_service::FileChunk>* writer) override {
-        
-        std::string filename = request->name();
-        std::string full_path = WrapPath(filename);
-        
-        dfs_log(LL_DEBUG) << "Fetching file: " << full_path;
-        
-        // Check if file exists
-        std::ifstream infile(full_path, std::ios::binary);
-        if (!infile.is_open()) {
-            dfs_log(LL_ERROR) << "Could not open file: " << full_path;
-            return Status(StatusCode::NOT_FOUND, "File not found");
+    Status StoreMany(ServerContext* context,
+                     ServerReader<dfs_service::BatchChunk>* reader,
+                     dfs_service::BatchStatus* response) override {
+
+        context->AddInitialMetadata(DFS_CHUNK_SIZE_METADATA, std::to_string(this->max_chunk_size));
+        reader->SendInitialMetadata();
+
+        dfs_service::BatchChunk chunk;
+        std::string filename;
+        std::string staged_path;
+        std::unique_ptr<DFSFileWriter> outfile;
+        StatusCode code = StatusCode::OK;
+        bool committed = false;
+
+        // Drop the staging file of a file the stream ended in the middle of
+        std::shared_ptr<void> drop_staged(nullptr, [&](void*) {
+            outfile.reset();
+            if (!staged_path.empty()) {
+                unlink(staged_path.c_str());
+            }
+        });
+
+        while (reader->Read(&chunk)) {
+            if (context->IsCancelled()) {
+                break;
+            }
+
+            if (!chunk.filename().empty()) {
+                if (!filename.empty()) {
+                    return Status(StatusCode::INVALID_ARGUMENT, "File started before the previous one ended");
+                }
+                filename = chunk.filename();
+                code = StatusCode::OK;
+                int fd = StageUpload(&staged_path);
+                if (fd < 0) {
+                    dfs_log(LL_ERROR) << "Could not create staging file for: " << WrapPath(filename);
+                    code = StatusCode::INTERNAL;
+                } else if (chunk.last()) {
+                    // A file that arrived whole is written through the staging
+                    // descriptor without opening it again
+                    const char* data = chunk.data().data();
+                    size_t remaining = chunk.data().size();
+                    while (remaining > 0) {
+                        ssize_t written = write(fd, data, remaining);
+                        if (written < 0 && errno == EINTR) {
+                            continue;
+                        }
+                        if (written <= 0) {
+                            code = StatusCode::INTERNAL;
+                            break;
+                        }
+                        data += written;
+                        remaining -= written;
+                    }
+                    close(fd);
+                    chunk.clear_data();
+                } else {
+                    close(fd);
+                    outfile = this->file_io->OpenWrite(staged_path, false, DFSWriteOptions());
+                    if (!outfile) {
+                        code = StatusCode::INTERNAL;
+                    }
+                }
+            } else if (filename.empty()) {
+                return Status(StatusCode::INVALID_ARGUMENT, "Data before the first filename");
+            }
+
+            if (code == StatusCode::OK && outfile && !chunk.data().empty() &&
+                    !outfile->Write(chunk.data().data(), chunk.data().size())) {
+                code = StatusCode::INTERNAL;
+            }
+            if (!chunk.last()) {
+                continue;
+            }
+
+            if (outfile && !outfile->Close()) {
+                code = StatusCode::INTERNAL;
+            }
+            outfile.reset();
+
+            // The staging file is consumed by the commit or dropped here
+            std::string full_path = WrapPath(filename);
+            dfs_service::BatchResult* result = response->add_results();
+            result->mutable_status()->set_filename(filename);
+            if (code == StatusCode::OK && CommitUpload(staged_path, full_path, false)) {
+                committed = true;
+                unlink(CompressedPath(filename).c_str());
+                struct stat st;
+                if (stat(full_path.c_str(), &st) == 0) {
+                    result->mutable_status()->set_size(st.st_size);
+                    result->mutable_status()->set_mtime(st.st_mtime);
+                    result->mutable_status()->set_ctime(st.st_ctime);
+                }
+                dfs_log(LL_DEBUG) << "File stored successfully: " << filename;
+            } else {
+                unlink(staged_path.c_str());
+                code = code == StatusCode::OK ? StatusCode::INTERNAL : code;
+                dfs_log(LL_ERROR) << "Could not store " << filename << " in batch";
+            }
+            result->set_code(code);
+            staged_path.clear();
+            filename.clear();
         }
-        
-        // Check for deadline exceeded
+
+        // One directory sync covers every rename in the batch
+        if (committed && this->durability == DURABILITY_FULL) {
+            SyncMountPath();
+        }
+
         if (context->IsCancelled()) {
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
-        
-        // Read file in chunks and stream to client
-        char buffer[DFS_CHUNK_SIZE];
-        dfs_service::FileChunk chunk;
-        chunk.set_filename(filename);
-        
-        while (infile.read(buffer, DFS_CHUNK_SIZE) || infile.gcount() > 0) {
-            chunk.set_data(buffer, infile.gcount());
-            if (!writer->Write(chunk)) {
-                dfs_log(LL_ERROR) << "Failed to write chunk";
+        dfs_log(LL_DEBUG) << "Stored batch of " << response->results_size() << " files";
+        return grpc::Status::OK;
+    }
+
+    /*
+     * FetchMany: Stream many files to the client over one call
+     */
+    Status FetchMany(ServerContext* context,
+                     const dfs_service::FileNames* request,
+                     ServerWriter<dfs_service::BatchChunk>* writer) override {
+
+        size_t chunk_limit = this->max_chunk_size;
+        if (request->chunk_size() > 0) {
+            chunk_limit = std::min<size_t>(chunk_limit, request->chunk_size());
+        }
+
+        // Small files make for small messages; let gRPC coalesce them
+        grpc::WriteOptions options;
+        options.set_buffer_hint();
+
+        dfs_service::BatchChunk chunk;
+        for (const std::string& filename : request->names()) {
+            if (context->IsCancelled()) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+
+            chunk.Clear();
+            chunk.set_filename(filename);
+            std::unique_ptr<DFSFileReader> infile = OpenStored(WrapPath(filename), 0);
+            if (!infile) {
+                dfs_log(LL_DEBUG) << "Skipping missing file in batch: " << filename;
+                chunk.set_code(StatusCode::NOT_FOUND);
+                chunk.set_last(true);
+            }
+
+            while (!chunk.last()) {
+                std::string* data = chunk.mutable_data();
+                data->clear();
+                ssize_t count = 0;
+                while (data->size() < chunk_limit) {
+                    const char* view;
+                    count = infile->Next(chunk_limit - data->size(), &view);
+                    if (count <= 0) {
+                        break;
+                    }
+                    data->append(view, count);
+                }
+                if (count < 0) {
+                    dfs_log(LL_ERROR) << "Could not read file: " << WrapPath(filename);
+                    chunk.set_code(StatusCode::INTERNAL);
+                }
+                chunk.set_last(count <= 0);
+                if (!chunk.last()) {
+                    if (!writer->Write(chunk, options)) {
+                        return Status(StatusCode::INTERNAL, "Failed to write chunk");
+                    }
+                    chunk.clear_filename();
+                }
+            }
+
+            if (!writer->Write(chunk, options)) {
                 return Status(StatusCode::INTERNAL, "Failed to write chunk");
             }
-            chunk.clear_data();
         }
-        
-        infile.close();
-        
-        dfs_log(LL_DEBUG) << "File fetched successfully: " << filename;
+
+        dfs_log(LL_DEBUG) << "Fetched batch of " << request->names_size() << " files";
+        return grpc::Status::OK;
+    }
+
+    /*
+     * MissingChunks: Filter a list of chunks down to those not yet stored
+     */
+    Status MissingChunks(ServerContext* context,
+                         const dfs_service::ChunkList* request,
+                         dfs_service::ChunkList* response) override {
+
+        if (!this->chunk_store) {
+            return Status(StatusCode::UNIMPLEMENTED, "Deduplication is disabled");
+        }
+        for (const std::string& hash : request->hashes()) {
+            if (hash.size() != DFS_CHUNK_HASH_SIZE) {
+                return Status(StatusCode::INVALID_ARGUMENT, "Malformed chunk hash");
+            }
+            if (!this->chunk_store->Has(hash)) {
+                response->add_hashes(hash);
+            }
+        }
+
+        dfs_log(LL_DEBUG) << response->hashes_size() << " of " << request->hashes_size() << " chunks missing";
+        return grpc::Status::OK;
+    }
+
+    /*
+     * QueryTransfer: Report the committed offset of a resumable upload
+     */
+    Status QueryTransfer(ServerContext* context,
+                         const dfs_service::TransferRequest* request,
+                         dfs_service::TransferStatus* response) override {
+
+        if (!DFSValidTransferId(request->transfer_id())) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Malformed transfer id");
+        }
+
+        int64_t committed = GetFileSize(TransferPath(request->transfer_id()));
+        response->set_transfer_id(request->transfer_id());
+        response->set_committed_offset(std::max<int64_t>(committed, 0));
+
+        dfs_log(LL_DEBUG) << "Transfer " << request->transfer_id() << " committed at " << response->committed_offset();
         return grpc::Status::OK;
     }
 
+    /*
+     * Fetch: Read file from disk and stream chunks to client
+     */
+    Status Fetch(ServerContext* context,
+                 const dfs_service::FileName* request,
+                 ServerWriter<dfs_service::FileChunk>* writer) override {
+
+        return StreamFile(context, request->name(), 0, 0, request->chunk_size(), request->codec(), 0, 0, writer);
+    }
+
+    /*
+     * FetchRange: Stream one byte range of a file to the client
+     */
+    Status FetchRange(ServerContext* context,
+                      const dfs_service::FileRange* request,
+                      ServerWriter<dfs_service::FileChunk>* writer) override {
+
+        return StreamFile(context, request->name(), request->offset(), request->length(),
+                          request->chunk_size(), request->codec(), request->mtime_ns(),
+                          request->generation(), writer);
+    }
+
+    /*
+     * FetchMapped: Stream a file to the client straight out of an mmap'd view
+     */
+    ServerWriteReactor<ByteBuffer>* FetchMapped(CallbackServerContext* context,
+                                                const ByteBuffer* request_buffer) override {
+
+        dfs_service::FileName request;
+        ByteBuffer request_copy(*request_buffer);
+        if (!grpc::SerializationTraits<dfs_service::FileName>::Deserialize(&request_copy, &request).ok()) {
+            return new DFSMappedFetchReactor(Status(StatusCode::INVALID_ARGUMENT, "Malformed request"));
+        }
+
+        std::string full_path = WrapPath(request.name());
+        dfs_log(LL_DEBUG) << "Fetching mapped file: " << full_path;
+
+        std::shared_ptr<DFSMappedFile> file = this->mapped_files.Acquire(full_path, this->chunk_store.get());
+        if (!file) {
+            dfs_log(LL_ERROR) << "Could not map file: " << full_path;
+            return new DFSMappedFetchReactor(Status(StatusCode::NOT_FOUND, "File not found"));
+        }
+
+        size_t max_chunk_size = this->max_chunk_size;
+        if (request.chunk_size() > 0) {
+            max_chunk_size = std::min<size_t>(max_chunk_size, request.chunk_size());
+        }
+        return new DFSMappedFetchReactor(file, request.name(), max_chunk_size);
+    }
+
         /**
      * Delete: Remove a file from the server
      */
@@ -205,12 +1475,15 @@ public:
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
         
-        // Try to delete the file
+        // Try to delete the file; the chunk store's sweep reclaims its manifest
         if (std::remove(full_path.c_str()) != 0) {
             dfs_log(LL_ERROR) << "Could not delete file: " << full_path;
             return Status(StatusCode::NOT_FOUND, "File not found");
         }
+        this->index.Remove(filename);
         
+        unlink(CompressedPath(filename).c_str());
+
         response->set_filename(filename);
         dfs_log(LL_DEBUG) << "File deleted successfully: " << filename;
         return grpc::Status::OK;
@@ -230,32 +1503,154 @@ public:
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
         
-        DIR* dir = opendir(mount_path.c_str());
-        if (!dir) {
-            dfs_log(LL_ERROR) << "Could not open directory: " << mount_path;
-            return Status(StatusCode::INTERNAL, "Could not open directory");
-        }
-        
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            // Skip . and .. entries
-            if (entry->d_type == DT_REG) {  // Regular file only
-                std::string filename = entry->d_name;
-                std::string full_path = WrapPath(filename);
-                
-                auto file_info = response->add_files();
-                file_info->set_name(filename);
-                file_info->set_mtime(GetFileModTime(full_path));
-                
-                dfs_log(LL_DEBUG) << "  Listed file: " << filename;
-            }
-        }
+        this->index.ForEach("", [response](const std::string& filename, const DFSFileAttributes& attributes) {
+            auto file_info = response->add_files();
+            file_info->set_name(filename);
+            file_info->set_mtime(static_cast<int32_t>(attributes.mtime_ns / 1000000000));
+            return true;
+        });
         
-        closedir(dir);
         dfs_log(LL_DEBUG) << "File listing complete";
         return grpc::Status::OK;
     }
 
+    /**
+     * Whether a name passes a listing's name filters
+     *
+     * @param name
+     * @param request
+     * @return
+     */
+    static bool ListMatches(const char* name, const dfs_service::ListRequest& request) {
+        return strncmp(name, request.prefix().c_str(), request.prefix().size()) == 0 &&
+            (request.pattern().empty() || fnmatch(request.pattern().c_str(), name, 0) == 0);
+    }
+
+    /**
+     * Look up a listed file and apply the listing's mtime filter
+     *
+     * @param name
+     * @param attributes
+     * @param request
+     * @param info filled if the file is listed
+     * @return false if the file is filtered out
+     */
+    static bool ListInfo(const std::string& name, const DFSFileAttributes& attributes,
+                         const dfs_service::ListRequest& request, dfs_service::FileInfo* info) {
+        int64_t mtime = attributes.mtime_ns / 1000000000;
+        if (mtime < request.mtime_since()) {
+            return false;
+        }
+        info->set_name(name);
+        info->set_mtime(static_cast<int32_t>(mtime));
+        return true;
+    }
+
+    /**
+     * The files per page for a listing request
+     */
+    static size_t ListPageSize(const dfs_service::ListRequest& request) {
+        return request.page_size() == 0 ? DFS_LIST_PAGE_SIZE :
+            std::min<size_t>(request.page_size(), DFS_LIST_MAX_PAGE_SIZE);
+    }
+
+    /**
+     * ListPage: Return one page of a name-ordered, filtered listing
+     *
+     * The name filters are applied once, when the first page snapshots the
+     * index. The mtime filter is applied as pages are built, against the
+     * index's current record for each file a page walks over.
+     */
+    Status ListPage(ServerContext* context,
+                    const dfs_service::ListRequest* request,
+                    dfs_service::FileListPage* response) override {
+
+        std::shared_ptr<const std::vector<std::string>> names;
+        uint64_t id = 0;
+        size_t position = 0;
+
+        if (request->cursor().empty()) {
+            auto matching = std::make_shared<std::vector<std::string>>();
+            this->index.ForEach("", [&matching, request](const std::string& name, const DFSFileAttributes&) {
+                if (ListMatches(name.c_str(), *request)) {
+                    matching->push_back(name);
+                }
+                return true;
+            });
+            names = matching;
+        } else {
+            if (!DFSListCursors::Parse(request->cursor(), &id, &position)) {
+                return Status(StatusCode::INVALID_ARGUMENT, "Malformed cursor");
+            }
+            names = this->list_cursors.Find(id);
+            if (!names) {
+                return Status(StatusCode::NOT_FOUND, "Cursor expired");
+            }
+            if (position > names->size()) {
+                return Status(StatusCode::INVALID_ARGUMENT, "Cursor out of range");
+            }
+        }
+
+        size_t page_size = ListPageSize(*request);
+        while (position < names->size() && static_cast<size_t>(response->files_size()) < page_size) {
+            if (context->IsCancelled()) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            DFSFileAttributes attributes;
+            const std::string& name = (*names)[position];
+            if (!this->index.Get(name, &attributes) ||
+                !ListInfo(name, attributes, *request, response->add_files())) {
+                response->mutable_files()->RemoveLast();
+            }
+            position++;
+        }
+
+        if (position < names->size()) {
+            if (id == 0) {
+                id = this->list_cursors.Open(names);
+            }
+            response->set_next_cursor(DFSListCursors::Format(id, position));
+        } else if (id != 0) {
+            this->list_cursors.Close(id);
+        }
+
+        dfs_log(LL_DEBUG) << "Listed page of " << response->files_size() << " files";
+        return Status::OK;
+    }
+
+    /**
+     * ListStream: Stream a filtered listing as pages while the index is walked
+     *
+     * Each page is gathered under the index's lock and written after it is
+     * released, so a slow reader doesn't hold up commits.
+     */
+    Status ListStream(ServerContext* context,
+                      const dfs_service::ListRequest* request,
+                      ServerWriter<dfs_service::FileListPage>* writer) override {
+
+        size_t page_size = ListPageSize(*request);
+        dfs_service::FileListPage page;
+        std::string last;
+        bool more = true;
+        while (more) {
+            more = this->index.ForEach(last, [&](const std::string& name, const DFSFileAttributes& attributes) {
+                last = name;
+                if (ListMatches(name.c_str(), *request) && !ListInfo(name, attributes, *request, page.add_files())) {
+                    page.mutable_files()->RemoveLast();
+                }
+                return static_cast<size_t>(page.files_size()) < page_size;
+            });
+            if (page.files_size() == 0) {
+                continue;
+            }
+            if (context->IsCancelled() || !writer->Write(page)) {
+                return Status(StatusCode::CANCELLED, "Listing abandoned");
+            }
+            page.Clear();
+        }
+        return Status::OK;
+    }
+
         /**
      * Stat: Return file attributes/status
      */
@@ -273,21 +1668,41 @@ public:
             return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
         }
         
-        // Check if file exists
-        if (GetFileSize(full_path) == -1) {
+        DFSFileAttributes attributes;
+        if (!this->index.Get(filename, &attributes)) {
             dfs_log(LL_ERROR) << "File not found: " << full_path;
             return Status(StatusCode::NOT_FOUND, "File not found");
         }
-        
-        response->set_filename(filename);
-        response->set_size(GetFileSize(full_path));
-        response->set_mtime(GetFileModTime(full_path));
-        response->set_ctime(GetFileCreateTime(full_path));
+        DFSFillFileStatus(filename, attributes, response);
         
         dfs_log(LL_DEBUG) << "Status retrieved for: " << filename;
         return grpc::Status::OK;
     }
 
+    /**
+     * StatMany: Return the attributes of many files from the index
+     */
+    Status StatMany(ServerContext* context,
+                    const dfs_service::FileNames* request,
+                    dfs_service::FileStatuses* response) override {
+
+        for (const std::string& filename : request->names()) {
+            if (context->IsCancelled()) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            DFSFileAttributes attributes;
+            if (!this->index.Get(filename, &attributes)) {
+                response->add_missing(filename);
+                continue;
+            }
+            DFSFillFileStatus(filename, attributes, response->add_files());
+        }
+
+        dfs_log(LL_DEBUG) << "Status retrieved for " << response->files_size() << " of "
+                          << request->names_size() << " files";
+        return Status::OK;
+    }
+
 };
 
 //
@@ -307,7 +1722,9 @@ public:
 DFSServerNode::DFSServerNode(const std::string &server_address,
         const std::string &mount_path,
         std::function<void()> callback) :
-    server_address(server_address), mount_path(mount_path), grader_callback(callback) {}
+    server_address(server_address), mount_path(mount_path),
+    max_chunk_size(DFS_MAX_CHUNK_SIZE), durability(DURABILITY_DATA), io_backend("stream"),
+    direct_io_threshold(0), deduplicate(false), grader_callback(callback) {}
 
 /**
  * Server shutdown
@@ -319,9 +1736,12 @@ DFSServerNode::~DFSServerNode() noexcept {
 
 /** Server start **/
 void DFSServerNode::Start() {
-    DFSServiceImpl service(this->mount_path);
+    DFSServiceImpl service(this->mount_path, this->max_chunk_size, this->durability, this->io_backend,
+                           this->direct_io_threshold, this->deduplicate);
     ServerBuilder builder;
     builder.AddListeningPort(this->server_address, grpc::InsecureServerCredentials());
+    builder.SetMaxReceiveMessageSize(this->max_chunk_size + DFS_CHUNK_OVERHEAD);
+    builder.SetMaxSendMessageSize(this->max_chunk_size + DFS_CHUNK_OVERHEAD);
     builder.RegisterService(&service);
     this->server = builder.BuildAndStart();
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
@@ -333,3 +1753,48 @@ void DFSServerNode::Start() {
 //
 // Add your additional DFSServerNode definitions here
 //
+
+/**
+ * Set the largest chunk size the server will stream or accept
+ *
+ * @param max_chunk_size
+ */
+void DFSServerNode::SetMaxChunkSize(size_t max_chunk_size) {
+    this->max_chunk_size = std::max<size_t>(max_chunk_size, DFS_MIN_CHUNK_SIZE);
+}
+
+/**
+ * Set how stored files are flushed before they are renamed into place
+ *
+ * @param durability
+ */
+void DFSServerNode::SetDurability(dfs_durability_e durability) {
+    this->durability = durability;
+}
+
+/**
+ * Set the file I/O backend: "stream" (the default) or "uring"
+ *
+ * @param io_backend
+ */
+void DFSServerNode::SetIOBackend(const std::string &io_backend) {
+    this->io_backend = io_backend;
+}
+
+/**
+ * Write uploads expected to be at least `threshold` bytes with O_DIRECT
+ *
+ * @param threshold 0 disables O_DIRECT
+ */
+void DFSServerNode::SetDirectIOThreshold(uint64_t threshold) {
+    this->direct_io_threshold = threshold;
+}
+
+/**
+ * Keep stored files in a content-addressed chunk store
+ *
+ * @param deduplicate
+ */
+void DFSServerNode::SetDeduplication(bool deduplicate) {
+    this->deduplicate = deduplicate;
+}
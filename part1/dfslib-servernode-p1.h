@@ -6,6 +6,8 @@
 #include <thread>
 #include <grpcpp/grpcpp.h>
 
+#include "dfslib-shared-p1.h"
+
 class DFSServerNode {
 
 private:
@@ -18,6 +20,21 @@ private:
     /** The pointer to the grpc server instance **/
     std::unique_ptr<grpc::Server> server;
 
+    /** The largest chunk size streamed or accepted by the server **/
+    size_t max_chunk_size;
+
+    /** How stored files are flushed before they become visible **/
+    dfs_durability_e durability;
+
+    /** The file I/O backend used for stored and fetched data **/
+    std::string io_backend;
+
+    /** Smallest upload written with O_DIRECT (0 = never) **/
+    uint64_t direct_io_threshold;
+
+    /** Whether stored files are deduplicated into a chunk store **/
+    bool deduplicate;
+
     /** Server callback **/
     std::function<void()> grader_callback;
 
@@ -32,6 +49,11 @@ public:
     //
     // Add your additional declarations here
     //
+    void SetMaxChunkSize(size_t max_chunk_size);
+    void SetDurability(dfs_durability_e durability);
+    void SetIOBackend(const std::string& io_backend);
+    void SetDirectIOThreshold(uint64_t threshold);
+    void SetDeduplication(bool deduplicate);
 
 };
 
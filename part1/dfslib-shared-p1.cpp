@@ -2,7 +2,15 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/sha.h>
 
 #include "dfslib-shared-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
@@ -23,3 +31,309 @@ dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 // Just be aware they are always submitted, so they should
 // be compilable.
 //
+
+DFSChunkSizer::DFSChunkSizer(size_t ceiling) :
+    chunk_size(DFS_MIN_CHUNK_SIZE),
+    ceiling(std::max<size_t>(ceiling, DFS_MIN_CHUNK_SIZE)),
+    window_bytes(0),
+    window_writes(0),
+    window_time(std::chrono::steady_clock::duration::zero()),
+    last_throughput(0),
+    round_trip(0) {}
+
+void DFSChunkSizer::LimitCeiling(size_t limit) {
+    if (limit == 0) {
+        return;
+    }
+    this->ceiling = std::max<size_t>(std::min(this->ceiling, limit), DFS_MIN_CHUNK_SIZE);
+    this->chunk_size = std::min(this->chunk_size, this->ceiling);
+}
+
+void DFSChunkSizer::RecordRoundTrip(std::chrono::steady_clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    if (seconds > 0 && (this->round_trip == 0 || seconds < this->round_trip)) {
+        this->round_trip = seconds;
+    }
+}
+
+void DFSChunkSizer::RecordWrite(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+    this->window_bytes += bytes;
+    this->window_time += elapsed;
+    this->window_writes++;
+
+    // A write that returns faster than any round trip we've seen is the best
+    // available latency estimate when no explicit measurement was recorded
+    RecordRoundTrip(elapsed);
+
+    if (this->window_writes < DFS_CHUNK_WINDOW) {
+        return;
+    }
+
+    double seconds = std::chrono::duration<double>(this->window_time).count();
+    double throughput = seconds > 0 ? this->window_bytes / seconds : 0;
+    size_t previous = this->chunk_size;
+
+    if (throughput >= this->last_throughput * 1.05) {
+        this->chunk_size = std::min(this->chunk_size * 2, this->ceiling);
+    } else if (throughput < this->last_throughput * 0.85) {
+        this->chunk_size = std::max<size_t>(this->chunk_size / 2, DFS_MIN_CHUNK_SIZE);
+    }
+
+    // Keep at least one bandwidth-delay product in each message
+    size_t bdp = static_cast<size_t>(throughput * this->round_trip);
+    this->chunk_size = std::min(std::max(this->chunk_size, bdp), this->ceiling);
+
+    if (this->chunk_size != previous) {
+        dfs_log(LL_DEBUG2) << "Chunk size " << previous << " -> " << this->chunk_size
+                           << " (" << static_cast<size_t>(throughput) << " B/s)";
+    }
+
+    this->last_throughput = throughput;
+    this->window_bytes = 0;
+    this->window_writes = 0;
+    this->window_time = std::chrono::steady_clock::duration::zero();
+}
+
+dfs_service::Codec DFSSelectCodec(const std::string& filename, const char* sample, size_t length) {
+    static const char* const precompressed[] = {
+        "jpg", "jpeg", "png", "gif", "webp", "mp3", "mp4", "mkv", "mov", "avi",
+        "zip", "gz", "tgz", "bz2", "xz", "zst", "lz4", "7z", "rar"
+    };
+
+    size_t dot = filename.find_last_of('.');
+    if (dot != std::string::npos) {
+        std::string extension = filename.substr(dot + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        for (const char* type : precompressed) {
+            if (extension == type) {
+                return dfs_service::CODEC_NONE;
+            }
+        }
+    }
+
+    length = std::min<size_t>(length, DFS_ENTROPY_SAMPLE);
+    if (length == 0) {
+        return dfs_service::CODEC_NONE;
+    }
+
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < length; i++) {
+        counts[static_cast<unsigned char>(sample[i])]++;
+    }
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count > 0) {
+            double p = static_cast<double>(count) / length;
+            entropy -= p * std::log2(p);
+        }
+    }
+
+    dfs_log(LL_DEBUG2) << "Sampled entropy of " << filename << ": " << entropy << " bits/byte";
+    return entropy > DFS_ENTROPY_THRESHOLD ? dfs_service::CODEC_NONE : dfs_service::CODEC_DEFLATE;
+}
+
+void DFSCompressChunk(dfs_service::FileChunk* chunk, dfs_service::Codec codec) {
+    chunk->set_codec(dfs_service::CODEC_NONE);
+    chunk->set_raw_size(chunk->data().size());
+    if (codec != dfs_service::CODEC_DEFLATE || chunk->data().empty()) {
+        return;
+    }
+
+    const std::string& raw = chunk->data();
+    uLongf compressed_size = compressBound(raw.size());
+    std::string compressed(compressed_size, '\0');
+    if (compress2(reinterpret_cast<Bytef*>(&compressed[0]), &compressed_size,
+                  reinterpret_cast<const Bytef*>(raw.data()), raw.size(), Z_BEST_SPEED) != Z_OK ||
+            compressed_size >= raw.size()) {
+        return;
+    }
+
+    compressed.resize(compressed_size);
+    chunk->set_data(std::move(compressed));
+    chunk->set_codec(dfs_service::CODEC_DEFLATE);
+}
+
+bool DFSDecompressChunk(dfs_service::FileChunk* chunk, size_t max_raw_size) {
+    if (chunk->codec() == dfs_service::CODEC_NONE) {
+        return true;
+    }
+    if (chunk->codec() != dfs_service::CODEC_DEFLATE || chunk->raw_size() > max_raw_size) {
+        return false;
+    }
+
+    uLongf raw_size = chunk->raw_size();
+    std::string raw(raw_size, '\0');
+    if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &raw_size,
+                   reinterpret_cast<const Bytef*>(chunk->data().data()), chunk->data().size()) != Z_OK ||
+            raw_size != chunk->raw_size()) {
+        return false;
+    }
+
+    chunk->set_data(std::move(raw));
+    chunk->set_codec(dfs_service::CODEC_NONE);
+    return true;
+}
+
+/**
+ * Random 64-bit values for the gear hash. They are generated from a fixed
+ * seed so that clients and servers cut identical chunks.
+ */
+static const uint64_t* GearTable() {
+    static const std::vector<uint64_t> table = [] {
+        std::vector<uint64_t> values(256);
+        uint64_t state = 0x6466732d63646321ULL;
+        for (uint64_t& value : values) {
+            // splitmix64
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+size_t DFSContentChunkLength(const char* data, size_t length) {
+    // Harder to match before the average size and easier after it, which
+    // keeps chunk sizes close to DFS_CDC_AVG_CHUNK
+    const uint64_t mask_small = 0x0003590703530000ULL;
+    const uint64_t mask_large = 0x0000d90003530000ULL;
+
+    if (length <= DFS_CDC_MIN_CHUNK) {
+        return length;
+    }
+    const uint64_t* gear = GearTable();
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    size_t normal = std::min<size_t>(length, DFS_CDC_AVG_CHUNK);
+    size_t end = std::min<size_t>(length, DFS_CDC_MAX_CHUNK);
+
+    uint64_t fingerprint = 0;
+    size_t i = DFS_CDC_MIN_CHUNK;
+    for (; i < normal; i++) {
+        fingerprint = (fingerprint << 1) + gear[bytes[i]];
+        if ((fingerprint & mask_small) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        fingerprint = (fingerprint << 1) + gear[bytes[i]];
+        if ((fingerprint & mask_large) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+std::string DFSChunkHash(const char* data, size_t length) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(data), length, digest);
+    return std::string(reinterpret_cast<char*>(digest), sizeof(digest));
+}
+
+bool DFSChunkFile(const std::string& path, std::vector<DFSContentChunk>* chunks,
+                  const std::function<bool(const DFSContentChunk&, const char*)>& visit) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Keep at least one maximum-size chunk buffered so that every cut is
+    // made with the same lookahead, except at the end of the file
+    std::vector<char> buffer(16 * DFS_CDC_MAX_CHUNK);
+    size_t start = 0;
+    size_t end = 0;
+    uint64_t offset = 0;
+    bool eof = false;
+    bool ok = true;
+    while (ok) {
+        if (!eof && end - start < DFS_CDC_MAX_CHUNK) {
+            memmove(buffer.data(), buffer.data() + start, end - start);
+            end -= start;
+            start = 0;
+            ssize_t count = read(fd, buffer.data() + end, buffer.size() - end);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count < 0) {
+                ok = false;
+                break;
+            }
+            eof = count == 0;
+            end += count;
+            continue;
+        }
+        if (start == end) {
+            break;
+        }
+
+        DFSContentChunk chunk;
+        chunk.offset = offset;
+        chunk.length = DFSContentChunkLength(buffer.data() + start, end - start);
+        chunk.hash = DFSChunkHash(buffer.data() + start, chunk.length);
+        if (visit && !visit(chunk, buffer.data() + start)) {
+            ok = false;
+        }
+        start += chunk.length;
+        offset += chunk.length;
+        chunks->push_back(std::move(chunk));
+    }
+
+    close(fd);
+    return ok;
+}
+
+/**
+ * The generation is derived from the change time, which the kernel bumps on
+ * every write, truncate, rename over and attribute change, mixed with the
+ * inode so a file replaced within one clock tick still reads as changed.
+ */
+static uint64_t ChangeGeneration(int64_t ctime_ns, uint64_t inode) {
+    return static_cast<uint64_t>(ctime_ns) ^ (inode * 0x9E3779B97F4A7C15ULL);
+}
+
+bool DFSGetFileAttributes(const std::string& path, DFSFileAttributes* attributes) {
+    struct statx stx;
+    if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_CTIME | STATX_INO, &stx) != 0) {
+        if (errno != ENOSYS) {
+            return false;
+        }
+        // Kernels without statx
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        DFSFileAttributesFromStat(st, attributes);
+        return true;
+    }
+    if (!S_ISREG(stx.stx_mode)) {
+        return false;
+    }
+    attributes->size = static_cast<int64_t>(stx.stx_size);
+    attributes->mtime_ns = stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec;
+    attributes->ctime_ns = stx.stx_ctime.tv_sec * 1000000000LL + stx.stx_ctime.tv_nsec;
+    attributes->inode = stx.stx_ino;
+    attributes->generation = ChangeGeneration(attributes->ctime_ns, attributes->inode);
+    return true;
+}
+
+void DFSFileAttributesFromStat(const struct stat& st, DFSFileAttributes* attributes) {
+    attributes->size = static_cast<int64_t>(st.st_size);
+    attributes->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    attributes->ctime_ns = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+    attributes->inode = st.st_ino;
+    attributes->generation = ChangeGeneration(attributes->ctime_ns, attributes->inode);
+}
+
+void DFSFillFileStatus(const std::string& filename, const DFSFileAttributes& attributes,
+                       dfs_service::FileStatus* status) {
+    status->set_filename(filename);
+    status->set_size(attributes.size);
+    status->set_mtime(attributes.mtime_ns / 1000000000);
+    status->set_ctime(attributes.ctime_ns / 1000000000);
+    status->set_mtime_ns(attributes.mtime_ns);
+    status->set_ctime_ns(attributes.ctime_ns);
+    status->set_inode(attributes.inode);
+    status->set_generation(attributes.generation);
+}
@@ -0,0 +1,160 @@
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dfs-utils.h"
+#include "../dfslib-shared-p1.h"
+#include "../dfslib-fileio-p1.h"
+
+//
+// Microbenchmark for the server's file I/O backends.
+//
+// Each of N threads writes its own file in chunk-sized pieces and then
+// reads it back, the same access pattern as concurrent Store and Fetch
+// handlers. Every backend runs the identical workload. The files are
+// flushed and dropped from the page cache between the two phases, so
+// reads come from the device rather than from what was just written.
+//
+
+void Usage() {
+    std::cout <<
+        "\nUSAGE: dfs-bench-fileio-p1 [OPTIONS]\n"
+        "-b, --backend <name>:     Backend to measure: uring, stream (default: both)\n"
+        "-c, --chunk_size <bytes>: Bytes per Read/Write call (default: 1048576)\n"
+        "-m, --mount_path <path>:  Directory for the scratch files (default: /tmp)\n"
+        "-o, --direct_io:          Write with O_DIRECT\n"
+        "-p, --preallocate:        Pass each file's size so writers preallocate it\n"
+        "-s, --size <MB>:          Megabytes per thread (default: 64)\n"
+        "-t, --threads <int>:      Concurrent transfers (default: 8)\n"
+        "-h, --help:               Show help\n\n";
+    exit(1);
+}
+
+/**
+ * Run the workload with `threads` concurrent writers, then readers
+ *
+ * @return {write MB/s, read MB/s}
+ */
+std::pair<double, double> RunWorkload(DFSFileIO* io, const std::string& dir, size_t file_size,
+                                      size_t chunk_size, int threads, const DFSWriteOptions& options) {
+    auto run = [&](bool write) {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                std::string path = dir + "/dfs-bench-" + std::to_string(getpid()) + "-" + std::to_string(t);
+                std::vector<char> buffer(chunk_size, static_cast<char>('a' + t));
+                if (write) {
+                    auto writer = io->OpenWrite(path, false, options);
+                    for (size_t done = 0; writer && done < file_size; done += chunk_size) {
+                        writer->Write(buffer.data(), std::min(chunk_size, file_size - done));
+                    }
+                    if (!writer || !writer->Close()) {
+                        dfs_log(LL_ERROR) << "Write failed: " << path;
+                    }
+                } else {
+                    auto reader = io->OpenRead(path, 0);
+                    const char* view;
+                    while (reader && reader->Next(chunk_size, &view) > 0) {}
+                    unlink(path.c_str());
+                }
+            });
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return (static_cast<double>(file_size) * threads / (1024 * 1024)) / seconds;
+    };
+
+    double write_rate = run(true);
+    for (int t = 0; t < threads; t++) {
+        std::string path = dir + "/dfs-bench-" + std::to_string(getpid()) + "-" + std::to_string(t);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+            dfs_log(LL_ERROR) << "Could not evict " << path << " from the page cache";
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    double read_rate = run(false);
+    return {write_rate, read_rate};
+}
+
+int main(int argc, char** argv) {
+
+    const char* const short_opts = "b:c:m:ops:t:h";
+
+    const option long_opts[] = {
+        {"backend", optional_argument, nullptr, 'b'},
+        {"chunk_size", optional_argument, nullptr, 'c'},
+        {"mount_path", optional_argument, nullptr, 'm'},
+        {"direct_io", no_argument, nullptr, 'o'},
+        {"preallocate", no_argument, nullptr, 'p'},
+        {"size", optional_argument, nullptr, 's'},
+        {"threads", optional_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, no_argument, nullptr, 0}
+    };
+
+    int option_char;
+    std::vector<std::string> backends = {"stream", "uring"};
+    size_t chunk_size = 1024 * 1024;
+    std::string dir = "/tmp";
+    size_t size_mb = 64;
+    int threads = 8;
+    bool preallocate = false;
+    DFSWriteOptions options;
+
+    while((option_char = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
+        switch(option_char) {
+            case 'b':
+                backends = {std::string(optarg)};
+                break;
+            case 'c':
+                chunk_size = std::max<size_t>(std::stoul(optarg), 1);
+                break;
+            case 'm':
+                dir = std::string(optarg);
+                break;
+            case 'o':
+                options.direct = true;
+                break;
+            case 'p':
+                preallocate = true;
+                break;
+            case 's':
+                size_mb = std::stoul(optarg);
+                break;
+            case 't':
+                threads = std::max(std::stoi(optarg), 1);
+                break;
+            case 'h':
+            case '?':
+            default:
+                Usage();
+                break;
+        }
+    }
+
+    if (preallocate) {
+        options.expected_size = size_mb * 1024 * 1024;
+    }
+
+    std::cout << threads << " threads x " << size_mb << "MB, " << chunk_size << " byte calls\n";
+    for (const std::string& backend : backends) {
+        std::unique_ptr<DFSFileIO> io = DFSCreateFileIO(backend);
+        auto rates = RunWorkload(io.get(), dir, size_mb * 1024 * 1024, chunk_size, threads, options);
+        std::cout << std::setw(8) << io->Name() << ": write " << std::fixed << std::setprecision(1)
+                  << rates.first << " MB/s, read " << rates.second << " MB/s\n";
+    }
+
+    return 0;
+}
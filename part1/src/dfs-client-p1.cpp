@@ -20,7 +20,7 @@
 using grpc::Status;
 using grpc::StatusCode;
 
-DFSClient::DFSClient() {}
+DFSClient::DFSClient() : max_chunk_size(DFS_MAX_CHUNK_SIZE) {}
 
 DFSClient::~DFSClient() noexcept {}
 
@@ -40,6 +40,17 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
         std::map<std::string,int> file_map;
         client_node.List(&file_map, true);
 
+    } else if (command == "list-page") {
+
+        std::map<std::string,int> file_map;
+        std::string next_cursor;
+        if (client_node.ListPage(filename, &file_map, &next_cursor) == StatusCode::OK) {
+            for (const auto& file : file_map) {
+                std::cout << "  " << file.first << " (mtime: " << file.second << ")" << std::endl;
+            }
+            std::cout << "Next cursor: " << next_cursor << std::endl;
+        }
+
     } else if (command == "delete") {
 
         client_node.Delete(filename);
@@ -56,8 +67,33 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 
 }
 
+void DFSClient::ProcessBatchCommand(const std::string &command, const std::vector<std::string> &filenames) {
+
+    if (command == "fetch-many") {
+
+        client_node.FetchMany(filenames);
+
+    } else if (command == "store-many") {
+
+        client_node.StoreMany(filenames);
+
+    } else if (command == "stat-many") {
+
+        client_node.StatMany(filenames, nullptr);
+
+    } else {
+
+        dfs_log(LL_ERROR) << "Unknown command";
+
+    }
+
+}
+
 void DFSClient::InitializeClientNode(const std::string &server_address) {
-    this->client_node.CreateStub(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+    grpc::ChannelArguments args;
+    args.SetMaxReceiveMessageSize(this->max_chunk_size + DFS_CHUNK_OVERHEAD);
+    args.SetMaxSendMessageSize(this->max_chunk_size + DFS_CHUNK_OVERHEAD);
+    this->client_node.CreateStub(grpc::CreateCustomChannel(server_address, grpc::InsecureChannelCredentials(), args));
 }
 
 void DFSClient::SetMountPath(const std::string &path) {
@@ -70,6 +106,39 @@ void DFSClient::SetDeadlineTimeout(int deadline) {
     this->client_node.SetDeadlineTimeout(deadline);
 }
 
+void DFSClient::SetMaxChunkSize(size_t max_chunk_size) {
+    this->max_chunk_size = max_chunk_size;
+    this->client_node.SetMaxChunkSize(max_chunk_size);
+}
+
+void DFSClient::SetZeroCopyFetch(bool zero_copy) {
+    this->client_node.SetZeroCopyFetch(zero_copy);
+}
+
+void DFSClient::SetFetchStreams(int streams) {
+    this->client_node.SetFetchStreams(streams);
+}
+
+void DFSClient::SetCompression(bool compress) {
+    this->client_node.SetCompression(compress);
+}
+
+void DFSClient::SetStorePipelineDepth(int depth) {
+    this->client_node.SetStorePipelineDepth(depth);
+}
+
+void DFSClient::SetDeduplication(bool dedup) {
+    this->client_node.SetDeduplication(dedup);
+}
+
+void DFSClient::SetListFilter(const std::string& prefix, const std::string& pattern, int mtime_since) {
+    this->client_node.SetListFilter(prefix, pattern, mtime_since);
+}
+
+void DFSClient::SetListPageSize(size_t page_size) {
+    this->client_node.SetListPageSize(page_size);
+}
+
 #ifdef DFS_MAIN
 
 DFSClient client;
@@ -81,25 +150,48 @@ void Usage() {
     std::cout <<
         "\nUSAGE: dfs-client [OPTIONS] COMMAND [FILENAME]\n"
         "-a, --address <address>:  The rpc server address to connect to (default: 0.0.0.0:51189)\n"
+        "-c, --max_chunk_size <bytes>:  The largest chunk size to stream (default: 4128768)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
+        "-g, --glob <pattern>:     List only files whose names match a shell glob\n"
+        "-l, --page_size <int>:    Files per listing page (default: 1000)\n"
         "-m, --mount_path <path>:  The mount path this client attaches to\n"
+        "-n, --newer <mtime>:      List only files modified at or after this time\n"
+        "-p, --pipeline <int>:     Chunk buffers read ahead of the network on store (default: 4)\n"
+        "-r, --prefix <prefix>:    List only files whose names start with a prefix\n"
+        "-s, --streams <int>:      Parallel range streams for fetching files of 64MB or more (default: 4)\n"
         "-t, --deadline_timeout <int>:  The deadline timeout in milliseconds (default: 12000)\n"
+        "-u, --dedup:              Skip chunks the server already holds when storing\n"
+        "-x, --compress:           Compress transfers of compressible files\n"
+        "-z, --zero_copy:          Fetch through the server's mmap-backed stream\n"
         "-h, --help:               Show help\n"
         "\n"
-        "COMMAND is one of fetch|store|delete|list|stat.\n"
-        "FILENAME is the filename to fetch, store, delete, or stat. The list command does not require a filename.\n\n";
+        "COMMAND is one of fetch|store|delete|list|list-page|stat|fetch-many|store-many|stat-many.\n"
+        "FILENAME is the filename to fetch, store, delete, or stat. The list command does not require a filename.\n"
+        "list-page prints one page of the listing and the cursor to pass for the next page.\n"
+        "fetch-many and store-many take any number of filenames and transfer them over one call.\n"
+        "stat-many takes any number of filenames and stats them in one call.\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:t:h";
+    const char* const short_opts = "a:c:d:g:l:m:n:p:r:s:t:uxzh";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
+        {"max_chunk_size", optional_argument, nullptr, 'c'},
         {"debug_level", optional_argument, nullptr, 'd'},
+        {"glob", required_argument, nullptr, 'g'},
+        {"page_size", required_argument, nullptr, 'l'},
         {"mount_path", optional_argument, nullptr, 'm'},
+        {"newer", required_argument, nullptr, 'n'},
+        {"pipeline", optional_argument, nullptr, 'p'},
+        {"prefix", required_argument, nullptr, 'r'},
+        {"streams", optional_argument, nullptr, 's'},
         {"deadline_timeout", optional_argument, nullptr, 't'},
+        {"dedup", no_argument, nullptr, 'u'},
+        {"compress", no_argument, nullptr, 'x'},
+        {"zero_copy", no_argument, nullptr, 'z'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -108,8 +200,19 @@ int main(int argc, char** argv) {
     std::string mount_path = "mnt/client";
     std::string server_address = "0.0.0.0:51189";
     std::string filename = "";
+    std::vector<std::string> filenames;
     std::string command = "";
     int deadline_timeout = 12000;
+    size_t max_chunk_size = DFS_MAX_CHUNK_SIZE;
+    bool zero_copy = false;
+    bool compress = false;
+    bool dedup = false;
+    int fetch_streams = DFS_FETCH_STREAMS;
+    int pipeline_depth = DFS_STORE_PIPELINE_DEPTH;
+    std::string list_prefix;
+    std::string list_pattern;
+    int list_mtime_since = 0;
+    size_t list_page_size = DFS_LIST_PAGE_SIZE;
     int debug_level = static_cast<int>(LL_ERROR);
 
     char cwd[PATH_MAX];
@@ -124,15 +227,45 @@ int main(int argc, char** argv) {
             case 'a':
                 server_address = std::string(optarg);
                 break;
+            case 'c':
+                max_chunk_size = std::stoul(optarg);
+                break;
             case 'd':
                 debug_level = std::stoi(optarg);
                 break;
+            case 'g':
+                list_pattern = std::string(optarg);
+                break;
+            case 'l':
+                list_page_size = std::stoul(optarg);
+                break;
             case 'm':
                 mount_path = std::string(optarg);
                 break;
+            case 'n':
+                list_mtime_since = std::stoi(optarg);
+                break;
+            case 'p':
+                pipeline_depth = std::stoi(optarg);
+                break;
+            case 'r':
+                list_prefix = std::string(optarg);
+                break;
+            case 's':
+                fetch_streams = std::stoi(optarg);
+                break;
             case 't':
                 deadline_timeout = std::stoi(optarg);
                 break;
+            case 'u':
+                dedup = true;
+                break;
+            case 'x':
+                compress = true;
+                break;
+            case 'z':
+                zero_copy = true;
+                break;
             case 'h':
                 Usage();
                 break;
@@ -170,7 +303,10 @@ int main(int argc, char** argv) {
     // Get command and filename
     for(int i = optind; i < argc; i++) {
         if (command.empty()) { command = argv[i]; }
-        else if (filename.empty()) { filename = argv[i]; }
+        else { filenames.push_back(argv[i]); }
+    }
+    if (!filenames.empty()) {
+        filename = filenames.front();
     }
 
     if (command.empty()) {
@@ -179,14 +315,14 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    std::string commands("fetch store delete list stat");
+    std::string commands("fetch store delete list list-page stat fetch-many store-many stat-many");
     if (commands.find(command) == std::string::npos ) {
         std::cerr << "\nUnknown command!\n";
         Usage();
         return -1;
     }
 
-    std::string nonpath_commands("list");
+    std::string nonpath_commands("list list-page");
     if (filename.empty() && nonpath_commands.find(command) == std::string::npos ) {
         std::cerr << "\nMissing filename!\n";
         Usage();
@@ -198,8 +334,20 @@ int main(int argc, char** argv) {
 
     client.SetMountPath(mount_path);
     client.SetDeadlineTimeout(deadline_timeout);
+    client.SetMaxChunkSize(max_chunk_size);
+    client.SetZeroCopyFetch(zero_copy);
+    client.SetFetchStreams(fetch_streams);
+    client.SetCompression(compress);
+    client.SetStorePipelineDepth(pipeline_depth);
+    client.SetDeduplication(dedup);
+    client.SetListFilter(list_prefix, list_pattern, list_mtime_since);
+    client.SetListPageSize(list_page_size);
     client.InitializeClientNode(server_address);
-    client.ProcessCommand(command, filename);
+    if (command == "fetch-many" || command == "store-many" || command == "stat-many") {
+        client.ProcessBatchCommand(command, filenames);
+    } else {
+        client.ProcessCommand(command, filename);
+    }
 
     return 0;
 }
@@ -13,6 +13,7 @@ class DFSClient {
 protected:
 
         int deadline_timeout;
+        size_t max_chunk_size;
         std::string mount_path;
         DFSClientNodeP1 client_node;
 
@@ -36,6 +37,14 @@ public:
          */
         void ProcessCommand(const std::string& command, const std::string& filename);
 
+        /**
+         * Handles a command that takes many filenames (store-many, fetch-many)
+         *
+         * @param command
+         * @param filenames
+         */
+        void ProcessBatchCommand(const std::string& command, const std::vector<std::string>& filenames);
+
         /**
          * Sets the mount path on the client node. This is the path
          * where files will be synced/cached with the server.
@@ -51,5 +60,63 @@ public:
          */
         void SetDeadlineTimeout(int deadline);
 
+        /**
+         * Sets the largest chunk size used when streaming files
+         *
+         * @param max_chunk_size
+         */
+        void SetMaxChunkSize(size_t max_chunk_size);
+
+        /**
+         * Enables fetching through the server's mmap-backed stream
+         *
+         * @param zero_copy
+         */
+        void SetZeroCopyFetch(bool zero_copy);
+
+        /**
+         * Sets the number of concurrent range streams for large fetches
+         *
+         * @param streams
+         */
+        void SetFetchStreams(int streams);
+
+        /**
+         * Enables compression of Store and Fetch streams
+         *
+         * @param compress
+         */
+        void SetCompression(bool compress);
+
+        /**
+         * Sets how many chunk buffers Store reads ahead of the network
+         *
+         * @param depth
+         */
+        void SetStorePipelineDepth(int depth);
+
+        /**
+         * Enables skipping chunks the server already holds on store
+         *
+         * @param dedup
+         */
+        void SetDeduplication(bool dedup);
+
+        /**
+         * Restricts listings to matching files
+         *
+         * @param prefix
+         * @param pattern
+         * @param mtime_since
+         */
+        void SetListFilter(const std::string& prefix, const std::string& pattern, int mtime_since);
+
+        /**
+         * Sets the files per listing page
+         *
+         * @param page_size
+         */
+        void SetListPageSize(size_t page_size);
+
 };
 #endif
@@ -5,6 +5,7 @@
 #include <csignal>
 
 #include "dfs-utils.h"
+#include "../dfslib-shared-p1.h"
 #include "../dfslib-servernode-p1.h"
 
 void HandleSignal(int signum) {
@@ -15,26 +16,41 @@ void Usage() {
     std::cout <<
         "\nUSAGE: dfs-server-p1 [OPTIONS]\n"
         "-a, --address <address>:    The server address to connect to (default: 0.0.0.0:51189)\n"
+        "-c, --max_chunk_size <bytes>: The largest chunk size to stream (default: 4128768)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
+        "-i, --io_backend <name>:    File I/O backend: stream, or uring where supported (default: stream)\n"
         "-m, --mount_path <path>:    The mount storage path (default: mnt/server)\n"
+        "-o, --direct_io <bytes>:    Write uploads of at least this size with O_DIRECT (default: 0 = never)\n"
+        "-u, --dedup:                Deduplicate stored files into a content-addressed chunk store\n"
+        "-y, --durability <policy>:  Flush stored files before commit: none, data, full (default: data)\n"
         "-h, --help:                 Show help\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:h";
+    const char* const short_opts = "a:c:d:i:m:o:uy:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
+        {"max_chunk_size", optional_argument, nullptr, 'c'},
         {"debug_level", optional_argument, nullptr, 'd'},
+        {"io_backend", optional_argument, nullptr, 'i'},
         {"mount_path", optional_argument, nullptr, 'm'},
+        {"direct_io", optional_argument, nullptr, 'o'},
+        {"dedup", no_argument, nullptr, 'u'},
+        {"durability", optional_argument, nullptr, 'y'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
 
     int option_char;
     int debug_level = static_cast<int>(LL_ERROR);
+    size_t max_chunk_size = DFS_MAX_CHUNK_SIZE;
+    dfs_durability_e durability = DURABILITY_DATA;
+    std::string io_backend = "stream";
+    uint64_t direct_io_threshold = 0;
+    bool deduplicate = false;
     std::string mount_path = "mnt/server/";
     std::string server_address = "0.0.0.0:51189";
 
@@ -43,12 +59,35 @@ int main(int argc, char** argv) {
             case 'a':
                 server_address = std::string(optarg);
                 break;
+            case 'c':
+                max_chunk_size = std::stoul(optarg);
+                break;
             case 'd':
                 debug_level = std::stoi(optarg);
                 break;
+            case 'i':
+                io_backend = std::string(optarg);
+                break;
             case 'm':
                 mount_path = std::string(optarg);
                 break;
+            case 'o':
+                direct_io_threshold = std::stoull(optarg);
+                break;
+            case 'u':
+                deduplicate = true;
+                break;
+            case 'y':
+                if (std::string(optarg) == "none") {
+                    durability = DURABILITY_NONE;
+                } else if (std::string(optarg) == "data") {
+                    durability = DURABILITY_DATA;
+                } else if (std::string(optarg) == "full") {
+                    durability = DURABILITY_FULL;
+                } else {
+                    Usage();
+                }
+                break;
             case 'h':
             case '?':
             default:
@@ -65,6 +104,11 @@ int main(int argc, char** argv) {
     signal(SIGTERM, HandleSignal);
 
     DFSServerNode server_node(server_address, dfs_clean_path(mount_path), [&]{ return; });
+    server_node.SetMaxChunkSize(max_chunk_size);
+    server_node.SetDurability(durability);
+    server_node.SetIOBackend(io_backend);
+    server_node.SetDirectIOThreshold(direct_io_threshold);
+    server_node.SetDeduplication(deduplicate);
     server_node.Start();
 
     return 0;
@@ -1,4 +1,5 @@
 #include <regex>
+#include <algorithm>
 #include <mutex>
 #include <vector>
 #include <string>
@@ -17,6 +18,8 @@
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 #include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "src/dfs-utils.h"
 #include "src/dfslibx-clientnode-p2.h"
@@ -31,6 +34,22 @@ using grpc::ClientWriter;
 using grpc::ClientReader;
 using grpc::ClientContext;
 
+using dfs_service::Empty;
+using dfs_service::FileRequest;
+using dfs_service::FileChunk;
+using dfs_service::FileStatus;
+using dfs_service::FileList;
+using dfs_service::WriteLockRequest;
+using dfs_service::WriteLockResponse;
+using dfs_service::FileSignature;
+using dfs_service::FileDelta;
+using dfs_service::DeltaOp;
+using dfs_service::SubscribeRequest;
+using dfs_service::FileEvent;
+using dfs_service::MerkleRequest;
+using dfs_service::MerkleNode;
+using dfs_service::MerkleReply;
+
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
 //
@@ -43,8 +62,21 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 using FileRequestType = FileRequest;
 using FileListResponseType = FileList;
 
-DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode() {}
-DFSClientNodeP2::~DFSClientNodeP2() {}
+DFSClientNodeP2::DFSClientNodeP2() :
+    DFSClientNode(), delta_transfers(true), lease_time(DFS_LOCK_LEASE), heartbeat_stopping(false) {}
+DFSClientNodeP2::~DFSClientNodeP2() {
+    {
+        std::lock_guard<std::mutex> lock(lease_mutex);
+        this->heartbeat_stopping = true;
+    }
+    this->lease_cv.notify_all();
+    if (this->heartbeat.joinable()) {
+        this->heartbeat.join();
+    }
+    if (this->checksums) {
+        this->checksums->Stop();
+    }
+}
 
 grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename) {
 
@@ -66,6 +98,108 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
     //
     //
 
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    WriteLockRequest request;
+    request.set_name(filename);
+    request.set_client_id(this->client_id);
+    WriteLockResponse response;
+
+    Status status = this->service_stub->RequestWriteLock(&context, request, &response);
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED ||
+            status.error_code() == StatusCode::RESOURCE_EXHAUSTED) {
+            dfs_log(LL_ERROR) << "Write lock on " << filename << " not granted: " << status.error_message();
+            return status.error_code();
+        }
+        dfs_log(LL_ERROR) << "Write lock request failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(lease_mutex);
+        this->write_tokens[filename] = response.token();
+        if (response.lease_ms() > 0) {
+            this->lease_time = response.lease_ms();
+        }
+    }
+    std::call_once(this->heartbeat_started, [this] {
+        this->heartbeat = std::thread(&DFSClientNodeP2::HeartbeatLeases, this);
+    });
+
+    dfs_log(LL_DEBUG2) << "Write lock granted on " << filename << " with token " << response.token();
+    return StatusCode::OK;
+}
+
+void DFSClientNodeP2::ReleaseWriteAccess(const std::string &filename) {
+    uint64_t token = WriteToken(filename);
+    ForgetWriteAccess(filename);
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    WriteLockRequest request;
+    request.set_name(filename);
+    request.set_client_id(this->client_id);
+    request.set_token(token);
+    Empty response;
+    this->service_stub->ReleaseWriteLock(&context, request, &response);
+}
+
+uint64_t DFSClientNodeP2::WriteToken(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(lease_mutex);
+    auto token = this->write_tokens.find(filename);
+    return token == this->write_tokens.end() ? 0 : token->second;
+}
+
+void DFSClientNodeP2::ForgetWriteAccess(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(lease_mutex);
+    this->write_tokens.erase(filename);
+}
+
+void DFSClientNodeP2::HeartbeatLeases() {
+    std::unique_lock<std::mutex> lock(lease_mutex);
+    while (!this->heartbeat_stopping) {
+        this->lease_cv.wait_for(lock, std::chrono::milliseconds(std::max(this->lease_time / 3, 1)));
+        if (this->heartbeat_stopping) {
+            break;
+        }
+        std::map<std::string, uint64_t> held(this->write_tokens);
+        lock.unlock();
+
+        for (const auto& lease : held) {
+            ClientContext context;
+            std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+            context.set_deadline(deadline);
+
+            WriteLockRequest request;
+            request.set_name(lease.first);
+            request.set_client_id(this->client_id);
+            request.set_token(lease.second);
+            WriteLockResponse response;
+            Status status = this->service_stub->RenewWriteLock(&context, request, &response);
+            if (status.error_code() == StatusCode::NOT_FOUND) {
+                // Released by a store that finished meanwhile, or lapsed
+                dfs_log(LL_DEBUG2) << "Write lock on " << lease.first << " is no longer held";
+                std::lock_guard<std::mutex> relock(lease_mutex);
+                auto token = this->write_tokens.find(lease.first);
+                if (token != this->write_tokens.end() && token->second == lease.second) {
+                    this->write_tokens.erase(token);
+                }
+            } else if (!status.ok()) {
+                dfs_log(LL_ERROR) << "Could not renew the write lock on " << lease.first << ": "
+                                  << status.error_message();
+            }
+        }
+
+        lock.lock();
+    }
 }
 
 grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
@@ -95,6 +229,200 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
     //
     //
 
+    std::string filepath = WrapPath(filename);
+    int64_t size = GetFileSize(filepath);
+    if (size < 0) {
+        dfs_log(LL_ERROR) << "Could not open file for reading: " << filepath;
+        return StatusCode::NOT_FOUND;
+    }
+    std::uint32_t crc = Checksum(filename);
+    int64_t mtime = GetFileModTime(filepath);
+
+    StatusCode code = RequestWriteAccess(filename);
+    if (code != StatusCode::OK) {
+        return code == StatusCode::DEADLINE_EXCEEDED ? code : StatusCode::RESOURCE_EXHAUSTED;
+    }
+
+    // A delta store falls back to a whole-file store when the server has no
+    // copy to patch or its copy changed after it was signed
+    code = StatusCode::NOT_FOUND;
+    if (this->delta_transfers && size >= DFS_DELTA_MIN_FILE) {
+        code = StoreDelta(filename, crc, mtime);
+    }
+    if (code != StatusCode::OK && code != StatusCode::ALREADY_EXISTS && code != StatusCode::DEADLINE_EXCEEDED) {
+        code = StoreWhole(filename, crc, mtime);
+    }
+
+    // The server releases the lock itself once a store succeeds
+    if (code != StatusCode::OK) {
+        ReleaseWriteAccess(filename);
+    } else {
+        ForgetWriteAccess(filename);
+    }
+    return code;
+}
+
+grpc::StatusCode DFSClientNodeP2::StoreWhole(const std::string &filename, std::uint32_t crc, int64_t mtime) {
+
+    std::string filepath = WrapPath(filename);
+    std::ifstream infile(filepath, std::ios::binary);
+    if (!infile.is_open()) {
+        dfs_log(LL_ERROR) << "Could not open file for reading: " << filepath;
+        return StatusCode::NOT_FOUND;
+    }
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    FileStatus response;
+    auto writer = this->service_stub->Store(&context, &response);
+
+    dfs_log(LL_DEBUG) << "Storing file: " << filepath;
+
+    char buffer[DFS_CHUNK_SIZE];
+    FileChunk chunk;
+    chunk.set_filename(filename);
+    chunk.set_client_id(this->client_id);
+    chunk.set_crc(crc);
+    chunk.set_mtime(mtime);
+    chunk.set_lock_token(WriteToken(filename));
+
+    // Always send one chunk, so that empty files carry their name too
+    bool first = true;
+    while (infile.read(buffer, DFS_CHUNK_SIZE) || infile.gcount() > 0 || first) {
+        chunk.set_data(buffer, infile.gcount());
+        if (!writer->Write(chunk)) {
+            // The server refused the file; Finish has the reason
+            break;
+        }
+        if (first) {
+            chunk.Clear();
+            first = false;
+        }
+    }
+    infile.close();
+
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED ||
+            status.error_code() == StatusCode::ALREADY_EXISTS ||
+            status.error_code() == StatusCode::RESOURCE_EXHAUSTED) {
+            dfs_log(LL_DEBUG) << "Store of " << filename << " ended: " << status.error_message();
+            return status.error_code();
+        }
+        dfs_log(LL_ERROR) << "Store failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    dfs_log(LL_DEBUG) << "File stored successfully: " << filename;
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::StoreDelta(const std::string &filename, std::uint32_t crc, int64_t mtime) {
+
+    std::string filepath = WrapPath(filename);
+    DFSMappedFile file;
+    if (!file.Open(filepath)) {
+        dfs_log(LL_ERROR) << "Could not open file for reading: " << filepath;
+        return StatusCode::CANCELLED;
+    }
+
+    FileRequest request;
+    request.set_name(filename);
+    request.set_client_id(this->client_id);
+    request.set_crc(crc);
+    request.set_cached(true);
+    FileSignature signature;
+    {
+        ClientContext context;
+        std::chrono::system_clock::time_point deadline =
+            std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+        context.set_deadline(deadline);
+        Status status = this->service_stub->Signatures(&context, request, &signature);
+        if (!status.ok()) {
+            // NOT_FOUND means there is nothing to patch, so the caller sends the whole file
+            dfs_log(LL_DEBUG) << "No delta store for " << filename << ": " << status.error_message();
+            return status.error_code();
+        }
+    }
+    // A malformed signature could stall the block matching; send the whole file instead
+    if (!DFSValidSignature(signature)) {
+        dfs_log(LL_ERROR) << "Server sent a malformed signature of " << filename;
+        return StatusCode::INVALID_ARGUMENT;
+    }
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    FileStatus response;
+    auto writer = this->service_stub->StoreDelta(&context, &response);
+
+    FileDelta delta;
+    delta.set_filename(filename);
+    delta.set_client_id(this->client_id);
+    delta.set_crc(crc);
+    delta.set_mtime(mtime);
+    delta.set_base_crc(signature.crc());
+    delta.set_block_size(signature.block_size());
+    delta.set_lock_token(WriteToken(filename));
+
+    uint64_t literal_bytes = 0;
+    uint64_t matched_blocks = 0;
+    bool sent = DFSStreamDelta(file.Data(), file.Size(), signature, &delta, [&](const FileDelta& message) {
+        for (const DeltaOp& op : message.ops()) {
+            literal_bytes += op.literal().size();
+            matched_blocks += op.count();
+        }
+        return writer->Write(message);
+    });
+    if (!sent) {
+        // Don't let the server commit a partial delta
+        context.TryCancel();
+        writer->Finish();
+        dfs_log(LL_DEBUG) << "Delta store of " << filename << " was cut off";
+        return StatusCode::CANCELLED;
+    }
+
+    writer->WritesDone();
+    Status status = writer->Finish();
+
+    if (!status.ok()) {
+        dfs_log(LL_DEBUG) << "Delta store of " << filename << " failed: " << status.error_message();
+        return status.error_code();
+    }
+
+    dfs_log(LL_DEBUG) << "Delta stored " << filename << ": " << literal_bytes << " literal bytes, "
+                      << matched_blocks << " blocks of " << signature.block_size() << " reused";
+    return StatusCode::OK;
+}
+
+DFSMetadataIndex& DFSClientNodeP2::Checksums() {
+    std::call_once(this->checksums_opened, [this] {
+        this->checksums.reset(new DFSMetadataIndex(this->mount_path));
+        this->checksums->Open();
+        this->tree.reset(new DFSMerkleTree(*this->checksums));
+    });
+    return *this->checksums;
+}
+
+DFSMerkleTree& DFSClientNodeP2::Tree() {
+    Checksums();
+    return *this->tree;
+}
+
+std::uint32_t DFSClientNodeP2::Checksum(const std::string& filename) {
+    DFSFileRecord record;
+    return Checksums().Refresh(filename, &record) ? record.crc : 0;
+}
+
+void DFSClientNodeP2::SetDeltaTransfers(bool enabled) {
+    this->delta_transfers = enabled;
 }
 
 
@@ -121,6 +449,181 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
     //
     // Hint: You may want to match the mtime on local files to the server's mtime
     //
+
+    // A cached copy that differs is patched with a delta; the whole file
+    // is fetched if that fails for any reason other than the file's state
+    int64_t size = GetFileSize(WrapPath(filename));
+    if (this->delta_transfers && size >= DFS_DELTA_MIN_FILE) {
+        StatusCode code = FetchDelta(filename);
+        if (code == StatusCode::OK || code == StatusCode::ALREADY_EXISTS ||
+            code == StatusCode::NOT_FOUND || code == StatusCode::DEADLINE_EXCEEDED) {
+            return code;
+        }
+    }
+    return FetchWhole(filename);
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchWhole(const std::string &filename) {
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    std::string filepath = WrapPath(filename);
+    FileRequest request;
+    request.set_name(filename);
+    request.set_client_id(this->client_id);
+    if (GetFileSize(filepath) >= 0) {
+        request.set_crc(Checksum(filename));
+        request.set_cached(true);
+    }
+
+    dfs_log(LL_DEBUG) << "Fetching file: " << filename;
+
+    // Fetch into a hidden temp file so that the watcher ignores it
+    // and a failed transfer leaves the cached copy intact
+    std::string staged;
+    int fd = DFSStageFile(filepath, &staged);
+    if (fd < 0) {
+        return StatusCode::CANCELLED;
+    }
+    std::ofstream outfile(staged, std::ios::binary);
+    close(fd);
+
+    auto reader = this->service_stub->Fetch(&context, request);
+
+    FileChunk chunk;
+    int64_t mtime = 0;
+    std::uint32_t crc = 0;
+    bool first = true;
+    DFSFileChecksum checksum;
+    while (reader->Read(&chunk)) {
+        if (first) {
+            mtime = chunk.mtime();
+            crc = chunk.crc();
+            first = false;
+        }
+        if (!chunk.data().empty()) {
+            outfile.write(chunk.data().data(), chunk.data().size());
+            checksum.Update(chunk.data().data(), chunk.data().size());
+        }
+    }
+    outfile.close();
+
+    Status status = reader->Finish();
+    if (!status.ok() || !outfile) {
+        unlink(staged.c_str());
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED ||
+            status.error_code() == StatusCode::NOT_FOUND ||
+            status.error_code() == StatusCode::ALREADY_EXISTS) {
+            dfs_log(LL_DEBUG) << "Fetch of " << filename << " ended: " << status.error_message();
+            return status.error_code();
+        }
+        dfs_log(LL_ERROR) << "Fetch failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+    if (checksum.Final() != crc) {
+        // The server's copy changed while it was being sent
+        dfs_log(LL_ERROR) << "Fetched copy of " << filename << " does not match the server's crc";
+        unlink(staged.c_str());
+        return StatusCode::DATA_LOSS;
+    }
+
+    DFSSetModTime(staged, mtime);
+    if (!Checksums().Commit(staged, filename, crc)) {
+        dfs_log(LL_ERROR) << "Could not replace " << filepath << ": " << strerror(errno);
+        unlink(staged.c_str());
+        return StatusCode::CANCELLED;
+    }
+
+    dfs_log(LL_DEBUG) << "File fetched successfully: " << filename;
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchDelta(const std::string &filename) {
+
+    // Signing maps and hashes the whole cached copy, so first ask whether
+    // the server's copy differs at all
+    std::uint32_t cached_crc = Checksum(filename);
+    FileStatus server_status;
+    StatusCode code = Stat(filename, &server_status);
+    if (code != StatusCode::OK) {
+        return code;
+    }
+    if (server_status.crc() == cached_crc) {
+        dfs_log(LL_DEBUG) << "Cached copy of " << filename << " is current";
+        return StatusCode::ALREADY_EXISTS;
+    }
+
+    std::string filepath = WrapPath(filename);
+    DFSMappedFile base;
+    if (!base.Open(filepath)) {
+        dfs_log(LL_ERROR) << "Could not open cached copy: " << filepath;
+        return StatusCode::CANCELLED;
+    }
+
+    FileSignature signature;
+    signature.set_name(filename);
+    signature.set_crc(cached_crc);
+    DFSSignFile(base, &signature);
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    std::string staged;
+    int fd = DFSStageFile(filepath, &staged);
+    if (fd < 0) {
+        return StatusCode::CANCELLED;
+    }
+
+    auto reader = this->service_stub->FetchDelta(&context, signature);
+
+    FileDelta delta;
+    bool first = true;
+    bool applied = true;
+    std::uint32_t crc = 0;
+    int64_t mtime = 0;
+    uint32_t block_size = 0;
+    uint64_t literal_bytes = 0;
+    DFSFileChecksum checksum;
+    while (reader->Read(&delta)) {
+        if (first) {
+            crc = delta.crc();
+            mtime = delta.mtime();
+            block_size = delta.block_size();
+            first = false;
+        }
+        for (const DeltaOp& op : delta.ops()) {
+            literal_bytes += op.literal().size();
+            applied = applied && DFSApplyDeltaOp(base, block_size, op, fd, &checksum);
+        }
+    }
+    applied = (close(fd) == 0) && applied;
+
+    Status status = reader->Finish();
+    if (!status.ok()) {
+        unlink(staged.c_str());
+        dfs_log(LL_DEBUG) << "Delta fetch of " << filename << " ended: " << status.error_message();
+        return status.error_code();
+    }
+    if (!applied || first || checksum.Final() != crc) {
+        dfs_log(LL_ERROR) << "Patched copy of " << filename << " does not match the server's";
+        unlink(staged.c_str());
+        return StatusCode::DATA_LOSS;
+    }
+
+    DFSSetModTime(staged, mtime);
+    if (!Checksums().Commit(staged, filename, crc)) {
+        dfs_log(LL_ERROR) << "Could not replace " << filepath << ": " << strerror(errno);
+        unlink(staged.c_str());
+        return StatusCode::CANCELLED;
+    }
+
+    dfs_log(LL_DEBUG) << "Delta fetched " << filename << ": " << literal_bytes << " literal bytes";
+    return StatusCode::OK;
 }
 
 grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
@@ -145,6 +648,39 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
     //
     //
 
+    StatusCode code = RequestWriteAccess(filename);
+    if (code != StatusCode::OK) {
+        return code == StatusCode::DEADLINE_EXCEEDED ? code : StatusCode::RESOURCE_EXHAUSTED;
+    }
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    FileRequest request;
+    request.set_name(filename);
+    request.set_client_id(this->client_id);
+    request.set_lock_token(WriteToken(filename));
+    FileStatus response;
+
+    dfs_log(LL_DEBUG) << "Deleting file: " << filename;
+
+    Status status = this->service_stub->Delete(&context, request, &response);
+    if (!status.ok()) {
+        ReleaseWriteAccess(filename);
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED ||
+            status.error_code() == StatusCode::NOT_FOUND) {
+            dfs_log(LL_DEBUG) << "Delete of " << filename << " ended: " << status.error_message();
+            return status.error_code();
+        }
+        dfs_log(LL_ERROR) << "Delete failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    ForgetWriteAccess(filename);
+    dfs_log(LL_DEBUG) << "File deleted successfully: " << filename;
+    return StatusCode::OK;
 }
 
 grpc::StatusCode DFSClientNodeP2::List(std::map<std::string,int>* file_map, bool display) {
@@ -165,6 +701,43 @@ grpc::StatusCode DFSClientNodeP2::List(std::map<std::string,int>* file_map, bool
     // StatusCode::CANCELLED otherwise
     //
     //
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    Empty request;
+    FileList response;
+
+    dfs_log(LL_DEBUG) << "Listing files from server";
+
+    Status status = this->service_stub->List(&context, request, &response);
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            dfs_log(LL_ERROR) << "Deadline exceeded for list operation";
+            return StatusCode::DEADLINE_EXCEEDED;
+        }
+        dfs_log(LL_ERROR) << "List failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    if (file_map != nullptr) {
+        file_map->clear();
+        for (const FileStatus& file : response.files()) {
+            (*file_map)[file.filename()] = file.mtime();
+        }
+    }
+
+    if (display) {
+        std::cout << "File Listing:" << std::endl;
+        for (const FileStatus& file : response.files()) {
+            std::cout << "  " << file.filename() << " (size: " << file.size()
+                      << ", mtime: " << file.mtime() << ")" << std::endl;
+        }
+    }
+
+    return StatusCode::OK;
 }
 
 grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void* file_status) {
@@ -186,6 +759,34 @@ grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void* file_s
     // StatusCode::CANCELLED otherwise
     //
     //
+
+    ClientContext context;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+    context.set_deadline(deadline);
+
+    FileRequest request;
+    request.set_name(filename);
+    FileStatus response;
+
+    Status status = this->service_stub->Stat(&context, request, &response);
+    if (!status.ok()) {
+        if (status.error_code() == StatusCode::DEADLINE_EXCEEDED ||
+            status.error_code() == StatusCode::NOT_FOUND) {
+            dfs_log(LL_DEBUG) << "Stat of " << filename << " ended: " << status.error_message();
+            return status.error_code();
+        }
+        dfs_log(LL_ERROR) << "Stat failed: " << status.error_message();
+        return StatusCode::CANCELLED;
+    }
+
+    if (file_status != nullptr) {
+        static_cast<FileStatus*>(file_status)->CopyFrom(response);
+    } else {
+        std::cout << response.filename() << ": size " << response.size() << ", mtime " << response.mtime()
+                  << ", ctime " << response.ctime() << ", crc " << response.crc() << std::endl;
+    }
+    return StatusCode::OK;
 }
 
 void DFSClientNodeP2::InotifyWatcherCallback(std::function<void()> callback) {
@@ -209,7 +810,7 @@ void DFSClientNodeP2::InotifyWatcherCallback(std::function<void()> callback) {
     // the async thread when a file event has been signaled?
     //
 
-
+    std::lock_guard<std::mutex> lock(sync_mutex);
     callback();
 
 }
@@ -254,6 +855,7 @@ void DFSClientNodeP2::HandleCallbackList() {
             //
             // Consider adding a critical section or RAII style lock here
             //
+            std::lock_guard<std::mutex> lock(sync_mutex);
 
             // The tag is the memory location of the call_data object
             AsyncClientData<FileListResponseType> *call_data = static_cast<AsyncClientData<FileListResponseType> *>(tag);
@@ -281,7 +883,20 @@ void DFSClientNodeP2::HandleCallbackList() {
                 // Send an update to the server?
                 // Do nothing?
                 //
-
+                const FileList& reply = call_data->reply;
+                if (reply.reconcile()) {
+                    Reconcile(reply.root_hash());
+                } else if (reply.incremental()) {
+                    for (const FileStatus& file : reply.files()) {
+                        SynchronizeFile(file);
+                    }
+                    for (const FileStatus& file : reply.deleted()) {
+                        SynchronizeDeletion(file.filename(), file.mtime());
+                    }
+                } else {
+                    Synchronize(reply);
+                }
+                this->callback_cursor = reply.cursor();
 
 
             } else {
@@ -317,7 +932,79 @@ void DFSClientNodeP2::HandleCallbackList() {
  * give you a chance to focus more on the project's requirements.
  */
 void DFSClientNodeP2::InitCallbackList() {
-    CallbackList<FileRequestType, FileListResponseType>();
+    FileRequestType request;
+    request.set_client_id(ClientId());
+    request.set_cursor(this->callback_cursor);
+    request.set_merkle(true);
+    CallbackList<FileRequestType, FileListResponseType>(request);
+}
+
+void DFSClientNodeP2::HandleSubscription() {
+
+    std::string resume_token;
+    while (!Unmounting()) {
+        ClientContext context;
+        SubscribeRequest request;
+        request.set_client_id(ClientId());
+        request.set_resume_token(resume_token);
+        request.set_merkle(true);
+        std::unique_ptr<ClientReader<FileEvent>> reader = service_stub->Subscribe(&context, request);
+
+        // A listing is collected across LISTING events and applied at SYNCED
+        FileList listing;
+        bool listed = false;
+        FileEvent event;
+        while (reader->Read(&event)) {
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            switch (event.kind()) {
+                case FileEvent::LISTING:
+                    listing.MergeFrom(event.listing());
+                    listed = true;
+                    break;
+                case FileEvent::SYNCED:
+                    if (listed) {
+                        dfs_log(LL_DEBUG2) << "Synchronizing with a listing of " << listing.files_size() << " files";
+                        Synchronize(listing);
+                        listing.Clear();
+                        listed = false;
+                    }
+                    break;
+                case FileEvent::RECONCILE:
+                    if (!Reconcile(event.root_hash())) {
+                        // Don't resume past changes that were never applied
+                        resume_token.clear();
+                        context.TryCancel();
+                        continue;
+                    }
+                    break;
+                case FileEvent::CREATED:
+                case FileEvent::MODIFIED:
+                    dfs_log(LL_DEBUG2) << "Server changed " << event.file().filename();
+                    SynchronizeFile(event.file());
+                    break;
+                case FileEvent::DELETED:
+                    dfs_log(LL_DEBUG2) << "Server deleted " << event.file().filename();
+                    SynchronizeDeletion(event.file().filename(), event.file().mtime());
+                    break;
+                default:
+                    break;
+            }
+            if (!event.resume_token().empty()) {
+                resume_token = event.resume_token();
+            }
+        }
+
+        Status status = reader->Finish();
+        if (status.error_code() == StatusCode::UNIMPLEMENTED) {
+            dfs_log(LL_SYSINFO) << "Server has no change notifications, polling instead";
+            InitCallbackList();
+            HandleCallbackList();
+            return;
+        }
+        dfs_log(LL_ERROR) << "Subscription ended: " << status.error_message() << ". Will try again in "
+                          << DFS_RESET_TIMEOUT << " milliseconds.";
+        std::this_thread::sleep_for(std::chrono::milliseconds(DFS_RESET_TIMEOUT));
+    }
 }
 
 //
@@ -326,3 +1013,154 @@ void DFSClientNodeP2::InitCallbackList() {
 // Add any additional code you need to here
 //
 
+void DFSClientNodeP2::Synchronize(const FileList& server_files) {
+
+    DIR* dir = opendir(this->mount_path.c_str());
+    if (!dir) {
+        dfs_log(LL_ERROR) << "Could not open directory: " << this->mount_path;
+        return;
+    }
+    std::vector<std::string> local_files;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG && entry->d_name[0] != '.') {
+            local_files.emplace_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    Synchronize(server_files, local_files);
+}
+
+void DFSClientNodeP2::Synchronize(const FileList& server_files, const std::vector<std::string>& local_files) {
+
+    std::map<std::string, const FileStatus*> on_server;
+    for (const FileStatus& file : server_files.files()) {
+        on_server[file.filename()] = &file;
+    }
+
+    for (const FileStatus& file : server_files.files()) {
+        SynchronizeFile(file);
+    }
+
+    // Files deleted on the server, by deletion time
+    std::map<std::string, int64_t> deleted;
+    for (const FileStatus& file : server_files.deleted()) {
+        deleted[file.filename()] = file.mtime();
+    }
+
+    for (const std::string& filename : local_files) {
+        if (on_server.count(filename) != 0) {
+            continue;
+        }
+        auto tombstone = deleted.find(filename);
+        if (tombstone != deleted.end()) {
+            SynchronizeDeletion(filename, tombstone->second);
+        } else {
+            Store(filename);
+        }
+    }
+}
+
+bool DFSClientNodeP2::Reconcile(const std::string& server_root) {
+
+    // Pick up changes made while nothing was watching
+    Checksums().Scan();
+    if (Tree().Root() == server_root) {
+        dfs_log(LL_DEBUG2) << "Merkle roots match, nothing to reconcile";
+        return true;
+    }
+
+    // Descend into the nodes whose hashes differ from ours, a batch of
+    // nodes per call
+    std::vector<std::string> frontier(1, "");
+    size_t leaves = 0;
+    while (!frontier.empty()) {
+        size_t count = std::min(frontier.size(), static_cast<size_t>(DFS_MERKLE_BATCH));
+        MerkleRequest request;
+        for (size_t i = frontier.size() - count; i < frontier.size(); i++) {
+            request.add_nodes(frontier[i]);
+        }
+        frontier.resize(frontier.size() - count);
+
+        ClientContext context;
+        std::chrono::system_clock::time_point deadline =
+            std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout);
+        context.set_deadline(deadline);
+
+        MerkleReply reply;
+        Status status = this->service_stub->MerkleNodes(&context, request, &reply);
+        if (!status.ok()) {
+            dfs_log(LL_ERROR) << "Merkle reconciliation failed: " << status.error_message();
+            return false;
+        }
+
+        for (const MerkleNode& node : reply.nodes()) {
+            if (DFSMerkleTree::IsLeaf(node.node())) {
+                FileList listing;
+                listing.mutable_files()->CopyFrom(node.files());
+                listing.mutable_deleted()->CopyFrom(node.deleted());
+                std::map<std::string, DFSFileRecord> files;
+                Tree().Files(node.node(), &files);
+                std::vector<std::string> local_files;
+                for (const auto& file : files) {
+                    local_files.push_back(file.first);
+                }
+                Synchronize(listing, local_files);
+                leaves++;
+                continue;
+            }
+
+            std::vector<std::string> children;
+            if (!Tree().Children(node.node(), &children) ||
+                children.size() != static_cast<size_t>(node.children_size())) {
+                dfs_log(LL_ERROR) << "Server sent a malformed Merkle node: " << node.node();
+                return false;
+            }
+            static const char digits[] = "0123456789abcdef";
+            for (size_t i = 0; i < children.size(); i++) {
+                if (children[i] != node.children(static_cast<int>(i))) {
+                    frontier.push_back(node.node() + digits[i]);
+                }
+            }
+        }
+    }
+
+    dfs_log(LL_DEBUG2) << "Reconciled " << leaves << " differing Merkle leaves";
+    return true;
+}
+
+void DFSClientNodeP2::SynchronizeFile(const FileStatus& file) {
+
+    // The most recently modified copy wins
+    int64_t local_mtime = GetFileModTime(WrapPath(file.filename()));
+    if (local_mtime < 0) {
+        Fetch(file.filename());
+        return;
+    }
+    if (Checksum(file.filename()) == file.crc()) {
+        return;
+    }
+    if (file.mtime() > local_mtime) {
+        Fetch(file.filename());
+    } else if (local_mtime > file.mtime()) {
+        Store(file.filename());
+    }
+}
+
+void DFSClientNodeP2::SynchronizeDeletion(const std::string& filename, int64_t deleted) {
+
+    // Deletions win over copies that are no newer than the deletion
+    int64_t local_mtime = GetFileModTime(WrapPath(filename));
+    if (local_mtime < 0) {
+        return;
+    }
+    if (local_mtime <= deleted) {
+        dfs_log(LL_DEBUG) << "Removing " << filename << ", deleted on the server";
+        unlink(WrapPath(filename).c_str());
+        Checksums().Remove(filename);
+    } else {
+        Store(filename);
+    }
+}
+
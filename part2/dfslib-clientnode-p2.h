@@ -7,10 +7,15 @@
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <memory>
+#include <thread>
+#include <condition_variable>
 
 #include <grpcpp/grpcpp.h>
 
 #include "src/dfslibx-clientnode-p2.h"
+#include "dfslib-metadata-p2.h"
+#include "dfslib-merkle-p2.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 class DFSClientNodeP2 : public DFSClientNode {
@@ -119,6 +124,14 @@ public:
      */
      void InitCallbackList() override;
 
+    /**
+     * Keep the mount path in sync from the server's change notifications
+     * until unmounted, resubscribing after disconnects. Falls back to
+     * polling with InitCallbackList and HandleCallbackList on a server
+     * without them.
+     */
+    void HandleSubscription();
+
     /**
      * Watcher wrapper
      *
@@ -142,6 +155,172 @@ public:
     // You may add any additional declarations of methods or variables that you need here.
     //
 
+    /**
+     * Give up a write lock without storing
+     *
+     * @param filename
+     */
+    void ReleaseWriteAccess(const std::string& filename);
+
+    /**
+     * Enable or disable delta transfers (on by default). With delta
+     * transfers, a file the other side already has a copy of is sent
+     * as the differences from that copy rather than in full.
+     *
+     * @param enabled
+     */
+    void SetDeltaTransfers(bool enabled);
+
+private:
+
+    /** Serializes the watcher and the callback list handler **/
+    std::mutex sync_mutex;
+
+    /** Whether Store and Fetch send deltas against the other side's copy **/
+    bool delta_transfers;
+
+    /** The cursor of the last CallbackList reply, for an incremental next one **/
+    std::string callback_cursor;
+
+    /** Guards write_tokens, lease_time and heartbeat_stopping **/
+    std::mutex lease_mutex;
+    std::condition_variable lease_cv;
+
+    /** Fencing tokens of the write locks held, by file **/
+    std::map<std::string, uint64_t> write_tokens;
+
+    /** Milliseconds the server's write locks live without renewal **/
+    int lease_time;
+
+    /** Renews the held write locks until the node is destroyed **/
+    std::thread heartbeat;
+    std::once_flag heartbeat_started;
+    bool heartbeat_stopping;
+
+    /**
+     * The fencing token of the write lock held on a file
+     *
+     * @param filename
+     * @return 0 if no lock is held
+     */
+    uint64_t WriteToken(const std::string& filename);
+
+    /**
+     * Stop renewing a write lock the server released itself
+     *
+     * @param filename
+     */
+    void ForgetWriteAccess(const std::string& filename);
+
+    /**
+     * Renew the held write locks every third of the lease time, so that
+     * a long transfer keeps its lock and a dead client's locks lapse
+     */
+    void HeartbeatLeases();
+
+    /** Checksums of the cached files, and the Merkle tree over them, opened on first use **/
+    std::unique_ptr<DFSMetadataIndex> checksums;
+    std::unique_ptr<DFSMerkleTree> tree;
+    std::once_flag checksums_opened;
+
+    /**
+     * The checksum cache, opened on first use
+     */
+    DFSMetadataIndex& Checksums();
+
+    /**
+     * The Merkle tree over the checksum cache
+     */
+    DFSMerkleTree& Tree();
+
+    /**
+     * The checksum of a file in the mount path, rehashed only if it changed
+     * since it was last hashed, even in an earlier run
+     *
+     * @param filename
+     * @return 0 if the file doesn't exist
+     */
+    std::uint32_t Checksum(const std::string& filename);
+
+    /**
+     * Send a whole file; the caller holds the write lock
+     *
+     * @param filename
+     * @param crc
+     * @param mtime
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode StoreWhole(const std::string& filename, std::uint32_t crc, int64_t mtime);
+
+    /**
+     * Send only the differences from the server's copy; the caller holds the write lock
+     *
+     * @param filename
+     * @param crc
+     * @param mtime
+     * @return NOT_FOUND if the server has no copy, FAILED_PRECONDITION or
+     *         DATA_LOSS if its copy changed, INVALID_ARGUMENT if its signature
+     *         is malformed, CANCELLED if the delta couldn't be sent, otherwise
+     *         as Store
+     */
+    grpc::StatusCode StoreDelta(const std::string& filename, std::uint32_t crc, int64_t mtime);
+
+    /**
+     * Fetch a whole file
+     *
+     * @param filename
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode FetchWhole(const std::string& filename);
+
+    /**
+     * Patch the cached copy with only the differences from the server's
+     * copy. The cached copy is only signed once a Stat shows the crcs differ.
+     *
+     * @param filename
+     * @return DATA_LOSS if the patched copy doesn't match the server's, otherwise as Fetch
+     */
+    grpc::StatusCode FetchDelta(const std::string& filename);
+
+    /**
+     * Reconcile the mount path with a server listing
+     *
+     * @param server_files
+     */
+    void Synchronize(const dfs_service::FileList& server_files);
+
+    /**
+     * Reconcile some of the mount path with a server listing of the same files
+     *
+     * @param server_files
+     * @param local_files the local files the listing covers
+     */
+    void Synchronize(const dfs_service::FileList& server_files, const std::vector<std::string>& local_files);
+
+    /**
+     * Reconcile the mount path with the server's by walking the Merkle
+     * trees, fetching only the nodes whose hashes differ
+     *
+     * @param server_root the root hash of the server's tree
+     * @return false if the server couldn't be asked for its nodes
+     */
+    bool Reconcile(const std::string& server_root);
+
+    /**
+     * Reconcile one file with its status on the server
+     *
+     * @param file
+     */
+    void SynchronizeFile(const dfs_service::FileStatus& file);
+
+    /**
+     * Drop the local copy of a file deleted on the server, unless it was
+     * modified after the deletion, in which case it is stored again
+     *
+     * @param filename
+     * @param deleted the deletion time
+     */
+    void SynchronizeDeletion(const std::string& filename, int64_t deleted);
 
 };
 #endif
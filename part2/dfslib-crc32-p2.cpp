@@ -0,0 +1,367 @@
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <system_error>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DFS_CRC32_X86
+#endif
+
+#include "dfslib-crc32-p2.h"
+
+#define DFS_CRC32_POLY 0xEDB88320u         // 0x04C11DB7, reflected
+#define DFS_CRC32_CLMUL_MIN 64              // the folding kernel needs four lanes to start
+
+/**
+ * Lookup tables for slicing-by-16. tables[0] is the classic byte table;
+ * tables[k][b] is the CRC of byte b followed by k zero bytes.
+ */
+struct DFSCrc32Tables {
+    std::uint32_t tables[16][256];
+
+    DFSCrc32Tables() {
+        for (std::uint32_t byte = 0; byte < 256; byte++) {
+            std::uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (DFS_CRC32_POLY & (0u - (crc & 1)));
+            }
+            tables[0][byte] = crc;
+        }
+        for (int k = 1; k < 16; k++) {
+            for (int byte = 0; byte < 256; byte++) {
+                std::uint32_t previous = tables[k - 1][byte];
+                tables[k][byte] = (previous >> 8) ^ tables[0][previous & 0xFF];
+            }
+        }
+    }
+};
+
+static const DFSCrc32Tables& Tables() {
+    static const DFSCrc32Tables tables;
+    return tables;
+}
+
+static inline std::uint32_t Load32(const unsigned char* p) {
+    std::uint32_t value;
+    memcpy(&value, p, sizeof(value));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+#endif
+    return value;
+}
+
+/**
+ * The byte loop on the internal (inverted) register
+ */
+static inline std::uint32_t UpdateBytes(std::uint32_t reg, const unsigned char* p, size_t length) {
+    const std::uint32_t* table = Tables().tables[0];
+    while (length-- > 0) {
+        reg = (reg >> 8) ^ table[(reg ^ *p++) & 0xFF];
+    }
+    return reg;
+}
+
+/**
+ * Slicing-by-16 on the internal (inverted) register
+ */
+static std::uint32_t UpdateSlice16(std::uint32_t reg, const unsigned char* p, size_t length) {
+    const auto& t = Tables().tables;
+    while (length >= 16) {
+        std::uint32_t a = Load32(p) ^ reg;
+        std::uint32_t b = Load32(p + 4);
+        std::uint32_t c = Load32(p + 8);
+        std::uint32_t d = Load32(p + 12);
+        reg = t[15][a & 0xFF] ^ t[14][(a >> 8) & 0xFF] ^ t[13][(a >> 16) & 0xFF] ^ t[12][a >> 24] ^
+              t[11][b & 0xFF] ^ t[10][(b >> 8) & 0xFF] ^ t[9][(b >> 16) & 0xFF] ^ t[8][b >> 24] ^
+              t[7][c & 0xFF] ^ t[6][(c >> 8) & 0xFF] ^ t[5][(c >> 16) & 0xFF] ^ t[4][c >> 24] ^
+              t[3][d & 0xFF] ^ t[2][(d >> 8) & 0xFF] ^ t[1][(d >> 16) & 0xFF] ^ t[0][d >> 24];
+        p += 16;
+        length -= 16;
+    }
+    return UpdateBytes(reg, p, length);
+}
+
+std::uint32_t DFSCrc32Bytewise(std::uint32_t crc, const void* data, size_t length) {
+    return ~UpdateBytes(~crc, static_cast<const unsigned char*>(data), length);
+}
+
+std::uint32_t DFSCrc32Slice16(std::uint32_t crc, const void* data, size_t length) {
+    return ~UpdateSlice16(~crc, static_cast<const unsigned char*>(data), length);
+}
+
+#ifdef DFS_CRC32_X86
+
+/**
+ * Fold a multiple of 16 bytes, at least 64, into the internal register.
+ *
+ * Four 128-bit lanes are folded 64 bytes ahead at a time, then merged
+ * into one lane, reduced to 64 bits, and Barrett-reduced to 32 bits.
+ * The constants are x^n mod P for the fold distances, bit-reflected, as
+ * in Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction".
+ */
+__attribute__((target("pclmul,sse4.1")))
+static std::uint32_t UpdateClmul(std::uint32_t reg, const unsigned char* p, size_t length) {
+    alignas(16) static const std::uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const std::uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const std::uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const std::uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(reg)));
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+    p += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 0x30)));
+        p += 64;
+        length -= 64;
+    }
+
+    // Merge the four lanes
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (length >= 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        length -= 16;
+    }
+
+    // 128 bits to 64
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return static_cast<std::uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+bool DFSCrc32ClmulSupported() {
+    static const bool supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    return supported;
+}
+
+std::uint32_t DFSCrc32Clmul(std::uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    std::uint32_t reg = ~crc;
+    if (length >= DFS_CRC32_CLMUL_MIN && DFSCrc32ClmulSupported()) {
+        size_t folded = length & ~static_cast<size_t>(15);
+        reg = UpdateClmul(reg, p, folded);
+        p += folded;
+        length -= folded;
+    }
+    return ~UpdateSlice16(reg, p, length);
+}
+
+#else
+
+bool DFSCrc32ClmulSupported() {
+    return false;
+}
+
+std::uint32_t DFSCrc32Clmul(std::uint32_t crc, const void* data, size_t length) {
+    return DFSCrc32Slice16(crc, data, length);
+}
+
+#endif
+
+/**
+ * Pick the variant once, on first use
+ */
+static std::uint32_t (*Dispatch())(std::uint32_t, const void*, size_t) {
+    static std::uint32_t (* const update)(std::uint32_t, const void*, size_t) =
+        DFSCrc32ClmulSupported() ? DFSCrc32Clmul : DFSCrc32Slice16;
+    return update;
+}
+
+std::uint32_t DFSCrc32(std::uint32_t crc, const void* data, size_t length) {
+    return Dispatch()(crc, data, length);
+}
+
+const char* DFSCrc32Engine() {
+    return DFSCrc32ClmulSupported() ? "pclmul" : "slice16";
+}
+
+/**
+ * a(x) * b(x) mod P(x), on reflected polynomials
+ */
+static std::uint32_t MultiplyModP(std::uint32_t a, std::uint32_t b) {
+    std::uint32_t product = 0;
+    for (std::uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b >> 1) ^ (DFS_CRC32_POLY & (0u - (b & 1)));
+    }
+    return product;
+}
+
+/**
+ * x^(8 * bytes) mod P(x), by squaring
+ */
+static std::uint32_t ShiftModP(std::uint64_t bytes) {
+    std::uint32_t power = 1u << 31;        // x^0
+    std::uint32_t square = 1u << 23;       // x^8, one byte
+    while (bytes != 0) {
+        if (bytes & 1) {
+            power = MultiplyModP(power, square);
+        }
+        square = MultiplyModP(square, square);
+        bytes >>= 1;
+    }
+    return power;
+}
+
+std::uint32_t DFSCrc32Combine(std::uint32_t crc_a, std::uint32_t crc_b, std::uint64_t length_b) {
+    return MultiplyModP(ShiftModP(length_b), crc_a) ^ crc_b;
+}
+
+static std::atomic<unsigned> checksum_threads(DFS_CHECKSUM_THREADS);
+
+void DFSSetChecksumThreads(unsigned threads) {
+    checksum_threads = std::max(threads, 1u);
+}
+
+/** Helper threads running for all DFSCrc32File calls; guarded by helper_mutex **/
+static std::mutex helper_mutex;
+static unsigned helpers_running = 0;
+
+/**
+ * Reserve up to `wanted` helper threads from the process-wide budget
+ *
+ * @return the helpers reserved, possibly none
+ */
+static unsigned AcquireHelpers(unsigned wanted) {
+    std::lock_guard<std::mutex> lock(helper_mutex);
+    unsigned budget = checksum_threads - 1;
+    unsigned granted = helpers_running < budget ? std::min(wanted, budget - helpers_running) : 0;
+    helpers_running += granted;
+    return granted;
+}
+
+static void ReleaseHelpers(unsigned helpers) {
+    std::lock_guard<std::mutex> lock(helper_mutex);
+    helpers_running -= helpers;
+}
+
+/**
+ * CRC one range on the calling thread
+ */
+static bool Crc32Range(int fd, std::uint64_t offset, std::uint64_t length, std::uint32_t* crc) {
+    std::vector<char> buffer(static_cast<size_t>(std::min<std::uint64_t>(length, DFS_CHECKSUM_READ_SIZE)));
+    std::uint32_t value = 0;
+    while (length > 0) {
+        ssize_t read_size = pread(fd, buffer.data(), static_cast<size_t>(std::min<std::uint64_t>(length, buffer.size())),
+                                  static_cast<off_t>(offset));
+        if (read_size <= 0) {
+            return false;
+        }
+        value = DFSCrc32(value, buffer.data(), static_cast<size_t>(read_size));
+        offset += static_cast<std::uint64_t>(read_size);
+        length -= static_cast<std::uint64_t>(read_size);
+    }
+    *crc = value;
+    return true;
+}
+
+bool DFSCrc32File(int fd, std::uint64_t offset, std::uint64_t length, std::uint32_t* crc) {
+    std::uint64_t wanted = std::min<std::uint64_t>(
+        std::min<unsigned>(checksum_threads, std::max(std::thread::hardware_concurrency(), 1u)),
+        length / DFS_CHECKSUM_SEGMENT_MIN);
+    unsigned helpers = wanted <= 1 ? 0 : AcquireHelpers(static_cast<unsigned>(wanted - 1));
+    if (helpers == 0) {
+        return Crc32Range(fd, offset, length, crc);
+    }
+
+    // Segment boundaries fall on read-size multiples. The calling thread
+    // hashes the first segment, and any whose helper couldn't be started.
+    std::uint64_t segments = helpers + 1;
+    std::uint64_t segment_size = (length / segments + DFS_CHECKSUM_READ_SIZE - 1) / DFS_CHECKSUM_READ_SIZE *
+                                 DFS_CHECKSUM_READ_SIZE;
+    std::vector<std::uint32_t> crcs(segments, 0);
+    std::vector<std::uint64_t> lengths(segments, 0);
+    std::vector<char> read(segments, 0);
+    std::vector<std::uint64_t> local{0};
+    std::vector<std::thread> workers;
+    workers.reserve(helpers);
+    for (std::uint64_t i = 0; i < segments; i++) {
+        std::uint64_t start = i * segment_size;
+        lengths[i] = start < length ? std::min(segment_size, length - start) : 0;
+        if (i == 0) {
+            continue;
+        }
+        try {
+            workers.emplace_back([&, i, start] {
+                read[i] = Crc32Range(fd, offset + start, lengths[i], &crcs[i]);
+            });
+        } catch (const std::system_error&) {
+            local.push_back(i);
+        }
+    }
+    ReleaseHelpers(helpers - static_cast<unsigned>(workers.size()));
+
+    for (std::uint64_t i : local) {
+        read[i] = Crc32Range(fd, offset + i * segment_size, lengths[i], &crcs[i]);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    ReleaseHelpers(static_cast<unsigned>(workers.size()));
+
+    std::uint32_t value = 0;
+    for (std::uint64_t i = 0; i < segments; i++) {
+        if (!read[i]) {
+            return false;
+        }
+        value = DFSCrc32Combine(value, crcs[i], lengths[i]);
+    }
+    *crc = value;
+    return true;
+}
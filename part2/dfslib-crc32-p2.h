@@ -0,0 +1,92 @@
+#ifndef PR4_DFSLIB_CRC32_H
+#define PR4_DFSLIB_CRC32_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define DFS_CHECKSUM_READ_SIZE (1024 * 1024)        // bytes read per call when hashing a file
+#define DFS_CHECKSUM_SEGMENT_MIN (32 * 1024 * 1024) // smallest range hashed by its own thread
+#define DFS_CHECKSUM_THREADS 4                      // default cap on threads per file, and on helpers in all
+
+//
+// CRC-32 (the zlib/IEEE polynomial, reflected, as CRCpp's CRC_32) over
+// buffers. Every variant continues from `crc`, the value returned for the
+// data before this buffer, and starts from 0, so
+//
+//     DFSCrc32(DFSCrc32(0, a, n), b, m) == DFSCrc32(0, a || b, n + m)
+//
+// and each returns exactly what CRC::Calculate(data, length,
+// CRC::CRC_32(), crc) would.
+//
+
+/**
+ * Update a CRC with the fastest variant this CPU supports
+ *
+ * @param crc
+ * @param data
+ * @param length
+ * @return
+ */
+std::uint32_t DFSCrc32(std::uint32_t crc, const void* data, size_t length);
+
+/**
+ * The name of the variant DFSCrc32 dispatches to
+ */
+const char* DFSCrc32Engine();
+
+/**
+ * One table lookup per byte
+ */
+std::uint32_t DFSCrc32Bytewise(std::uint32_t crc, const void* data, size_t length);
+
+/**
+ * Sixteen table lookups per 16 bytes, with no dependency between them
+ */
+std::uint32_t DFSCrc32Slice16(std::uint32_t crc, const void* data, size_t length);
+
+/**
+ * Carry-less multiplication folding, 64 bytes per step. Falls back to
+ * DFSCrc32Slice16 for short buffers and on CPUs without PCLMULQDQ.
+ */
+std::uint32_t DFSCrc32Clmul(std::uint32_t crc, const void* data, size_t length);
+
+/**
+ * Whether this CPU can run DFSCrc32Clmul's folding kernel
+ */
+bool DFSCrc32ClmulSupported();
+
+/**
+ * The CRC of A || B from the CRCs of A and B, without the data
+ *
+ * @param crc_a
+ * @param crc_b
+ * @param length_b
+ * @return
+ */
+std::uint32_t DFSCrc32Combine(std::uint32_t crc_a, std::uint32_t crc_b, std::uint64_t length_b);
+
+/**
+ * CRC a byte range of an open file. Ranges of at least two
+ * DFS_CHECKSUM_SEGMENT_MIN segments are split between the calling thread
+ * and helper threads, up to the DFSSetChecksumThreads cap, and the segment
+ * CRCs combined. Helpers come from a budget shared by every call; a call
+ * that finds it spent, or can't start a thread, hashes on its own thread.
+ *
+ * @param fd
+ * @param offset
+ * @param length
+ * @param crc set to the CRC of the range, starting from 0
+ * @return false if the range couldn't be read in full
+ */
+bool DFSCrc32File(int fd, std::uint64_t offset, std::uint64_t length, std::uint32_t* crc);
+
+/**
+ * Cap the threads one DFSCrc32File call may use, its own included, so
+ * hashing a large file leaves cores for the RPC threads. Concurrent calls
+ * share `threads` - 1 helpers between them.
+ *
+ * @param threads
+ */
+void DFSSetChecksumThreads(unsigned threads);
+
+#endif
@@ -0,0 +1,101 @@
+#include <string>
+#include <functional>
+
+#include "dfslib-locks-p2.h"
+
+DFSLockManager::DFSLockManager(int lease_ms) :
+    lease_time(lease_ms),
+    next_token(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count())) {}
+
+DFSLockManager::Shard& DFSLockManager::ShardOf(const std::string& name) {
+    return this->shards[std::hash<std::string>()(name) % DFS_LOCK_SHARDS];
+}
+
+bool DFSLockManager::Acquire(const std::string& name, const std::string& client_id,
+                             std::string* holder, uint64_t* token) {
+    Shard& shard = ShardOf(name);
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto lease = shard.leases.find(name);
+    if (lease != shard.leases.end() && lease->second.expires > now) {
+        *holder = lease->second.client_id;
+        *token = lease->second.token;
+        if (lease->second.client_id != client_id) {
+            return false;
+        }
+        lease->second.expires = now + this->lease_time;
+        return true;
+    }
+
+    // Drop the leases of clients that went away before adding one
+    for (auto it = shard.leases.begin(); it != shard.leases.end();) {
+        if (it->second.expires <= now) {
+            it = shard.leases.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    Lease& granted = shard.leases[name];
+    granted.client_id = client_id;
+    granted.token = this->next_token++;
+    granted.expires = now + this->lease_time;
+    *holder = client_id;
+    *token = granted.token;
+    return true;
+}
+
+bool DFSLockManager::Renew(const std::string& name, const std::string& client_id, uint64_t token) {
+    Shard& shard = ShardOf(name);
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto lease = shard.leases.find(name);
+    if (lease == shard.leases.end() || lease->second.expires <= now ||
+        lease->second.client_id != client_id || lease->second.token != token) {
+        return false;
+    }
+    lease->second.expires = now + this->lease_time;
+    return true;
+}
+
+bool DFSLockManager::Holds(const std::string& name, const std::string& client_id, uint64_t token) {
+    Shard& shard = ShardOf(name);
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto lease = shard.leases.find(name);
+    return lease != shard.leases.end() && lease->second.expires > now &&
+           lease->second.client_id == client_id && lease->second.token == token;
+}
+
+bool DFSLockManager::WhileHolding(const std::string& name, const std::string& client_id, uint64_t token,
+                                  const std::function<void()>& action) {
+    Shard& shard = ShardOf(name);
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto lease = shard.leases.find(name);
+    if (lease == shard.leases.end() || lease->second.expires <= now ||
+        lease->second.client_id != client_id || lease->second.token != token) {
+        return false;
+    }
+    action();
+    return true;
+}
+
+void DFSLockManager::Release(const std::string& name, const std::string& client_id, uint64_t token) {
+    Shard& shard = ShardOf(name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto lease = shard.leases.find(name);
+    if (lease != shard.leases.end() && lease->second.client_id == client_id && lease->second.token == token) {
+        shard.leases.erase(lease);
+    }
+}
+
+int DFSLockManager::LeaseTime() const {
+    return static_cast<int>(this->lease_time.count());
+}
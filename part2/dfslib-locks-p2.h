@@ -0,0 +1,126 @@
+#ifndef PR4_DFSLIB_LOCKS_H
+#define PR4_DFSLIB_LOCKS_H
+
+#include <map>
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+#define DFS_LOCK_SHARDS 16                      // lock tables, each with its own mutex
+
+/**
+ * Write locks on files, as leases.
+ *
+ * A lease is granted to one client id at a time and lapses unless it is
+ * renewed within the lease time, so a client that dies holding a lock
+ * only blocks the file until its lease runs out. Every grant carries a
+ * fencing token, fresh for each new lease; a write is only accepted with
+ * the token of the live lease, so a client that stalled past its lease
+ * can't commit over the next holder's write.
+ *
+ * Files are hashed across DFS_LOCK_SHARDS tables, so lock traffic on
+ * different files rarely contends for the same mutex.
+ */
+class DFSLockManager {
+
+public:
+    DFSLockManager(int lease_ms);
+
+    /**
+     * Grant or renew `client_id`'s lease on `name`, unless another client
+     * holds a live one. A holder asking again keeps its token.
+     *
+     * @param name
+     * @param client_id
+     * @param holder set to the client holding the lease
+     * @param token set to the lease's fencing token
+     * @return false if another client holds the lease
+     */
+    bool Acquire(const std::string& name, const std::string& client_id, std::string* holder, uint64_t* token);
+
+    /**
+     * Extend a live lease by the lease time
+     *
+     * @param name
+     * @param client_id
+     * @param token
+     * @return false if the lease lapsed or is someone else's
+     */
+    bool Renew(const std::string& name, const std::string& client_id, uint64_t token);
+
+    /**
+     * Whether `client_id` holds a live lease on `name` with fencing token `token`
+     *
+     * @param name
+     * @param client_id
+     * @param token
+     * @return
+     */
+    bool Holds(const std::string& name, const std::string& client_id, uint64_t token);
+
+    /**
+     * Run `action` only if `client_id` holds a live lease on `name` with
+     * fencing token `token`. The lease's shard stays locked while `action`
+     * runs, so the lease can't lapse to another client between the check
+     * and the write it fences. Lock traffic on the shard waits for `action`,
+     * so it should do the write and nothing more.
+     *
+     * @param name
+     * @param client_id
+     * @param token
+     * @param action
+     * @return false if the lease isn't held, and `action` didn't run
+     */
+    bool WhileHolding(const std::string& name, const std::string& client_id, uint64_t token,
+                      const std::function<void()>& action);
+
+    /**
+     * Give up a lease, if `client_id` holds it with `token`
+     *
+     * @param name
+     * @param client_id
+     * @param token
+     */
+    void Release(const std::string& name, const std::string& client_id, uint64_t token);
+
+    /**
+     * The lease time in milliseconds
+     */
+    int LeaseTime() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Lease {
+        std::string client_id;
+        uint64_t token;
+        Clock::time_point expires;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::map<std::string, Lease> leases;
+    };
+
+    std::chrono::milliseconds lease_time;
+
+    /** Next fencing token; starts from the clock so tokens aren't reused across restarts **/
+    std::atomic<uint64_t> next_token;
+
+    std::array<Shard, DFS_LOCK_SHARDS> shards;
+
+    /**
+     * The shard a file's lease lives in
+     *
+     * @param name
+     * @return
+     */
+    Shard& ShardOf(const std::string& name);
+
+};
+
+#endif
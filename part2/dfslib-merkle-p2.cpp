@@ -0,0 +1,200 @@
+#include <string>
+#include <vector>
+#include <ctime>
+#include <openssl/sha.h>
+
+#include "dfslib-crc32-p2.h"
+#include "dfslib-merkle-p2.h"
+
+/**
+ * The position in `hashes` of the first node on `level`
+ */
+static size_t LevelStart(size_t level) {
+    size_t start = 0;
+    size_t width = 1;
+    for (size_t i = 0; i < level; i++) {
+        start += width;
+        width *= DFS_MERKLE_FANOUT;
+    }
+    return start;
+}
+
+/**
+ * Append `value` as `bytes` little-endian bytes, so hashes agree across hosts
+ */
+static void AppendInteger(std::string* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+static std::string Hash(const std::string& data) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(), digest);
+    return std::string(reinterpret_cast<const char*>(digest), DFS_MERKLE_HASH_SIZE);
+}
+
+DFSMerkleTree::DFSMerkleTree(const DFSMetadataIndex& index) :
+    index(index), built(false), version(0),
+    leaves(LevelStart(DFS_MERKLE_DEPTH + 1) - LevelStart(DFS_MERKLE_DEPTH)), removed(leaves.size()),
+    hashes(LevelStart(DFS_MERKLE_DEPTH + 1)), stale(LevelStart(DFS_MERKLE_DEPTH + 1), true) {}
+
+size_t DFSMerkleTree::LeafOf(const std::string& name) {
+    return DFSCrc32(0, name.data(), name.size()) >> (32 - 4 * DFS_MERKLE_DEPTH);
+}
+
+std::string DFSMerkleTree::LeafName(size_t leaf) {
+    static const char digits[] = "0123456789abcdef";
+    std::string node(DFS_MERKLE_DEPTH, '0');
+    for (int i = DFS_MERKLE_DEPTH - 1; i >= 0; i--) {
+        node[i] = digits[leaf % DFS_MERKLE_FANOUT];
+        leaf /= DFS_MERKLE_FANOUT;
+    }
+    return node;
+}
+
+bool DFSMerkleTree::IsLeaf(const std::string& node) {
+    size_t position;
+    return node.size() == DFS_MERKLE_DEPTH && Position(node, &position);
+}
+
+bool DFSMerkleTree::Position(const std::string& node, size_t* position) {
+    if (node.size() > DFS_MERKLE_DEPTH) {
+        return false;
+    }
+    size_t offset = 0;
+    for (char digit : node) {
+        if (digit >= '0' && digit <= '9') {
+            offset = offset * DFS_MERKLE_FANOUT + (digit - '0');
+        } else if (digit >= 'a' && digit <= 'f') {
+            offset = offset * DFS_MERKLE_FANOUT + (digit - 'a' + 10);
+        } else {
+            return false;
+        }
+    }
+    *position = LevelStart(node.size()) + offset;
+    return true;
+}
+
+void DFSMerkleTree::Touch(size_t leaf) {
+    size_t offset = leaf;
+    for (int level = DFS_MERKLE_DEPTH; level >= 0; level--) {
+        this->stale[LevelStart(level) + offset] = true;
+        offset /= DFS_MERKLE_FANOUT;
+    }
+}
+
+void DFSMerkleTree::CatchUp() {
+    std::vector<DFSIndexChange> changes;
+    if (this->built && this->index.WaitChanges(this->version, &changes, 0)) {
+        for (const DFSIndexChange& change : changes) {
+            size_t leaf = LeafOf(change.name);
+            if (change.removed) {
+                this->leaves[leaf].erase(change.name);
+                this->removed[leaf][change.name] = DFSTombstone{change.time, change.record.version};
+            } else {
+                this->leaves[leaf][change.name] = change.record;
+                this->removed[leaf].erase(change.name);
+            }
+            Touch(leaf);
+            this->version = change.record.version;
+        }
+        return;
+    }
+
+    for (size_t leaf = 0; leaf < this->leaves.size(); leaf++) {
+        this->leaves[leaf].clear();
+        this->removed[leaf].clear();
+    }
+    this->version = this->index.ForEach([this](const std::string& name, const DFSFileRecord& record) {
+        this->leaves[LeafOf(name)][name] = record;
+    }, [this](const std::string& name, const DFSTombstone& tombstone) {
+        this->removed[LeafOf(name)][name] = tombstone;
+    });
+    this->stale.assign(this->stale.size(), true);
+    this->built = true;
+}
+
+void DFSMerkleTree::Rehash() {
+    // Leaves first, so each internal node hashes current children
+    size_t first_leaf = LevelStart(DFS_MERKLE_DEPTH);
+    for (size_t leaf = 0; leaf < this->leaves.size(); leaf++) {
+        if (!this->stale[first_leaf + leaf]) {
+            continue;
+        }
+        std::string data;
+        for (const auto& file : this->leaves[leaf]) {
+            data.append(file.first);
+            data.push_back('\0');
+            AppendInteger(&data, static_cast<uint64_t>(file.second.size), 8);
+            AppendInteger(&data, static_cast<uint64_t>(file.second.mtime_ns / 1000000000), 8);
+            AppendInteger(&data, file.second.crc, 4);
+        }
+        this->hashes[first_leaf + leaf] = Hash(data);
+        this->stale[first_leaf + leaf] = false;
+    }
+
+    for (int level = DFS_MERKLE_DEPTH - 1; level >= 0; level--) {
+        size_t start = LevelStart(level);
+        size_t children = LevelStart(level + 1);
+        for (size_t node = start; node < children; node++) {
+            if (!this->stale[node]) {
+                continue;
+            }
+            std::string data;
+            size_t first_child = children + (node - start) * DFS_MERKLE_FANOUT;
+            for (size_t child = first_child; child < first_child + DFS_MERKLE_FANOUT; child++) {
+                data.append(this->hashes[child]);
+            }
+            this->hashes[node] = Hash(data);
+            this->stale[node] = false;
+        }
+    }
+}
+
+std::string DFSMerkleTree::Root() {
+    std::lock_guard<std::mutex> lock(tree_mutex);
+    CatchUp();
+    Rehash();
+    return this->hashes[0];
+}
+
+bool DFSMerkleTree::Children(const std::string& node, std::vector<std::string>* children) {
+    size_t position;
+    if (node.size() >= DFS_MERKLE_DEPTH || !Position(node, &position)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(tree_mutex);
+    CatchUp();
+    Rehash();
+    size_t first_child = LevelStart(node.size() + 1) + (position - LevelStart(node.size())) * DFS_MERKLE_FANOUT;
+    children->assign(this->hashes.begin() + first_child, this->hashes.begin() + first_child + DFS_MERKLE_FANOUT);
+    return true;
+}
+
+bool DFSMerkleTree::Files(const std::string& node, std::map<std::string, DFSFileRecord>* files,
+                          std::map<std::string, DFSTombstone>* removed) {
+    size_t position;
+    if (node.size() != DFS_MERKLE_DEPTH || !Position(node, &position)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(tree_mutex);
+    CatchUp();
+    size_t leaf = position - LevelStart(DFS_MERKLE_DEPTH);
+    *files = this->leaves[leaf];
+    if (removed != nullptr) {
+        // The index expires tombstones without a change, so drop them here too
+        int64_t cutoff = static_cast<int64_t>(time(nullptr)) - DFS_TOMBSTONE_RETENTION;
+        for (auto tombstone = this->removed[leaf].begin(); tombstone != this->removed[leaf].end();) {
+            if (tombstone->second.time < cutoff) {
+                tombstone = this->removed[leaf].erase(tombstone);
+            } else {
+                ++tombstone;
+            }
+        }
+        *removed = this->removed[leaf];
+    }
+    return true;
+}
@@ -0,0 +1,140 @@
+#ifndef PR4_DFSLIB_MERKLE_H
+#define PR4_DFSLIB_MERKLE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "dfslib-metadata-p2.h"
+
+#define DFS_MERKLE_FANOUT 16                    // children per node, one hex digit each
+#define DFS_MERKLE_DEPTH 3                      // levels below the root; 4096 leaves
+#define DFS_MERKLE_HASH_SIZE 16                 // bytes of SHA-256 kept per node
+#define DFS_MERKLE_BATCH 256                    // nodes asked for per MerkleNodes call
+
+/**
+ * Merkle tree over the (name, size, mtime, crc) of every file in an index.
+ *
+ * Files are bucketed into leaves by the CRC-32 of their name, so a file
+ * lands in the same leaf on the server and on every client. A leaf hashes
+ * its files in name order, and every other node hashes its children, so
+ * two trees with equal roots hold the same files, and a differing file
+ * can be found by descending only into the children whose hashes differ.
+ *
+ * Nodes are named by the hex digits of the path from the root: "" is the
+ * root and leaves have DFS_MERKLE_DEPTH digits. Mtimes are hashed in
+ * seconds, the precision files are stamped with on transfer.
+ *
+ * The tree follows the index through its kept changes, catching up and
+ * rehashing only the touched paths on each query, and is rebuilt from
+ * the whole index if it fell further behind than that. It also buckets
+ * the index's tombstones by leaf, so that a leaf's deletions can be
+ * reported without walking every tombstone.
+ */
+class DFSMerkleTree {
+
+private:
+    const DFSMetadataIndex& index;
+
+    /** Guards everything below **/
+    std::mutex tree_mutex;
+
+    /** The index version the tree reflects, once built **/
+    bool built;
+    uint64_t version;
+
+    /** The files of each leaf, by name **/
+    std::vector<std::map<std::string, DFSFileRecord>> leaves;
+
+    /** The tombstones of each leaf, by name; they don't enter the hashes **/
+    std::vector<std::map<std::string, DFSTombstone>> removed;
+
+    /** Node hashes, level by level from the root, and which are stale **/
+    std::vector<std::string> hashes;
+    std::vector<bool> stale;
+
+    /**
+     * Apply the index's changes since `version`, or rebuild
+     */
+    void CatchUp();
+
+    /**
+     * Recompute the stale hashes, leaves first
+     */
+    void Rehash();
+
+    /**
+     * Mark a leaf and its ancestors stale
+     *
+     * @param leaf
+     */
+    void Touch(size_t leaf);
+
+    /**
+     * The position in `hashes` of a node name
+     *
+     * @param node
+     * @param position
+     * @return false if `node` isn't a node name
+     */
+    static bool Position(const std::string& node, size_t* position);
+
+public:
+    DFSMerkleTree(const DFSMetadataIndex& index);
+
+    /**
+     * The leaf a file belongs to, by position among the leaves
+     *
+     * @param name
+     * @return
+     */
+    static size_t LeafOf(const std::string& name);
+
+    /**
+     * The node name of a leaf position
+     *
+     * @param leaf
+     * @return
+     */
+    static std::string LeafName(size_t leaf);
+
+    /**
+     * Whether a node name is a leaf
+     *
+     * @param node
+     * @return
+     */
+    static bool IsLeaf(const std::string& node);
+
+    /**
+     * The root hash, current with the index
+     *
+     * @return
+     */
+    std::string Root();
+
+    /**
+     * The hashes of an internal node's children, by hex digit
+     *
+     * @param node
+     * @param children
+     * @return false if `node` isn't an internal node
+     */
+    bool Children(const std::string& node, std::vector<std::string>* children);
+
+    /**
+     * The files of a leaf, by name, and its tombstones that haven't expired
+     *
+     * @param node
+     * @param files
+     * @param removed skipped if null
+     * @return false if `node` isn't a leaf
+     */
+    bool Files(const std::string& node, std::map<std::string, DFSFileRecord>* files,
+               std::map<std::string, DFSTombstone>* removed = nullptr);
+
+};
+
+#endif
@@ -0,0 +1,481 @@
+#include <ctime>
+#include <vector>
+#include <string>
+#include <random>
+#include <fstream>
+#include <algorithm>
+#include <limits.h>
+#include <cstring>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "dfslib-metadata-p2.h"
+
+#define DFS_INDEX_MAGIC 0x33494644 // "DFI3"; tombstones follow the records
+
+/**
+ * Snapshot layout: this header, then `count` entries of a DFSIndexEntry
+ * followed by the file's name, then `removed` entries of a
+ * DFSIndexTombstone followed by the file's name
+ */
+struct DFSIndexHeader {
+    uint32_t magic;
+    uint32_t count;
+    uint64_t version;
+    uint32_t removed;
+    uint32_t reserved;
+};
+
+struct DFSIndexEntry {
+    uint64_t dev;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t inode;
+    uint64_t version;
+    uint32_t crc;
+    uint32_t name_length;
+};
+
+struct DFSIndexTombstone {
+    int64_t time;
+    uint64_t version;
+    uint32_t name_length;
+    uint32_t reserved;
+};
+
+static int64_t Nanoseconds(const struct timespec& time) {
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * Whether `record` still describes the file with attributes `st`
+ */
+static bool Unchanged(const DFSFileRecord& record, const struct stat& st) {
+    return record.dev == st.st_dev && record.inode == st.st_ino && record.size == st.st_size &&
+        record.mtime_ns == Nanoseconds(st.st_mtim) && record.ctime_ns == Nanoseconds(st.st_ctim);
+}
+
+/**
+ * A fresh epoch for each index instance
+ */
+static uint64_t NewEpoch() {
+    std::random_device random;
+    return (static_cast<uint64_t>(random()) << 32) ^ random() ^ static_cast<uint64_t>(time(nullptr));
+}
+
+DFSMetadataIndex::DFSMetadataIndex(const std::string& mount_path) :
+    mount_path(mount_path), version(0), epoch(NewEpoch()), changes_since(0), dirty(false), stopping(false) {}
+
+DFSMetadataIndex::~DFSMetadataIndex() {
+    Stop();
+}
+
+void DFSMetadataIndex::Start() {
+    if (!Load()) {
+        dfs_log(LL_SYSINFO) << "No metadata snapshot, indexing " << this->mount_path;
+    }
+    Scan();
+    Save();
+    this->watcher = std::thread(&DFSMetadataIndex::Watch, this);
+}
+
+void DFSMetadataIndex::Open() {
+    Load();
+    this->watcher = std::thread(&DFSMetadataIndex::Persist, this);
+}
+
+void DFSMetadataIndex::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        this->stopping = true;
+    }
+    this->stop_cv.notify_all();
+    if (this->watcher.joinable()) {
+        this->watcher.join();
+    }
+    if (this->dirty) {
+        Save();
+    }
+}
+
+bool DFSMetadataIndex::Load() {
+    std::ifstream in(this->mount_path + DFS_INDEX_SNAPSHOT, std::ios::binary);
+    DFSIndexHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != DFS_INDEX_MAGIC) {
+        return false;
+    }
+
+    std::map<std::string, DFSFileRecord> loaded;
+    for (uint32_t i = 0; i < header.count; i++) {
+        DFSIndexEntry entry;
+        if (!in.read(reinterpret_cast<char*>(&entry), sizeof(entry)) || entry.name_length > NAME_MAX) {
+            return false;
+        }
+        std::string name(entry.name_length, '\0');
+        if (!in.read(&name[0], entry.name_length)) {
+            return false;
+        }
+        loaded[name] = DFSFileRecord{entry.dev, entry.size, entry.mtime_ns, entry.ctime_ns, entry.inode, entry.crc, entry.version};
+    }
+
+    std::map<std::string, DFSTombstone> removed;
+    for (uint32_t i = 0; i < header.removed; i++) {
+        DFSIndexTombstone entry;
+        if (!in.read(reinterpret_cast<char*>(&entry), sizeof(entry)) || entry.name_length > NAME_MAX) {
+            return false;
+        }
+        std::string name(entry.name_length, '\0');
+        if (!in.read(&name[0], entry.name_length)) {
+            return false;
+        }
+        removed[name] = DFSTombstone{entry.time, entry.version};
+    }
+
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    this->records = std::move(loaded);
+    this->tombstones = std::move(removed);
+    this->version = header.version;
+    {
+        std::lock_guard<std::mutex> change_lock(change_mutex);
+        this->changes.clear();
+        this->changes_since = this->version;
+    }
+    dfs_log(LL_DEBUG) << "Loaded metadata snapshot of " << this->records.size() << " files and "
+                      << this->tombstones.size() << " tombstones";
+    return true;
+}
+
+void DFSMetadataIndex::Scan() {
+    std::vector<std::string> present;
+    DIR* dir = opendir(this->mount_path.c_str());
+    if (!dir) {
+        dfs_log(LL_ERROR) << "Could not open directory: " << this->mount_path;
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG && entry->d_name[0] != '.') {
+            present.emplace_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    size_t rehashed = 0;
+    for (const std::string& name : present) {
+        DFSFileRecord before;
+        bool known = Get(name, &before);
+        DFSFileRecord after;
+        if (Refresh(name, &after) && (!known || after.version != before.version)) {
+            rehashed++;
+        }
+    }
+
+    // Drop records of files removed while the server was down
+    std::sort(present.begin(), present.end());
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    for (auto record = this->records.begin(); record != this->records.end();) {
+        if (!std::binary_search(present.begin(), present.end(), record->first)) {
+            std::string name = record->first;
+            record = this->records.erase(record);
+            this->version++;
+            this->dirty = true;
+            Changed(name, nullptr, false);
+        } else {
+            ++record;
+        }
+    }
+    dfs_log(LL_SYSINFO) << "Indexed " << this->records.size() << " files, " << rehashed << " rehashed";
+}
+
+void DFSMetadataIndex::Persist() {
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (!this->stop_cv.wait_for(lock, std::chrono::milliseconds(DFS_INDEX_SAVE_DELAY),
+                                   [this] { return this->stopping.load(); })) {
+        if (this->dirty) {
+            lock.unlock();
+            Save();
+            lock.lock();
+        }
+    }
+}
+
+void DFSMetadataIndex::Watch() {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, this->mount_path.c_str(),
+                                    IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM |
+                                    IN_DELETE | IN_ONLYDIR) < 0) {
+        dfs_log(LL_ERROR) << "Could not watch " << this->mount_path << ": " << strerror(errno);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    std::vector<char> buffer(DFS_I_BUFFER_SIZE);
+    while (!this->stopping) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, DFS_INDEX_SAVE_DELAY);
+        if (ready <= 0) {
+            // Quiet for a while, so persist what changed
+            if (this->dirty) {
+                Save();
+            }
+            continue;
+        }
+
+        ssize_t length = read(fd, buffer.data(), buffer.size());
+        for (ssize_t index = 0; index < length;) {
+            inotify_event* event = reinterpret_cast<inotify_event*>(&buffer[index]);
+            index += DFS_I_EVENT_SIZE + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                dfs_log(LL_ERROR) << "Metadata watch overflowed, rescanning " << this->mount_path;
+                Scan();
+                continue;
+            }
+            if (event->len == 0 || event->name[0] == '.') {
+                continue;
+            }
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                Remove(event->name);
+            } else {
+                Refresh(event->name);
+            }
+        }
+    }
+    close(fd);
+}
+
+bool DFSMetadataIndex::Get(const std::string& name, DFSFileRecord* record) const {
+    std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+    auto found = this->records.find(name);
+    if (found == this->records.end()) {
+        return false;
+    }
+    *record = found->second;
+    return true;
+}
+
+bool DFSMetadataIndex::Refresh(const std::string& name, DFSFileRecord* record) {
+    std::string path = this->mount_path + name;
+    for (int attempt = 0;; attempt++) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            Remove(name);
+            return false;
+        }
+
+        // The version of the record seen before hashing, 0 if there was none
+        uint64_t seen = 0;
+        {
+            std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+            auto found = this->records.find(name);
+            if (found != this->records.end() && Unchanged(found->second, st)) {
+                if (record != nullptr) {
+                    *record = found->second;
+                }
+                return true;
+            }
+            seen = found != this->records.end() ? found->second.version : 0;
+        }
+
+        // Hash without holding the lock
+        DFSFileRecord updated = {st.st_dev, st.st_size, Nanoseconds(st.st_mtim), Nanoseconds(st.st_ctim), st.st_ino,
+                                 dfs_file_checksum(path), 0};
+
+        std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+        auto found = this->records.find(name);
+        if (found != this->records.end() && Unchanged(found->second, st)) {
+            // Another thread indexed the same change first
+            if (record != nullptr) {
+                *record = found->second;
+            }
+            return true;
+        }
+
+        // Install the hash only if neither the record nor the file moved on
+        // while it was computed; a Commit in between already indexed a
+        // newer version with its own crc, which this hash must not replace
+        struct stat now;
+        uint64_t current = found != this->records.end() ? found->second.version : 0;
+        bool moved = current != seen || stat(path.c_str(), &now) != 0 || !Unchanged(updated, now);
+        if (!moved) {
+            bool created = found == this->records.end();
+            updated.version = ++this->version;
+            this->records[name] = updated;
+            this->dirty = true;
+            Changed(name, &updated, created);
+            if (record != nullptr) {
+                *record = updated;
+            }
+            return true;
+        }
+        if (attempt + 1 >= DFS_INDEX_REFRESH_ATTEMPTS) {
+            // Still changing; report what is indexed and let the watcher catch up
+            if (found == this->records.end()) {
+                return false;
+            }
+            if (record != nullptr) {
+                *record = found->second;
+            }
+            return true;
+        }
+    }
+}
+
+bool DFSMetadataIndex::Commit(const std::string& staged, const std::string& name, std::uint32_t crc) {
+    std::string path = this->mount_path + name;
+
+    // A Refresh racing with the rename waits here, then finds the file
+    // already indexed
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    if (rename(staged.c_str(), path.c_str()) != 0) {
+        return false;
+    }
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        bool created = this->records.count(name) == 0;
+        DFSFileRecord& record = this->records[name];
+        record = DFSFileRecord{st.st_dev, st.st_size, Nanoseconds(st.st_mtim), Nanoseconds(st.st_ctim),
+                               st.st_ino, crc, ++this->version};
+        Changed(name, &record, created);
+    } else if (this->records.erase(name) > 0) {
+        this->version++;
+        Changed(name, nullptr, false);
+    }
+    this->dirty = true;
+    return true;
+}
+
+void DFSMetadataIndex::Remove(const std::string& name) {
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    if (this->records.erase(name) > 0) {
+        this->version++;
+        this->dirty = true;
+        Changed(name, nullptr, false);
+    }
+}
+
+void DFSMetadataIndex::Changed(const std::string& name, const DFSFileRecord* record, bool created) {
+    DFSIndexChange change = {name, DFSFileRecord{}, created, record == nullptr, static_cast<int64_t>(time(nullptr))};
+    if (record != nullptr) {
+        change.record = *record;
+        this->tombstones.erase(name);
+    } else {
+        this->tombstones[name] = DFSTombstone{change.time, this->version};
+    }
+    change.record.version = this->version;
+
+    std::lock_guard<std::mutex> lock(change_mutex);
+    this->changes.push_back(std::move(change));
+    if (this->changes.size() > DFS_INDEX_CHANGES_MAX) {
+        this->changes_since = this->changes.front().record.version;
+        this->changes.pop_front();
+    }
+    this->changed.notify_all();
+}
+
+void DFSMetadataIndex::ExpireTombstones() {
+    int64_t cutoff = static_cast<int64_t>(time(nullptr)) - DFS_TOMBSTONE_RETENTION;
+    std::unique_lock<std::shared_timed_mutex> lock(index_mutex);
+    for (auto tombstone = this->tombstones.begin(); tombstone != this->tombstones.end();) {
+        if (tombstone->second.time < cutoff) {
+            tombstone = this->tombstones.erase(tombstone);
+            this->dirty = true;
+        } else {
+            ++tombstone;
+        }
+    }
+}
+
+bool DFSMetadataIndex::WaitChanges(uint64_t version, std::vector<DFSIndexChange>* changes, int timeout_ms) const {
+    std::unique_lock<std::mutex> lock(change_mutex);
+    uint64_t latest = this->changes_since + this->changes.size();
+    if (version < this->changes_since || version > latest) {
+        return false;
+    }
+    if (version == latest) {
+        this->changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] {
+            return this->changes_since + this->changes.size() != latest;
+        });
+        if (version < this->changes_since) {
+            return false;
+        }
+    }
+    // Versions are consecutive, so the first change after `version` is at this offset
+    for (size_t i = version - this->changes_since; i < this->changes.size(); i++) {
+        changes->push_back(this->changes[i]);
+    }
+    return true;
+}
+
+uint64_t DFSMetadataIndex::ForEach(const std::function<void(const std::string&, const DFSFileRecord&)>& visit,
+                                   const std::function<void(const std::string&, const DFSTombstone&)>& removed) const {
+    std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+    if (visit) {
+        for (const auto& record : this->records) {
+            visit(record.first, record.second);
+        }
+    }
+    if (removed) {
+        for (const auto& tombstone : this->tombstones) {
+            removed(tombstone.first, tombstone.second);
+        }
+    }
+    return this->version;
+}
+
+uint64_t DFSMetadataIndex::Version() const {
+    std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+    return this->version;
+}
+
+uint64_t DFSMetadataIndex::Epoch() const {
+    return this->epoch;
+}
+
+bool DFSMetadataIndex::Save() {
+    ExpireTombstones();
+
+    std::string buffer;
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(index_mutex);
+        this->dirty = false;
+        DFSIndexHeader header = {DFS_INDEX_MAGIC, static_cast<uint32_t>(this->records.size()), this->version,
+                                 static_cast<uint32_t>(this->tombstones.size()), 0};
+        buffer.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& record : this->records) {
+            const DFSFileRecord& file = record.second;
+            DFSIndexEntry entry = {file.dev, file.size, file.mtime_ns, file.ctime_ns, file.inode, file.version, file.crc,
+                                   static_cast<uint32_t>(record.first.size())};
+            buffer.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            buffer.append(record.first);
+        }
+        for (const auto& tombstone : this->tombstones) {
+            DFSIndexTombstone entry = {tombstone.second.time, tombstone.second.version,
+                                       static_cast<uint32_t>(tombstone.first.size()), 0};
+            buffer.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            buffer.append(tombstone.first);
+        }
+    }
+
+    std::string staged;
+    int fd = DFSStageFile(this->mount_path + DFS_INDEX_SNAPSHOT, &staged);
+    if (fd < 0) {
+        this->dirty = true;
+        return false;
+    }
+    bool written = write(fd, buffer.data(), buffer.size()) == static_cast<ssize_t>(buffer.size());
+    written = (close(fd) == 0) && written;
+    if (!written || rename(staged.c_str(), (this->mount_path + DFS_INDEX_SNAPSHOT).c_str()) != 0) {
+        dfs_log(LL_ERROR) << "Could not save metadata snapshot: " << strerror(errno);
+        unlink(staged.c_str());
+        this->dirty = true;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,259 @@
+#ifndef PR4_DFSLIB_METADATA_H
+#define PR4_DFSLIB_METADATA_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <condition_variable>
+
+#include "dfslib-shared-p2.h"
+
+#define DFS_INDEX_SNAPSHOT ".dfs-index"         // snapshot of the index in the mount path
+#define DFS_INDEX_SAVE_DELAY 1000               // ms without changes before the snapshot is rewritten
+#define DFS_INDEX_CHANGES_MAX 4096              // recent changes kept for WaitChanges
+#define DFS_INDEX_REFRESH_ATTEMPTS 3            // rehashes of a file that keeps changing before Refresh gives up
+#define DFS_TOMBSTONE_RETENTION (7 * 24 * 3600) // seconds a deleted file's tombstone is kept
+
+/**
+ * The indexed attributes of a stored file
+ */
+struct DFSFileRecord {
+    uint64_t dev;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t inode;
+    uint32_t crc;
+    /** Index version at the file's last change **/
+    uint64_t version;
+};
+
+/**
+ * A file removed from the mount path
+ */
+struct DFSTombstone {
+    /** Wall-clock time of the removal, in seconds **/
+    int64_t time;
+    /** Index version of the removal **/
+    uint64_t version;
+};
+
+/**
+ * One change to the index
+ */
+struct DFSIndexChange {
+    std::string name;
+    /** The new record; for a removal, only the version is set **/
+    DFSFileRecord record;
+    bool created;
+    bool removed;
+    /** Wall-clock time of the change, in seconds **/
+    int64_t time;
+};
+
+/**
+ * In-memory index of the files in the server's mount path.
+ *
+ * The index is loaded from a snapshot at startup and reconciled with one
+ * stat per file, so only files that changed while the server was down are
+ * rehashed. After that, it is kept current by the server's own Store and
+ * Delete calls and by an inotify watch on the mount path, which catches
+ * changes made outside the server. List and Stat then never touch the disk.
+ *
+ * Every change bumps the index version, and the changed record takes the
+ * new version. The latest DFS_INDEX_CHANGES_MAX changes are also kept in
+ * memory, so that WaitChanges can hand out what changed since a version
+ * instead of the whole index. Versions are only comparable within one
+ * Epoch, since the kept changes don't survive a restart.
+ *
+ * Every removal, whether by Delete, by the watcher or found by a Scan,
+ * leaves a tombstone so that clients drop their copies instead of storing
+ * them again. Tombstones are saved with the snapshot, cleared when the
+ * name is indexed again, and expire after DFS_TOMBSTONE_RETENTION seconds;
+ * a client out of touch for longer may bring a deleted file back.
+ *
+ * A client can Open the index instead of starting it, to use it purely as
+ * a checksum cache: records are loaded from the snapshot and revalidated
+ * with a stat on each Refresh, with no scan and no watch. An opened index
+ * still saves what changed every DFS_INDEX_SAVE_DELAY, so a client that
+ * dies without Stop keeps most of the checksums it computed.
+ */
+class DFSMetadataIndex {
+
+private:
+    std::string mount_path;
+
+    /** Guards records, tombstones and version **/
+    mutable std::shared_timed_mutex index_mutex;
+    std::map<std::string, DFSFileRecord> records;
+    std::map<std::string, DFSTombstone> tombstones;
+    uint64_t version;
+
+    /** Random per instance, so versions from an earlier run aren't trusted **/
+    const uint64_t epoch;
+
+    /** Guards changes and changes_since; taken inside index_mutex **/
+    mutable std::mutex change_mutex;
+    mutable std::condition_variable changed;
+    /** The changes after version changes_since, oldest first **/
+    std::deque<DFSIndexChange> changes;
+    uint64_t changes_since;
+
+    /** Set when records changed since the last snapshot **/
+    std::atomic<bool> dirty;
+    std::atomic<bool> stopping;
+    std::thread watcher;
+
+    /** Wakes an opened index's saver for Stop **/
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+
+    /**
+     * Read the snapshot into `records`
+     *
+     * @return false if there is no usable snapshot
+     */
+    bool Load();
+
+    /**
+     * Watch the mount path and save snapshots until Stop
+     */
+    void Watch();
+
+    /**
+     * Save snapshots of an opened index until Stop
+     */
+    void Persist();
+
+    /**
+     * Log the change that took the index to `version`, add or clear the
+     * file's tombstone and wake the waiters; the caller holds index_mutex
+     * exclusively
+     *
+     * @param name
+     * @param record the new record, or nullptr for a removal
+     * @param created
+     */
+    void Changed(const std::string& name, const DFSFileRecord* record, bool created);
+
+    /**
+     * Drop tombstones older than DFS_TOMBSTONE_RETENTION
+     */
+    void ExpireTombstones();
+
+public:
+    DFSMetadataIndex(const std::string& mount_path);
+    ~DFSMetadataIndex();
+
+    /**
+     * Build the index and start watching the mount path
+     */
+    void Start();
+
+    /**
+     * Load the snapshot without scanning or watching the mount path, and
+     * start saving changes
+     */
+    void Open();
+
+    /**
+     * Stop watching or saving, and write a final snapshot if anything changed
+     */
+    void Stop();
+
+    /**
+     * Reconcile the records with the mount path, rehashing only changed files
+     */
+    void Scan();
+
+    /**
+     * Look up a file without touching the disk
+     *
+     * @param name
+     * @param record
+     * @return false if the file isn't indexed
+     */
+    bool Get(const std::string& name, DFSFileRecord* record) const;
+
+    /**
+     * Bring a file's record up to date. This costs one stat, plus a rehash
+     * if the file changed since it was indexed. The hash is only installed
+     * if the file and its record are still as they were when hashing began;
+     * otherwise the file is hashed again, up to DFS_INDEX_REFRESH_ATTEMPTS
+     * times.
+     *
+     * @param name
+     * @param record if given, set to the current record
+     * @return false if the file doesn't exist
+     */
+    bool Refresh(const std::string& name, DFSFileRecord* record = nullptr);
+
+    /**
+     * Rename a staged file into place and index it with the checksum the
+     * caller computed while writing it, so it isn't read back to be hashed.
+     * The watcher can't index the file in between.
+     *
+     * @param staged
+     * @param name
+     * @param crc
+     * @return false if the rename failed, with errno set
+     */
+    bool Commit(const std::string& staged, const std::string& name, std::uint32_t crc);
+
+    /**
+     * Drop a deleted file
+     *
+     * @param name
+     */
+    void Remove(const std::string& name);
+
+    /**
+     * Visit every record, then every tombstone, in name order. Both are
+     * read under one lock, so a file is in exactly one of them.
+     *
+     * @param visit skipped if empty
+     * @param removed skipped if empty
+     * @return the version of the records visited
+     */
+    uint64_t ForEach(const std::function<void(const std::string&, const DFSFileRecord&)>& visit,
+                     const std::function<void(const std::string&, const DFSTombstone&)>& removed = nullptr) const;
+
+    /**
+     * The version of the latest change
+     */
+    uint64_t Version() const;
+
+    /**
+     * Identifies this instance's versions
+     */
+    uint64_t Epoch() const;
+
+    /**
+     * Wait up to `timeout_ms` for the index to move past `version`, then
+     * collect the changes since
+     *
+     * @param version
+     * @param changes appended to, oldest first; empty on a timeout
+     * @param timeout_ms
+     * @return false if the changes after `version` are no longer kept, so
+     *         the caller has to start over from ForEach
+     */
+    bool WaitChanges(uint64_t version, std::vector<DFSIndexChange>* changes, int timeout_ms) const;
+
+    /**
+     * Write the snapshot
+     *
+     * @return
+     */
+    bool Save();
+
+};
+
+#endif
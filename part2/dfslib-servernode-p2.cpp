@@ -1,11 +1,15 @@
 #include <map>
 #include <mutex>
+#include <condition_variable>
 #include <shared_mutex>
 #include <chrono>
 #include <cstdio>
 #include <string>
 #include <thread>
 #include <errno.h>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
 #include <getopt.h>
@@ -17,6 +21,9 @@
 #include "src/dfslibx-call-data.h"
 #include "src/dfslibx-service-runner.h"
 #include "dfslib-shared-p2.h"
+#include "dfslib-metadata-p2.h"
+#include "dfslib-merkle-p2.h"
+#include "dfslib-locks-p2.h"
 #include "dfslib-servernode-p2.h"
 
 using grpc::Status;
@@ -28,6 +35,21 @@ using grpc::ServerContext;
 using grpc::ServerBuilder;
 
 using dfs_service::DFSService;
+using dfs_service::Empty;
+using dfs_service::FileRequest;
+using dfs_service::FileChunk;
+using dfs_service::FileStatus;
+using dfs_service::FileList;
+using dfs_service::WriteLockRequest;
+using dfs_service::WriteLockResponse;
+using dfs_service::FileSignature;
+using dfs_service::FileDelta;
+using dfs_service::DeltaOp;
+using dfs_service::SubscribeRequest;
+using dfs_service::FileEvent;
+using dfs_service::MerkleRequest;
+using dfs_service::MerkleNode;
+using dfs_service::MerkleReply;
 
 
 //
@@ -59,10 +81,9 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 // - How will you release the write lock?
 // - How will you handle a store request for a client that doesn't have a write lock?
 // - When matching files to determine similarity, you should use the `file_checksum` method we've provided.
-//      - Both the client and server have a pre-made `crc_table` variable to speed things up.
 //      - Use the `file_checksum` method to compare two files, similar to the following:
 //
-//          std::uint32_t server_crc = dfs_file_checksum(filepath, &this->crc_table);
+//          std::uint32_t server_crc = dfs_file_checksum(filepath);
 //
 //      - Hint: as the crc checksum is a simple integer, you can pass it around inside your message types.
 //
@@ -84,6 +105,21 @@ private:
     /** The vector of queued tags used to manage asynchronous requests **/
     std::vector<QueueRequest<FileRequestType, FileListResponseType>> queued_tags;
 
+    /** Signalled when a tag is queued **/
+    std::condition_variable queue_cv;
+
+    /** When the oldest queued tag arrived **/
+    std::chrono::steady_clock::time_point queued_since;
+
+    /** Queue thread only: the index version of the last callback round **/
+    uint64_t notified_version;
+
+    /** Queue thread only: tags are armed without waiting until then **/
+    std::chrono::steady_clock::time_point round_until;
+
+    /** Milliseconds of changes gathered into one callback round **/
+    int coalesce_window;
+
 
     /**
      * Prepend the mount path to the filename.
@@ -95,13 +131,205 @@ private:
         return this->mount_path + filepath;
     }
 
-    /** CRC Table kept in memory for faster calculations **/
-    CRC::Table<std::uint32_t, 32> crc_table;
+    /** Attributes and checksums of the stored files **/
+    DFSMetadataIndex index;
+
+    /** Merkle tree over the index, for clients to reconcile against **/
+    DFSMerkleTree tree;
+
+    /** Write locks on the stored files, as leases **/
+    DFSLockManager locks;
+
+    /**
+     * Whether `client_id` holds a live write lock on `filename` with fencing token `token`
+     *
+     * @param filename
+     * @param client_id
+     * @param token
+     * @return
+     */
+    bool HoldsWriteLock(const std::string& filename, const std::string& client_id, uint64_t token) {
+        return this->locks.Holds(filename, client_id, token);
+    }
+
+    /**
+     * Release the write lock on `filename` if `client_id` holds it with `token`
+     *
+     * @param filename
+     * @param client_id
+     * @param token
+     */
+    void ReleaseLock(const std::string& filename, const std::string& client_id, uint64_t token) {
+        this->locks.Release(filename, client_id, token);
+    }
+
+    /**
+     * Fill a status from an index record
+     *
+     * @param filename
+     * @param record
+     * @param status
+     */
+    static void FillStatus(const std::string& filename, const DFSFileRecord& record, FileStatus* status) {
+        status->set_filename(filename);
+        status->set_size(record.size);
+        status->set_mtime(record.mtime_ns / 1000000000);
+        status->set_ctime(record.ctime_ns / 1000000000);
+        status->set_crc(record.crc);
+    }
+
+    /**
+     * The current crc of a stored file, verified against the file's attributes
+     *
+     * @param filename
+     * @param crc
+     * @return false if the file doesn't exist
+     */
+    bool CurrentChecksum(const std::string& filename, std::uint32_t* crc) {
+        DFSFileRecord record;
+        if (!this->index.Refresh(filename, &record)) {
+            return false;
+        }
+        *crc = record.crc;
+        return true;
+    }
+
+    /**
+     * Move a fully written staged file into place and stamp it
+     * with the client's modification time
+     *
+     * @param staged
+     * @param filename
+     * @param mtime
+     * @param crc the checksum computed while the file was written
+     * @return
+     */
+    bool CommitStaged(const std::string& staged, const std::string& filename, int64_t mtime, std::uint32_t crc) {
+        std::string full_path = WrapPath(filename);
+        if (mtime > 0) {
+            DFSSetModTime(staged, mtime);
+        }
+        if (!this->index.Commit(staged, filename, crc)) {
+            dfs_log(LL_ERROR) << "Could not commit " << full_path << ": " << strerror(errno);
+            unlink(staged.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * CommitStaged, fenced by the write lock: the lock is checked and the
+     * file renamed into place under the lock's shard mutex, so a writer
+     * whose lease lapsed can't commit over the next holder's write
+     *
+     * @param staged
+     * @param filename
+     * @param mtime
+     * @param crc
+     * @param client_id
+     * @param token
+     * @param committed set to whether the commit succeeded
+     * @return false if the write lock wasn't held; the staged file is removed
+     */
+    bool CommitFenced(const std::string& staged, const std::string& filename, int64_t mtime, std::uint32_t crc,
+                      const std::string& client_id, uint64_t token, bool* committed) {
+        *committed = false;
+        if (!this->locks.WhileHolding(filename, client_id, token, [&] {
+                *committed = CommitStaged(staged, filename, mtime, crc);
+            })) {
+            unlink(staged.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * The resume token for `version` of the index, "epoch:version"
+     *
+     * @param version
+     * @return
+     */
+    std::string ResumeToken(uint64_t version) const {
+        std::ostringstream token;
+        token << std::hex << this->index.Epoch() << ":" << std::dec << version;
+        return token.str();
+    }
+
+    /**
+     * Read back a ResumeToken
+     *
+     * @param token
+     * @param version
+     * @return false if the token is malformed or from another run of the server
+     */
+    bool ParseResumeToken(const std::string& token, uint64_t* version) const {
+        std::istringstream in(token);
+        uint64_t epoch;
+        char separator;
+        if (!(in >> std::hex >> epoch >> separator >> std::dec >> *version) || separator != ':' ||
+            !in.eof() || epoch != this->index.Epoch()) {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Send a full listing as LISTING events, always at least one
+     *
+     * @param writer
+     * @param version set to the index version listed
+     * @return false if the stream broke
+     */
+    bool SendListing(ServerWriter<FileEvent>* writer, uint64_t* version) {
+        FileList listing;
+        *version = ListFiles(&listing);
+
+        FileEvent event;
+        event.set_kind(FileEvent::LISTING);
+        event.set_version(*version);
+        int files = 0;
+        for (const FileStatus& file : listing.files()) {
+            *event.mutable_listing()->add_files() = file;
+            if (++files % DFS_SUBSCRIBE_LISTING == 0) {
+                if (!writer->Write(event)) {
+                    return false;
+                }
+                event.clear_listing();
+            }
+        }
+        for (const FileStatus& file : listing.deleted()) {
+            *event.mutable_listing()->add_deleted() = file;
+        }
+        return writer->Write(event);
+    }
+
+    /**
+     * Fill a change event from an index change
+     *
+     * @param change
+     * @param event
+     */
+    static void FillEvent(const DFSIndexChange& change, FileEvent* event) {
+        if (change.removed) {
+            event->set_kind(FileEvent::DELETED);
+            event->mutable_file()->set_filename(change.name);
+            event->mutable_file()->set_mtime(change.time);
+        } else {
+            event->set_kind(change.created ? FileEvent::CREATED : FileEvent::MODIFIED);
+            FillStatus(change.name, change.record, event->mutable_file());
+        }
+        event->set_version(change.record.version);
+    }
 
 public:
 
-    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads):
-        mount_path(mount_path), crc_table(CRC::CRC_32()) {
+    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads,
+                   int coalesce_window, int lease_time):
+        mount_path(mount_path), notified_version(0), coalesce_window(coalesce_window), index(mount_path),
+        tree(index), locks(lease_time) {
+
+        this->index.Start();
+        this->notified_version = this->index.Version();
 
         this->runner.SetService(this);
         this->runner.SetAddress(server_address);
@@ -112,6 +340,7 @@ public:
 
     ~DFSServiceImpl() {
         this->runner.Shutdown();
+        this->index.Stop();
     }
 
     void Run() {
@@ -138,8 +367,14 @@ public:
                          grpc::ServerCompletionQueue* cq,
                          void* tag) {
 
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        this->queued_tags.emplace_back(context, request, response, cq, tag);
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            if (this->queued_tags.empty()) {
+                this->queued_since = std::chrono::steady_clock::now();
+            }
+            this->queued_tags.emplace_back(context, request, response, cq, tag);
+        }
+        this->queue_cv.notify_one();
 
     }
 
@@ -168,6 +403,106 @@ public:
         // is aware of. The client will then need to make the appropriate calls based on those changes.
         //
 
+        dfs_log(LL_DEBUG3) << "Processing callback list for " << request->client_id();
+
+        // Only what changed since the client's cursor, unless those
+        // changes are no longer kept
+        uint64_t version;
+        std::vector<DFSIndexChange> changes;
+        if (ParseResumeToken(request->cursor(), &version) && this->index.WaitChanges(version, &changes, 0)) {
+            FillChanges(changes, response);
+            if (!changes.empty()) {
+                version = changes.back().record.version;
+            }
+            response->set_incremental(true);
+        } else if (request->merkle()) {
+            // The client walks the tree for what differs instead
+            version = this->index.Version();
+            response->set_reconcile(true);
+        } else {
+            version = ListFiles(response);
+        }
+        response->set_cursor(ResumeToken(version));
+        response->set_root_hash(this->tree.Root());
+    }
+
+    /**
+     * Fill `response` with the latest status of each file in `changes`,
+     * or its tombstone if the last change removed it
+     *
+     * @param changes
+     * @param response
+     */
+    static void FillChanges(const std::vector<DFSIndexChange>& changes, FileListResponseType* response) {
+        std::map<std::string, const DFSIndexChange*> latest;
+        for (const DFSIndexChange& change : changes) {
+            latest[change.name] = &change;
+        }
+        for (const auto& change : latest) {
+            if (change.second->removed) {
+                FileStatus* deleted = response->add_deleted();
+                deleted->set_filename(change.first);
+                deleted->set_mtime(change.second->time);
+            } else {
+                FillStatus(change.first, change.second->record, response->add_files());
+            }
+        }
+    }
+
+    /**
+     * Fill `response` with the status of every file and the tombstone of every deleted one
+     *
+     * @param response
+     * @return the index version listed
+     */
+    uint64_t ListFiles(FileListResponseType* response) {
+        return this->index.ForEach([response](const std::string& name, const DFSFileRecord& record) {
+            FillStatus(name, record, response->add_files());
+        }, [response](const std::string& name, const DFSTombstone& tombstone) {
+            FileStatus* deleted = response->add_deleted();
+            deleted->set_filename(name);
+            deleted->set_mtime(tombstone.time);
+        });
+    }
+
+    /**
+     * Wait until the queued tags should be armed
+     *
+     * Each queued tag accepts the next CallbackList call, and that call is
+     * answered with the current listing right away. Arming is what gets
+     * held back, so a client polling an unchanged file set waits here for
+     * up to DFS_QUEUE_HOLD instead of being answered in a loop. A change
+     * opens a round: the burst is gathered for the coalescing window, then
+     * tags are armed without waiting for DFS_QUEUE_ROUND, long enough to
+     * accept the calls already waiting but too short for a client to
+     * come back many times.
+     */
+    void AwaitCallbackRound() {
+        std::chrono::steady_clock::time_point hold_until;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            this->queue_cv.wait(lock, [this] { return !this->queued_tags.empty(); });
+            hold_until = this->queued_since + std::chrono::milliseconds(DFS_QUEUE_HOLD);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now < this->round_until) {
+            return;
+        }
+
+        std::vector<DFSIndexChange> changes;
+        int hold = static_cast<int>(std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(hold_until - now).count(), 0));
+        if (this->index.Version() == this->notified_version &&
+            this->index.WaitChanges(this->notified_version, &changes, hold) && changes.empty()) {
+            // Held long enough; answer anyway so new clients get a listing
+            return;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(this->coalesce_window));
+        this->notified_version = this->index.Version();
+        this->round_until = std::chrono::steady_clock::now() + std::chrono::milliseconds(DFS_QUEUE_ROUND);
+        dfs_log(LL_DEBUG2) << "Callback round at index version " << this->notified_version;
     }
 
     /**
@@ -176,6 +511,9 @@ public:
     void ProcessQueuedRequests() {
         while(true) {
 
+            // Sleep until there are tags to arm and a reason to arm them
+            AwaitCallbackRound();
+
             //
             // STUDENT INSTRUCTION:
             //
@@ -217,6 +555,561 @@ public:
     // the implementations of your rpc protocol methods.
     //
 
+    /**
+     * RequestWriteLock: Grant the write lock on a file unless another client holds a live lease on it
+     */
+    Status RequestWriteLock(ServerContext* context,
+                            const WriteLockRequest* request,
+                            WriteLockResponse* response) override {
+
+        std::string holder;
+        uint64_t token;
+        bool granted = this->locks.Acquire(request->name(), request->client_id(), &holder, &token);
+        response->set_holder(holder);
+        if (!granted) {
+            dfs_log(LL_DEBUG) << "Write lock on " << request->name() << " is held by " << holder;
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Write lock is held by another client");
+        }
+        response->set_token(token);
+        response->set_lease_ms(this->locks.LeaseTime());
+        dfs_log(LL_DEBUG2) << "Write lock on " << request->name() << " granted to " << request->client_id()
+                           << " with token " << token;
+        return Status::OK;
+    }
+
+    /**
+     * RenewWriteLock: Extend the lease of a write lock the caller still holds
+     */
+    Status RenewWriteLock(ServerContext* context,
+                          const WriteLockRequest* request,
+                          WriteLockResponse* response) override {
+
+        if (!this->locks.Renew(request->name(), request->client_id(), request->token())) {
+            dfs_log(LL_DEBUG) << "Write lock on " << request->name() << " lapsed for " << request->client_id();
+            return Status(StatusCode::NOT_FOUND, "Write lock not held");
+        }
+        response->set_holder(request->client_id());
+        response->set_token(request->token());
+        response->set_lease_ms(this->locks.LeaseTime());
+        return Status::OK;
+    }
+
+    /**
+     * ReleaseWriteLock: Give up a write lock without storing
+     */
+    Status ReleaseWriteLock(ServerContext* context,
+                            const WriteLockRequest* request,
+                            Empty* response) override {
+
+        ReleaseLock(request->name(), request->client_id(), request->token());
+        return Status::OK;
+    }
+
+    /**
+     * Store: Receive file chunks from a client holding the write lock
+     *
+     * The first chunk carries the client's crc and mtime. If the server's
+     * copy already matches, the transfer is refused with ALREADY_EXISTS.
+     * The data is checksummed as it arrives and must match that crc.
+     */
+    Status Store(ServerContext* context,
+                 ServerReader<FileChunk>* reader,
+                 FileStatus* response) override {
+
+        FileChunk chunk;
+        if (!reader->Read(&chunk)) {
+            return Status(StatusCode::CANCELLED, "No file sent");
+        }
+
+        std::string filename = chunk.filename();
+        std::string client_id = chunk.client_id();
+        std::string full_path = WrapPath(filename);
+        int64_t mtime = chunk.mtime();
+        std::uint32_t client_crc = chunk.crc();
+        uint64_t lock_token = chunk.lock_token();
+
+        if (!HoldsWriteLock(filename, client_id, lock_token)) {
+            dfs_log(LL_ERROR) << "Store of " << filename << " without the write lock by " << client_id;
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Write lock not held");
+        }
+
+        std::uint32_t crc;
+        if (CurrentChecksum(filename, &crc) && crc == chunk.crc()) {
+            dfs_log(LL_DEBUG) << "File unchanged: " << filename;
+            return Status(StatusCode::ALREADY_EXISTS, "File unchanged");
+        }
+
+        std::string staged;
+        int fd = DFSStageFile(full_path, &staged);
+        if (fd < 0) {
+            return Status(StatusCode::INTERNAL, "Could not open file for writing");
+        }
+        std::ofstream outfile(staged, std::ios::binary);
+        close(fd);
+        dfs_log(LL_DEBUG) << "Storing file: " << full_path;
+
+        DFSFileChecksum checksum;
+        do {
+            if (context->IsCancelled()) {
+                outfile.close();
+                unlink(staged.c_str());
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            if (!chunk.data().empty()) {
+                outfile.write(chunk.data().data(), chunk.data().size());
+                checksum.Update(chunk.data().data(), chunk.data().size());
+            }
+        } while (reader->Read(&chunk));
+
+        outfile.close();
+        if (checksum.Final() != client_crc) {
+            dfs_log(LL_ERROR) << "Received " << filename << " does not match the client's crc";
+            unlink(staged.c_str());
+            return Status(StatusCode::DATA_LOSS, "File does not match its crc");
+        }
+        if (!outfile) {
+            unlink(staged.c_str());
+            return Status(StatusCode::INTERNAL, "Could not write file");
+        }
+        // Fencing: the lease may have lapsed, and gone to another writer, during the transfer
+        bool committed;
+        if (!CommitFenced(staged, filename, mtime, client_crc, client_id, lock_token, &committed)) {
+            dfs_log(LL_ERROR) << "Write lock on " << filename << " lapsed during its store by " << client_id;
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Write lock lapsed");
+        }
+        if (!committed) {
+            return Status(StatusCode::INTERNAL, "Could not write file");
+        }
+
+        ReleaseLock(filename, client_id, lock_token);
+        DFSFileRecord record;
+        if (this->index.Get(filename, &record)) {
+            FillStatus(filename, record, response);
+        }
+        dfs_log(LL_DEBUG) << "File stored successfully: " << filename;
+        return Status::OK;
+    }
+
+    /**
+     * Signatures: Sign the server's copy of a file for a delta store
+     *
+     * Returns ALREADY_EXISTS when the caller's crc matches the server's copy.
+     */
+    Status Signatures(ServerContext* context,
+                      const FileRequest* request,
+                      FileSignature* response) override {
+
+        std::string full_path = WrapPath(request->name());
+        DFSMappedFile file;
+        if (!file.Open(full_path)) {
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+
+        std::uint32_t crc;
+        if (!CurrentChecksum(request->name(), &crc)) {
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        if (request->cached() && request->crc() == crc) {
+            return Status(StatusCode::ALREADY_EXISTS, "File unchanged");
+        }
+
+        response->set_name(request->name());
+        response->set_crc(crc);
+        DFSSignFile(file, response);
+        dfs_log(LL_DEBUG) << "Signed " << full_path << ": " << response->blocks_size()
+                          << " blocks of " << response->block_size() << " bytes";
+        return Status::OK;
+    }
+
+    /**
+     * StoreDelta: Rebuild a file from the server's copy and a client's delta
+     *
+     * The first message names the copy the delta was computed against by its
+     * crc, and the result must match the client's crc before it is committed.
+     */
+    Status StoreDelta(ServerContext* context,
+                      ServerReader<FileDelta>* reader,
+                      FileStatus* response) override {
+
+        FileDelta delta;
+        if (!reader->Read(&delta)) {
+            return Status(StatusCode::CANCELLED, "No delta sent");
+        }
+
+        std::string filename = delta.filename();
+        std::string client_id = delta.client_id();
+        std::string full_path = WrapPath(filename);
+        std::uint32_t crc = delta.crc();
+        int64_t mtime = delta.mtime();
+        uint32_t block_size = delta.block_size();
+        uint64_t lock_token = delta.lock_token();
+
+        if (!HoldsWriteLock(filename, client_id, lock_token)) {
+            dfs_log(LL_ERROR) << "Delta store of " << filename << " without the write lock by " << client_id;
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Write lock not held");
+        }
+
+        DFSMappedFile base;
+        if (!base.Open(full_path)) {
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        std::uint32_t base_crc;
+        if (!CurrentChecksum(filename, &base_crc) || base_crc != delta.base_crc()) {
+            return Status(StatusCode::FAILED_PRECONDITION, "File changed since it was signed");
+        }
+
+        std::string staged;
+        int fd = DFSStageFile(full_path, &staged);
+        if (fd < 0) {
+            return Status(StatusCode::INTERNAL, "Could not open file for writing");
+        }
+
+        uint64_t literal_bytes = 0;
+        DFSFileChecksum checksum;
+        do {
+            if (context->IsCancelled()) {
+                close(fd);
+                unlink(staged.c_str());
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            for (const DeltaOp& op : delta.ops()) {
+                literal_bytes += op.literal().size();
+                if (!DFSApplyDeltaOp(base, block_size, op, fd, &checksum)) {
+                    close(fd);
+                    unlink(staged.c_str());
+                    return Status(StatusCode::INVALID_ARGUMENT, "Bad delta");
+                }
+            }
+        } while (reader->Read(&delta));
+
+        if (close(fd) != 0 || checksum.Final() != crc) {
+            dfs_log(LL_ERROR) << "Rebuilt " << filename << " does not match the client's copy";
+            unlink(staged.c_str());
+            return Status(StatusCode::DATA_LOSS, "Rebuilt file does not match");
+        }
+        bool committed;
+        if (!CommitFenced(staged, filename, mtime, crc, client_id, lock_token, &committed)) {
+            dfs_log(LL_ERROR) << "Write lock on " << filename << " lapsed during its delta store by " << client_id;
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Write lock lapsed");
+        }
+        if (!committed) {
+            return Status(StatusCode::INTERNAL, "Could not write file");
+        }
+
+        ReleaseLock(filename, client_id, lock_token);
+        DFSFileRecord record;
+        if (this->index.Get(filename, &record)) {
+            FillStatus(filename, record, response);
+        }
+        dfs_log(LL_DEBUG) << "File stored from delta: " << filename << " (" << literal_bytes << " literal bytes)";
+        return Status::OK;
+    }
+
+    /**
+     * FetchDelta: Stream the differences between the server's copy and a client's cached copy
+     *
+     * Returns ALREADY_EXISTS when the cached copy matches. The first message
+     * carries the crc and mtime of the server's copy.
+     */
+    Status FetchDelta(ServerContext* context,
+                      const FileSignature* request,
+                      ServerWriter<FileDelta>* writer) override {
+
+        std::string filename = request->name();
+        std::string full_path = WrapPath(filename);
+
+        if (!DFSValidSignature(*request)) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Bad signature");
+        }
+
+        DFSMappedFile file;
+        if (!file.Open(full_path)) {
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+
+        DFSFileRecord record;
+        if (!this->index.Refresh(filename, &record)) {
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        if (request->crc() == record.crc) {
+            return Status(StatusCode::ALREADY_EXISTS, "File unchanged");
+        }
+
+        FileDelta delta;
+        delta.set_filename(filename);
+        delta.set_crc(record.crc);
+        delta.set_mtime(record.mtime_ns / 1000000000);
+        delta.set_base_crc(request->crc());
+        delta.set_block_size(request->block_size());
+
+        uint64_t literal_bytes = 0;
+        bool sent = DFSStreamDelta(file.Data(), file.Size(), *request, &delta, [&](const FileDelta& message) {
+            if (context->IsCancelled()) {
+                return false;
+            }
+            for (const DeltaOp& op : message.ops()) {
+                literal_bytes += op.literal().size();
+            }
+            return writer->Write(message);
+        });
+        if (!sent) {
+            if (context->IsCancelled()) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            return Status(StatusCode::INTERNAL, "Failed to write delta");
+        }
+
+        dfs_log(LL_DEBUG) << "Delta fetched " << filename << ": " << literal_bytes << " literal bytes";
+        return Status::OK;
+    }
+
+    /**
+     * Fetch: Stream a file to the client unless its copy already matches
+     *
+     * The first chunk carries the file's crc and mtime.
+     */
+    Status Fetch(ServerContext* context,
+                 const FileRequest* request,
+                 ServerWriter<FileChunk>* writer) override {
+
+        std::string filename = request->name();
+        std::string full_path = WrapPath(filename);
+
+        dfs_log(LL_DEBUG) << "Fetching file: " << full_path;
+
+        std::ifstream infile(full_path, std::ios::binary);
+        if (!infile.is_open()) {
+            dfs_log(LL_ERROR) << "Could not open file: " << full_path;
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+
+        DFSFileRecord record;
+        if (!this->index.Refresh(filename, &record)) {
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        if (request->cached() && request->crc() == record.crc) {
+            return Status(StatusCode::ALREADY_EXISTS, "File unchanged");
+        }
+
+        char buffer[DFS_CHUNK_SIZE];
+        FileChunk chunk;
+        chunk.set_filename(filename);
+        chunk.set_crc(record.crc);
+        chunk.set_mtime(record.mtime_ns / 1000000000);
+
+        // Always send one chunk, so that empty files carry their mtime too
+        bool first = true;
+        while (infile.read(buffer, DFS_CHUNK_SIZE) || infile.gcount() > 0 || first) {
+            if (context->IsCancelled()) {
+                return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+            }
+            chunk.set_data(buffer, infile.gcount());
+            if (!writer->Write(chunk)) {
+                dfs_log(LL_ERROR) << "Failed to write chunk";
+                return Status(StatusCode::INTERNAL, "Failed to write chunk");
+            }
+            if (first) {
+                chunk.Clear();
+                first = false;
+            }
+        }
+
+        dfs_log(LL_DEBUG) << "File fetched successfully: " << filename;
+        return Status::OK;
+    }
+
+    /**
+     * Delete: Remove a file for a client holding its write lock
+     */
+    Status Delete(ServerContext* context,
+                  const FileRequest* request,
+                  FileStatus* response) override {
+
+        std::string filename = request->name();
+        std::string full_path = WrapPath(filename);
+
+        dfs_log(LL_DEBUG) << "Deleting file: " << full_path;
+
+        if (context->IsCancelled()) {
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+        }
+
+        // The lock is checked and the file removed under the lock's shard
+        // mutex, and the index leaves a tombstone in the same change that
+        // drops the file
+        bool removed = false;
+        if (!this->locks.WhileHolding(filename, request->client_id(), request->lock_token(), [&] {
+                removed = std::remove(full_path.c_str()) == 0;
+                if (removed) {
+                    this->index.Remove(filename);
+                }
+            })) {
+            dfs_log(LL_ERROR) << "Delete of " << filename << " without the write lock by " << request->client_id();
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Write lock not held");
+        }
+        if (!removed) {
+            dfs_log(LL_ERROR) << "Could not delete file: " << full_path;
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        ReleaseLock(filename, request->client_id(), request->lock_token());
+
+        response->set_filename(filename);
+        dfs_log(LL_DEBUG) << "File deleted successfully: " << filename;
+        return Status::OK;
+    }
+
+    /**
+     * List: Return the status of every file in the mount path
+     */
+    Status List(ServerContext* context,
+                const Empty* request,
+                FileList* response) override {
+
+        dfs_log(LL_DEBUG) << "Listing files in: " << mount_path;
+
+        if (context->IsCancelled()) {
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+        }
+
+        ListFiles(response);
+        return Status::OK;
+    }
+
+    /**
+     * Subscribe: Push changes to the file set as they happen
+     *
+     * A good resume token picks up after the last change the client saw.
+     * Otherwise the stream starts with a full listing. Either way a SYNCED
+     * event follows, and then one event per change to the index.
+     */
+    Status Subscribe(ServerContext* context,
+                     const SubscribeRequest* request,
+                     ServerWriter<FileEvent>* writer) override {
+
+        uint64_t version = 0;
+        std::vector<DFSIndexChange> changes;
+        bool list = !ParseResumeToken(request->resume_token(), &version) ||
+                    !this->index.WaitChanges(version, &changes, 0);
+        dfs_log(LL_DEBUG) << "Subscription from " << request->client_id() << ", "
+                          << (list ? "listing" : "resuming after version " + std::to_string(version));
+
+        bool synced = false;
+        while (!context->IsCancelled()) {
+            if (list && request->merkle()) {
+                // The client walks the tree for what differs instead of
+                // taking a listing; the event stands in for SYNCED
+                changes.clear();
+                version = this->index.Version();
+                FileEvent event;
+                event.set_kind(FileEvent::RECONCILE);
+                event.set_version(version);
+                event.set_resume_token(ResumeToken(version));
+                event.set_root_hash(this->tree.Root());
+                if (!writer->Write(event)) {
+                    break;
+                }
+                list = false;
+                synced = true;
+            }
+            if (list) {
+                changes.clear();
+                if (!SendListing(writer, &version)) {
+                    break;
+                }
+                list = false;
+                synced = false;
+            }
+            if (!synced) {
+                FileEvent event;
+                event.set_kind(FileEvent::SYNCED);
+                event.set_version(version);
+                event.set_resume_token(ResumeToken(version));
+                if (!writer->Write(event)) {
+                    break;
+                }
+                synced = true;
+            }
+
+            for (const DFSIndexChange& change : changes) {
+                FileEvent event;
+                FillEvent(change, &event);
+                event.set_resume_token(ResumeToken(change.record.version));
+                if (!writer->Write(event)) {
+                    return Status(StatusCode::CANCELLED, "Subscriber went away");
+                }
+                version = change.record.version;
+            }
+            changes.clear();
+
+            // Too far behind to catch up from the kept changes, so list again
+            list = !this->index.WaitChanges(version, &changes, DFS_SUBSCRIBE_WAIT);
+        }
+        return Status(StatusCode::CANCELLED, "Subscription ended");
+    }
+
+    /**
+     * MerkleNodes: Describe nodes of the Merkle tree over the stored files
+     *
+     * Internal nodes come back with their children's hashes, leaves with
+     * their files and the tombstones that fall in them.
+     */
+    Status MerkleNodes(ServerContext* context,
+                       const MerkleRequest* request,
+                       MerkleReply* response) override {
+
+        if (request->nodes_size() > DFS_MERKLE_BATCH) {
+            return Status(StatusCode::INVALID_ARGUMENT, "Too many nodes");
+        }
+
+        for (const std::string& name : request->nodes()) {
+            MerkleNode* node = response->add_nodes();
+            node->set_node(name);
+
+            std::vector<std::string> children;
+            std::map<std::string, DFSFileRecord> files;
+            std::map<std::string, DFSTombstone> removed;
+            if (this->tree.Children(name, &children)) {
+                for (const std::string& hash : children) {
+                    node->add_children(hash);
+                }
+            } else if (this->tree.Files(name, &files, &removed)) {
+                for (const auto& file : files) {
+                    FillStatus(file.first, file.second, node->add_files());
+                }
+                for (const auto& tombstone : removed) {
+                    FileStatus* deleted = node->add_deleted();
+                    deleted->set_filename(tombstone.first);
+                    deleted->set_mtime(tombstone.second.time);
+                }
+            } else {
+                return Status(StatusCode::INVALID_ARGUMENT, "Not a tree node: " + name);
+            }
+        }
+        return Status::OK;
+    }
+
+    /**
+     * Stat: Return file attributes/status
+     */
+    Status Stat(ServerContext* context,
+                const FileRequest* request,
+                FileStatus* response) override {
+
+        dfs_log(LL_DEBUG) << "Getting status for: " << request->name();
+
+        if (context->IsCancelled()) {
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded");
+        }
+
+        DFSFileRecord record;
+        if (!this->index.Get(request->name(), &record)) {
+            dfs_log(LL_ERROR) << "File not found: " << request->name();
+            return Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        FillStatus(request->name(), record, response);
+        return Status::OK;
+    }
+
 
 };
 
@@ -241,7 +1134,9 @@ DFSServerNode::DFSServerNode(const std::string &server_address,
         server_address(server_address),
         mount_path(mount_path),
         num_async_threads(num_async_threads),
-        grader_callback(callback) {}
+        grader_callback(callback),
+        coalesce_window(DFS_QUEUE_COALESCE),
+        lease_time(DFS_LOCK_LEASE) {}
 /**
  * Server shutdown
  */
@@ -249,11 +1144,20 @@ DFSServerNode::~DFSServerNode() noexcept {
     dfs_log(LL_SYSINFO) << "DFSServerNode shutting down";
 }
 
+void DFSServerNode::SetCoalesceWindow(int milliseconds) {
+    this->coalesce_window = std::max(milliseconds, 0);
+}
+
+void DFSServerNode::SetLeaseTime(int milliseconds) {
+    this->lease_time = std::max(milliseconds, 1);
+}
+
 /**
  * Start the DFSServerNode server
  */
 void DFSServerNode::Start() {
-    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads);
+    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads, this->coalesce_window,
+                           this->lease_time);
 
 
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
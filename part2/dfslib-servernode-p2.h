@@ -28,6 +28,12 @@ private:
     /** Server callback **/
     std::function<void()> grader_callback;
 
+    /** Milliseconds of changes gathered into one callback round **/
+    int coalesce_window;
+
+    /** Milliseconds a write lock lives without renewal **/
+    int lease_time;
+
 public:
     DFSServerNode(const std::string& server_address,
         const std::string& mount_path,
@@ -36,6 +42,20 @@ public:
     ~DFSServerNode();
     void Shutdown();
     void Start();
+
+    /**
+     * Set how long a burst of changes is gathered before callbacks are answered
+     *
+     * @param milliseconds
+     */
+    void SetCoalesceWindow(int milliseconds);
+
+    /**
+     * Set how long a write lock lives unless its holder renews it
+     *
+     * @param milliseconds
+     */
+    void SetLeaseTime(int milliseconds);
 };
 
 #endif
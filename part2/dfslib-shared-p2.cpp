@@ -2,7 +2,16 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <openssl/sha.h>
 
 #include "dfslib-shared-p2.h"
 #include "proto-src/dfs-service.grpc.pb.h"
@@ -23,3 +32,284 @@ dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 // Just be aware they are always submitted, so they should
 // be compilable.
 //
+
+int DFSStageFile(const std::string& path, std::string* staged) {
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    std::vector<char> name(dir.begin(), dir.end());
+    const std::string suffix = DFS_TEMP_PREFIX "XXXXXX";
+    name.insert(name.end(), suffix.begin(), suffix.end());
+    name.push_back('\0');
+    int fd = mkstemp(name.data());
+    if (fd < 0) {
+        dfs_log(LL_ERROR) << "Could not stage " << path << ": " << strerror(errno);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    *staged = name.data();
+    return fd;
+}
+
+bool DFSSetModTime(const std::string& path, int64_t mtime) {
+    struct utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    return utime(path.c_str(), &times) == 0;
+}
+
+DFSMappedFile::DFSMappedFile() : data(nullptr), size(0) {}
+
+DFSMappedFile::~DFSMappedFile() {
+    if (data != nullptr) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+bool DFSMappedFile::Open(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0) {
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            size = 0;
+            close(fd);
+            return false;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapped);
+    }
+    close(fd);
+    return true;
+}
+
+uint32_t DFSDeltaBlockSize(uint64_t file_size) {
+    uint64_t block = static_cast<uint64_t>(std::sqrt(static_cast<double>(file_size)));
+    block = (block + 1023) & ~static_cast<uint64_t>(1023);
+    return static_cast<uint32_t>(std::min<uint64_t>(std::max<uint64_t>(block, DFS_DELTA_MIN_BLOCK),
+                                                    DFS_DELTA_MAX_BLOCK));
+}
+
+uint32_t DFSWeakChecksum(const char* data, size_t length) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += bytes[i];
+        b += static_cast<uint32_t>(length - i) * bytes[i];
+    }
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+std::string DFSStrongChecksum(const char* data, size_t length) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(data), length, digest);
+    return std::string(reinterpret_cast<char*>(digest), DFS_DELTA_STRONG_SIZE);
+}
+
+void DFSSignFile(const DFSMappedFile& file, dfs_service::FileSignature* signature) {
+    uint32_t block_size = DFSDeltaBlockSize(file.Size());
+    signature->set_size(static_cast<int64_t>(file.Size()));
+    signature->set_block_size(block_size);
+    signature->mutable_blocks()->Reserve(static_cast<int>(file.Size() / block_size + 1));
+    for (size_t offset = 0; offset < file.Size(); offset += block_size) {
+        size_t length = std::min<size_t>(block_size, file.Size() - offset);
+        dfs_service::BlockSignature* block = signature->add_blocks();
+        block->set_weak(DFSWeakChecksum(file.Data() + offset, length));
+        block->set_strong(DFSStrongChecksum(file.Data() + offset, length));
+    }
+}
+
+bool DFSComputeDelta(const char* data, size_t size, const dfs_service::FileSignature& signature,
+                     const std::function<bool(const dfs_service::DeltaOp&)>& emit) {
+    const size_t block_size = signature.block_size();
+    const int block_count = signature.blocks_size();
+
+    // Full blocks by weak checksum. The last block is usually short and can
+    // only match at the very end of `data`, so it is checked separately.
+    size_t tail_length = block_count > 0 ?
+        static_cast<size_t>(signature.size()) - static_cast<size_t>(block_count - 1) * block_size : 0;
+    int full_blocks = (tail_length == block_size) ? block_count : block_count - 1;
+    std::unordered_map<uint32_t, std::vector<int>> index;
+    index.reserve(static_cast<size_t>(std::max(full_blocks, 0)));
+    for (int i = 0; i < full_blocks; i++) {
+        index[signature.blocks(i).weak()].push_back(i);
+    }
+
+    dfs_service::DeltaOp op;
+    bool pending_ref = false;
+    size_t literal_start = 0;
+
+    auto flush_ref = [&]() {
+        if (pending_ref) {
+            pending_ref = false;
+            return emit(op);
+        }
+        return true;
+    };
+    auto flush_literal = [&](size_t end) {
+        while (literal_start < end) {
+            size_t length = std::min<size_t>(end - literal_start, DFS_DELTA_MESSAGE_SIZE);
+            dfs_service::DeltaOp literal;
+            literal.set_literal(data + literal_start, length);
+            literal_start += length;
+            if (!emit(literal)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto add_ref = [&](size_t start, int block) {
+        if (!flush_literal(start)) {
+            return false;
+        }
+        if (pending_ref && op.block() + op.count() == static_cast<uint64_t>(block)) {
+            op.set_count(op.count() + 1);
+            return true;
+        }
+        if (!flush_ref()) {
+            return false;
+        }
+        op.Clear();
+        op.set_block(static_cast<uint64_t>(block));
+        op.set_count(1);
+        pending_ref = true;
+        return true;
+    };
+
+    size_t pos = 0;
+    bool have_sum = false;
+    uint32_t sum = 0;
+    while (full_blocks > 0 && pos + block_size <= size) {
+        if (!have_sum) {
+            sum = DFSWeakChecksum(data + pos, block_size);
+            have_sum = true;
+        }
+        int matched = -1;
+        auto candidates = index.find(sum);
+        if (candidates != index.end()) {
+            std::string strong = DFSStrongChecksum(data + pos, block_size);
+            // Prefer the block following the last reference, so runs stay merged
+            for (int block : candidates->second) {
+                if (signature.blocks(block).strong() == strong) {
+                    matched = block;
+                    if (pending_ref && op.block() + op.count() == static_cast<uint64_t>(block)) {
+                        break;
+                    }
+                }
+            }
+        }
+        if (matched >= 0) {
+            if (pos > literal_start && !flush_ref()) {
+                return false;
+            }
+            if (!add_ref(pos, matched)) {
+                return false;
+            }
+            pos += block_size;
+            literal_start = pos;
+            have_sum = false;
+            continue;
+        }
+        if (pos + block_size < size) {
+            sum = DFSRollChecksum(sum, block_size,
+                                  static_cast<unsigned char>(data[pos]),
+                                  static_cast<unsigned char>(data[pos + block_size]));
+        }
+        pos++;
+    }
+
+    // A short last block can still match the end of the file
+    if (block_count > 0 && tail_length < block_size && tail_length > 0 && size >= tail_length &&
+        size - tail_length >= literal_start) {
+        size_t start = size - tail_length;
+        const dfs_service::BlockSignature& tail = signature.blocks(block_count - 1);
+        if (DFSWeakChecksum(data + start, tail_length) == tail.weak() &&
+            DFSStrongChecksum(data + start, tail_length) == tail.strong()) {
+            if (start > literal_start && !flush_ref()) {
+                return false;
+            }
+            if (!add_ref(start, block_count - 1)) {
+                return false;
+            }
+            literal_start = size;
+        }
+    }
+
+    if (size > literal_start && !flush_ref()) {
+        return false;
+    }
+    return flush_literal(size) && flush_ref();
+}
+
+bool DFSValidSignature(const dfs_service::FileSignature& signature) {
+    if (signature.block_size() == 0 || signature.size() < 0) {
+        return false;
+    }
+    uint64_t size = static_cast<uint64_t>(signature.size());
+    return static_cast<uint64_t>(signature.blocks_size()) ==
+        (size + signature.block_size() - 1) / signature.block_size();
+}
+
+bool DFSStreamDelta(const char* data, size_t size, const dfs_service::FileSignature& signature,
+                    dfs_service::FileDelta* header,
+                    const std::function<bool(const dfs_service::FileDelta&)>& write) {
+    dfs_service::FileDelta* delta = header;
+    size_t pending = 0;
+    bool sent = DFSComputeDelta(data, size, signature, [&](const dfs_service::DeltaOp& op) {
+        // Literals dominate a message's size; 16 bytes covers a reference
+        pending += op.literal().size() + 16;
+        *delta->add_ops() = op;
+        if (pending < DFS_DELTA_MESSAGE_SIZE) {
+            return true;
+        }
+        pending = 0;
+        bool written = write(*delta);
+        delta->Clear();
+        return written;
+    });
+    // The last message is sent even without ops, so that a stream
+    // always carries its header
+    return sent && write(*delta);
+}
+
+bool DFSApplyDeltaOp(const DFSMappedFile& base, uint32_t block_size, const dfs_service::DeltaOp& op, int fd,
+                     DFSFileChecksum* checksum) {
+    const char* data = op.literal().data();
+    size_t length = op.literal().size();
+    if (length == 0) {
+        uint64_t start = op.block() * block_size;
+        if (block_size == 0 || op.count() == 0 || op.block() > base.Size() / block_size || start >= base.Size()) {
+            return false;
+        }
+        uint64_t end = start + static_cast<uint64_t>(op.count()) * block_size;
+        // Only the base's last block may be short
+        if (end > base.Size() && end - base.Size() >= block_size) {
+            return false;
+        }
+        data = base.Data() + start;
+        length = static_cast<size_t>(std::min<uint64_t>(end, base.Size()) - start);
+    }
+    if (checksum != nullptr) {
+        checksum->Update(data, length);
+    }
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
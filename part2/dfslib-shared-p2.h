@@ -10,6 +10,8 @@
 #include <fstream>
 #include <string>
 #include <thread>
+#include <vector>
+#include <functional>
 #include <sys/stat.h>
 
 #include "src/dfs-utils.h"
@@ -25,6 +27,7 @@
 #define DFS_RESET_TIMEOUT 2000
 #define DFS_I_EVENT_SIZE (sizeof(struct inotify_event))
 #define DFS_I_BUFFER_SIZE (1024 * (DFS_I_EVENT_SIZE + 16))
+#define DFS_CHUNK_SIZE 4096  // 4KB chunks for file streaming
 
 /** A file descriptor type **/
 typedef int FileDescriptor;
@@ -56,6 +59,214 @@ struct EventStruct {
 // Add any additional shared code here
 //
 
+#define DFS_TEMP_PREFIX ".dfs-"                         // staged transfers; hidden from List and the watcher
+#define DFS_DELTA_MIN_FILE (64 * 1024)                  // smaller files are always sent whole
+#define DFS_DELTA_MIN_BLOCK 2048                        // bounds for the signature block size
+#define DFS_DELTA_MAX_BLOCK (128 * 1024)
+#define DFS_DELTA_STRONG_SIZE 16                        // bytes of SHA-256 kept per block
+#define DFS_DELTA_MESSAGE_SIZE (1024 * 1024)            // literal bytes per FileDelta message
+#define DFS_SUBSCRIBE_WAIT 1000                         // ms a subscription waits before checking for cancellation
+#define DFS_SUBSCRIBE_LISTING 1000                      // files per LISTING event
+#define DFS_QUEUE_COALESCE 50                           // default ms of changes gathered into one callback round
+#define DFS_QUEUE_HOLD 1000                             // ms a callback is held back when nothing changed
+#define DFS_QUEUE_ROUND 5                               // ms callbacks are armed freely after a round starts
+#define DFS_LOCK_LEASE 10000                            // default ms a write lock lives without renewal
+
+/**
+ * Get the file size for a given file path
+ * Returns -1 if file doesn't exist
+ */
+inline int64_t GetFileSize(const std::string& filepath) {
+    struct stat file_stat;
+    if (stat(filepath.c_str(), &file_stat) == 0) {
+        return file_stat.st_size;
+    }
+    return -1;
+}
+
+/**
+ * Get the modification time for a given file path
+ * Returns -1 if file doesn't exist
+ */
+inline int64_t GetFileModTime(const std::string& filepath) {
+    struct stat file_stat;
+    if (stat(filepath.c_str(), &file_stat) == 0) {
+        return (int64_t)file_stat.st_mtime;
+    }
+    return -1;
+}
+
+/**
+ * Get the creation/change time for a given file path
+ * Returns -1 if file doesn't exist
+ */
+inline int64_t GetFileCreateTime(const std::string& filepath) {
+    struct stat file_stat;
+    if (stat(filepath.c_str(), &file_stat) == 0) {
+        return (int64_t)file_stat.st_ctime;
+    }
+    return -1;
+}
+
+/**
+ * Create a hidden temp file next to `path` for staging a transfer,
+ * so that it can be renamed over `path` once complete
+ *
+ * @param path the file being replaced
+ * @param staged set to the temp file's path
+ * @return the open descriptor, or -1
+ */
+int DFSStageFile(const std::string& path, std::string* staged);
+
+/**
+ * Set a file's access and modification times
+ *
+ * @param path
+ * @param mtime
+ * @return
+ */
+bool DFSSetModTime(const std::string& path, int64_t mtime);
+
+/**
+ * A read-only mapping of a whole file
+ */
+class DFSMappedFile {
+
+private:
+    const char* data;
+    size_t size;
+
+public:
+    DFSMappedFile();
+    ~DFSMappedFile();
+    DFSMappedFile(const DFSMappedFile&) = delete;
+    DFSMappedFile& operator=(const DFSMappedFile&) = delete;
+
+    /**
+     * Map `path`; an empty file maps to a null pointer of size 0
+     *
+     * @param path
+     * @return false if the file can't be opened or mapped
+     */
+    bool Open(const std::string& path);
+
+    const char* Data() const { return data; }
+    size_t Size() const { return size; }
+};
+
+//
+// rsync-style delta transfer.
+//
+// The receiver of a delta signs its copy of a file: for each fixed-size
+// block, a weak rolling checksum and a truncated strong hash. The sender
+// slides a window over its own copy one byte at a time. The rolling
+// checksum is updated in O(1) per byte and only windows whose weak sum
+// matches a block are confirmed with the strong hash. Matched windows are
+// sent as block references and everything else as literals, so an edit
+// costs roughly the changed bytes plus one block on either side.
+//
+
+/**
+ * Signature block size for a file, about the square root of its size
+ *
+ * @param file_size
+ * @return a multiple of 1KB between DFS_DELTA_MIN_BLOCK and DFS_DELTA_MAX_BLOCK
+ */
+uint32_t DFSDeltaBlockSize(uint64_t file_size);
+
+/**
+ * The rsync weak checksum of a window
+ *
+ * @param data
+ * @param length
+ * @return
+ */
+uint32_t DFSWeakChecksum(const char* data, size_t length);
+
+/**
+ * Slide a window of `length` bytes one byte forward
+ *
+ * @param sum checksum of the current window
+ * @param length
+ * @param out the byte leaving the window
+ * @param in the byte entering the window
+ * @return checksum of the next window
+ */
+inline uint32_t DFSRollChecksum(uint32_t sum, size_t length, unsigned char out, unsigned char in) {
+    uint32_t a = sum & 0xffff;
+    uint32_t b = sum >> 16;
+    a = (a - out + in) & 0xffff;
+    b = (b - static_cast<uint32_t>(length) * out + a) & 0xffff;
+    return a | (b << 16);
+}
+
+/**
+ * The strong hash confirming a weak checksum match
+ *
+ * @param data
+ * @param length
+ * @return the first DFS_DELTA_STRONG_SIZE bytes of the SHA-256 digest
+ */
+std::string DFSStrongChecksum(const char* data, size_t length);
+
+/**
+ * Sign a file for a delta transfer
+ *
+ * @param file
+ * @param signature filled with the block size and one entry per block
+ */
+void DFSSignFile(const DFSMappedFile& file, dfs_service::FileSignature* signature);
+
+/**
+ * Compute the delta that turns the signed copy into `data`
+ *
+ * Consecutive matched blocks are merged into one reference.
+ *
+ * @param data
+ * @param size
+ * @param signature
+ * @param emit called with each op in file order; returning false stops the scan
+ * @return false if `emit` stopped the scan
+ */
+bool DFSComputeDelta(const char* data, size_t size, const dfs_service::FileSignature& signature,
+                     const std::function<bool(const dfs_service::DeltaOp&)>& emit);
+
+/**
+ * Whether a signature is consistent with its size and block size
+ *
+ * @param signature
+ * @return
+ */
+bool DFSValidSignature(const dfs_service::FileSignature& signature);
+
+/**
+ * Compute a delta and write it as a stream of FileDelta messages
+ *
+ * @param data
+ * @param size
+ * @param signature
+ * @param header fields for the first message; its ops are appended
+ * @param write called with each message, at most about DFS_DELTA_MESSAGE_SIZE
+ *              bytes; returning false stops the stream
+ * @return false if `write` failed
+ */
+bool DFSStreamDelta(const char* data, size_t size, const dfs_service::FileSignature& signature,
+                    dfs_service::FileDelta* header,
+                    const std::function<bool(const dfs_service::FileDelta&)>& write);
+
+/**
+ * Write one delta op to `fd`, copying referenced blocks from `base`
+ *
+ * @param base
+ * @param block_size
+ * @param op
+ * @param fd
+ * @param checksum if given, updated with the bytes written
+ * @return false if the op references blocks past the end of `base` or the write failed
+ */
+bool DFSApplyDeltaOp(const DFSMappedFile& base, uint32_t block_size, const dfs_service::DeltaOp& op, int fd,
+                     DFSFileChecksum* checksum = nullptr);
+
 
 #endif
 
@@ -0,0 +1,154 @@
+#include <getopt.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+#include "dfs-utils.h"
+#include "../dfslib-crc32-p2.h"
+
+//
+// Microbenchmark for the CRC-32 variants behind dfs_file_checksum.
+//
+// Every variant checksums the same in-memory buffer, so the numbers are
+// the hashing cost alone, without I/O. CRCpp's CRC::Calculate, which the
+// checksum used before, is included as the baseline. All results must
+// agree, or the run fails.
+//
+// With --file, dfs_file_checksum is timed on that file instead, once per
+// thread cap from 1 to --threads, to show what segmenting buys with I/O.
+//
+
+void Usage() {
+    std::cout <<
+        "\nUSAGE: dfs-bench-crc-p2 [OPTIONS]\n"
+        "-f, --file <path>:        Time dfs_file_checksum on this file instead\n"
+        "-j, --threads <int>:      Highest thread cap to try with --file (default: 4)\n"
+        "-r, --rounds <int>:       Passes over the buffer per variant (default: 5)\n"
+        "-s, --size <MB>:          Buffer size in megabytes (default: 64)\n"
+        "-h, --help:               Show help\n\n";
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+
+    const char* const short_opts = "f:j:r:s:h";
+
+    const option long_opts[] = {
+        {"file", required_argument, nullptr, 'f'},
+        {"threads", required_argument, nullptr, 'j'},
+        {"rounds", required_argument, nullptr, 'r'},
+        {"size", required_argument, nullptr, 's'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, no_argument, nullptr, 0}
+    };
+
+    int rounds = 5;
+    size_t size_mb = 64;
+    std::string file;
+    int threads = DFS_CHECKSUM_THREADS;
+
+    int option_char;
+    while ((option_char = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
+        switch (option_char) {
+            case 'f':
+                file = std::string(optarg);
+                break;
+            case 'j':
+                threads = std::max(std::stoi(optarg), 1);
+                break;
+            case 'r':
+                rounds = std::max(std::stoi(optarg), 1);
+                break;
+            case 's':
+                size_mb = std::max<size_t>(std::stoul(optarg), 1);
+                break;
+            default:
+                Usage();
+        }
+    }
+
+    if (!file.empty()) {
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0) {
+            std::cerr << "Cannot stat " << file << std::endl;
+            return 1;
+        }
+        std::cout << "File: " << file << " (" << st.st_size << " bytes), rounds: " << rounds
+                  << ", dispatch: " << DFSCrc32Engine() << std::endl;
+
+        std::uint32_t expected = 0;
+        for (int cap = 1; cap <= threads; cap++) {
+            DFSSetChecksumThreads(static_cast<unsigned>(cap));
+            std::uint32_t crc = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (int round = 0; round < rounds; round++) {
+                crc = dfs_file_checksum(file);
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double gbps = static_cast<double>(st.st_size) * rounds / seconds / 1e9;
+            if (cap == 1) {
+                expected = crc;
+            }
+            std::cout << std::left << std::setw(10) << (std::to_string(cap) + " thr")
+                      << std::right << std::fixed << std::setprecision(2) << std::setw(8) << gbps << " GB/s"
+                      << "  crc " << std::hex << std::setw(8) << std::setfill('0') << crc
+                      << std::dec << std::setfill(' ') << std::endl;
+            if (crc != expected) {
+                std::cerr << "Thread caps disagree" << std::endl;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    std::vector<char> buffer(size_mb * 1024 * 1024);
+    std::mt19937_64 random(42);
+    for (char& byte : buffer) {
+        byte = static_cast<char>(random());
+    }
+
+    CRC::Table<std::uint32_t, 32> table(CRC::CRC_32());
+    std::vector<std::pair<std::string, std::function<std::uint32_t(const char*, size_t)>>> variants = {
+        {"crcpp", [&](const char* data, size_t length) { return CRC::Calculate(data, length, table); }},
+        {"bytewise", [](const char* data, size_t length) { return DFSCrc32Bytewise(0, data, length); }},
+        {"slice16", [](const char* data, size_t length) { return DFSCrc32Slice16(0, data, length); }},
+    };
+    if (DFSCrc32ClmulSupported()) {
+        variants.emplace_back("pclmul", [](const char* data, size_t length) { return DFSCrc32Clmul(0, data, length); });
+    }
+
+    std::cout << "Buffer: " << size_mb << "MB, rounds: " << rounds
+              << ", dispatch: " << DFSCrc32Engine() << std::endl;
+
+    std::uint32_t expected = 0;
+    bool agree = true;
+    for (size_t i = 0; i < variants.size(); i++) {
+        std::uint32_t crc = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++) {
+            crc = variants[i].second(buffer.data(), buffer.size());
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double gbps = static_cast<double>(buffer.size()) * rounds / seconds / 1e9;
+
+        if (i == 0) {
+            expected = crc;
+        }
+        agree = agree && crc == expected;
+        std::cout << std::left << std::setw(10) << variants[i].first
+                  << std::right << std::fixed << std::setprecision(2) << std::setw(8) << gbps << " GB/s"
+                  << "  crc " << std::hex << std::setw(8) << std::setfill('0') << crc
+                  << std::dec << std::setfill(' ') << std::endl;
+    }
+
+    if (!agree) {
+        std::cerr << "Variants disagree" << std::endl;
+        return 1;
+    }
+    return 0;
+}
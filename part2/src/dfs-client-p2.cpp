@@ -74,6 +74,10 @@ void DFSClient::SetDeadlineTimeout(int deadline) {
     this->client_node.SetDeadlineTimeout(deadline);
 }
 
+void DFSClient::SetDeltaTransfers(bool enabled) {
+    this->client_node.SetDeltaTransfers(enabled);
+}
+
 void DFSClient::Mount(const std::string &filepath) {
 
     this->mount_path = filepath;
@@ -101,12 +105,10 @@ void DFSClient::Mount(const std::string &filepath) {
     events.emplace_back(n_event);
     threads.push_back(std::move(thread_watcher));
 
-    thread_async = std::thread(&DFSClientNodeP2::HandleCallbackList, &this->client_node);
+    // Follow the server's change notifications
+    thread_async = std::thread(&DFSClientNodeP2::HandleSubscription, &this->client_node);
     threads.push_back(std::move(thread_async));
 
-    // Initialize the callback list
-    this->client_node.InitCallbackList();
-
     for (std::thread &t : threads) {
         if (t.joinable()) { t.join(); }
     }
@@ -238,9 +240,11 @@ void Usage() {
     std::cout <<
         "\nUSAGE: dfs-client [OPTIONS] COMMAND [FILENAME]\n"
         "-a, --address <address>:  The server address to connect to (default: 0.0.0.0:51189)\n"
+        "-c, --checksum_threads <num>:  The most threads one file checksum may use; all share one pool of helpers (default: 4)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:  The mount path this client attaches to\n"
         "-t, --deadline_timeout <int>:  The deadline timeout in milliseconds (default: 12000)\n"
+        "-w, --whole_file:  Always transfer whole files instead of deltas against the other side's copy\n"
         "-h, --help:               Show help\n"
         "\n"
         "COMMAND is one of mount|fetch|store|delete|list|stat.\n"
@@ -250,13 +254,15 @@ void Usage() {
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:r:t:h";
+    const char* const short_opts = "a:c:d:m:r:t:wh";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
+        {"checksum_threads", optional_argument, nullptr, 'c'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"deadline_timeout", optional_argument, nullptr, 't'},
+        {"whole_file", no_argument, nullptr, 'w'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -268,6 +274,7 @@ int main(int argc, char** argv) {
     std::string command = "";
     std::string mount_path = "";
     int deadline_timeout = 12000;
+    bool whole_file = false;
 
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
@@ -281,6 +288,9 @@ int main(int argc, char** argv) {
             case 'a':
                 server_address = std::string(optarg);
                 break;
+            case 'c':
+                DFSSetChecksumThreads(std::max(std::stoi(optarg), 1));
+                break;
             case 'd':
                 debug_level = std::stoi(optarg);
                 break;
@@ -290,6 +300,9 @@ int main(int argc, char** argv) {
             case 't':
                 deadline_timeout = std::stoi(optarg);
                 break;
+            case 'w':
+                whole_file = true;
+                break;
             case 'h':
                 Usage();
                 break;
@@ -354,6 +367,7 @@ int main(int argc, char** argv) {
 
     client.SetMountPath(mount_path);
     client.SetDeadlineTimeout(deadline_timeout);
+    client.SetDeltaTransfers(!whole_file);
     client.InitializeClientNode(server_address);
     client.ProcessCommand(command, filename);
 
@@ -65,6 +65,13 @@ class DFSClient {
          */
         void SetDeadlineTimeout(int deadline);
 
+        /**
+         * Enables or disables delta transfers
+         *
+         * @param enabled
+         */
+        void SetDeltaTransfers(bool enabled);
+
         /**
          * Mounts the client to the specified file path.
          *
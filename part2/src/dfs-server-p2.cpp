@@ -5,6 +5,7 @@
 #include <csignal>
 
 #include "dfs-utils.h"
+#include "../dfslib-shared-p2.h"
 #include "../dfslib-servernode-p2.h"
 
 void HandleSignal(int signum) {
@@ -15,22 +16,28 @@ void Usage() {
     std::cout <<
         "\nUSAGE: dfs-server-p2 [OPTIONS]\n"
         "-a, --address <address>:       The server address to connect to (default: 0.0.0.0:51189)\n"
+        "-c, --checksum_threads <num>:  The most threads one file checksum may use; all share one pool of helpers (default: 4)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
+        "-l, --lease_time <ms>:         How long a write lock lives unless its holder renews it (default: 10000)\n"
         "-m, --mount_path <path>:       The mount storage path (default: mnt/server)\n"
         "-n, --num_async_threads <num>: The number of asynchronous threads to generate (default: 4)\n"
+        "-w, --coalesce_window <ms>:    How long a burst of changes is gathered into one callback round (default: 50)\n"
         "-h, --help:                    Show help\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:n:h";
+    const char* const short_opts = "a:c:d:l:m:n:w:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
+        {"checksum_threads", optional_argument, nullptr, 'c'},
         {"debug_level", optional_argument, nullptr, 'd'},
+        {"lease_time", optional_argument, nullptr, 'l'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"num_async_threads", optional_argument, nullptr, 'n'},
+        {"coalesce_window", optional_argument, nullptr, 'w'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -40,21 +47,32 @@ int main(int argc, char** argv) {
     long num_async_threads = 4;
     std::string server_address = "0.0.0.0:51189";
     int debug_level = static_cast<int>(LL_ERROR);
+    int coalesce_window = DFS_QUEUE_COALESCE;
+    int lease_time = DFS_LOCK_LEASE;
 
     while((option_char = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
         switch(option_char) {
             case 'a':
                 server_address = std::string(optarg);
                 break;
+            case 'c':
+                DFSSetChecksumThreads(std::max(std::stoi(optarg), 1));
+                break;
             case 'd':
                 debug_level = std::stoi(optarg);
                 break;
+            case 'l':
+                lease_time = std::stoi(optarg);
+                break;
             case 'm':
                 mount_path = std::string(optarg);
                 break;
             case 'n':
                 num_async_threads = std::stoi(optarg);
                 break;
+            case 'w':
+                coalesce_window = std::stoi(optarg);
+                break;
             case 'h':
             case '?':
             default:
@@ -71,6 +89,8 @@ int main(int argc, char** argv) {
     signal(SIGTERM, HandleSignal);
 
     DFSServerNode server_node(server_address, dfs_clean_path(mount_path), num_async_threads, [&]{ return; });
+    server_node.SetCoalesceWindow(coalesce_window);
+    server_node.SetLeaseTime(lease_time);
     server_node.Start();
 
     return 0;
@@ -4,10 +4,16 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include <sys/stat.h>
 
 #define CRCPP_USE_CPP11
 #include "CRC.h"
+#include "../dfslib-crc32-p2.h"
 
 #define DFS_BUFFERSIZE 2048
 
@@ -29,69 +35,129 @@ inline std::string dfs_clean_path(const std::string& path) {
 }
 
 /**
- * Calculate the crc checksum for a file
+ * The file checksum, computed over data as it streams past
  *
- * @param filepath
- * @param table
- * @return
+ * The checksum is defined over DFS_BUFFERSIZE chunks (half the file for
+ * files smaller than that), and a short last chunk is hashed together
+ * with the rest of the previous chunk still in the buffer. Clients and
+ * servers compare these values, so that definition is kept. The stale
+ * bytes always lie within the file's last DFS_BUFFERSIZE bytes, so only
+ * those are kept back for Final.
  */
-inline std::uint32_t dfs_file_checksum(const std::string &filepath, CRC::Table<std::uint32_t, 32> *table) {
+class DFSFileChecksum {
+
+private:
+    std::uint32_t crc;
+    std::uint64_t size;
+    /** The last min(size, DFS_BUFFERSIZE) bytes, right-aligned **/
+    char tail[DFS_BUFFERSIZE];
+
+public:
+    DFSFileChecksum() : crc(0), size(0) {}
+
+    /**
+     * Add the next bytes of the file
+     *
+     * @param data
+     * @param length
+     */
+    void Update(const void* data, size_t length) {
+        const char* bytes = static_cast<const char*>(data);
+        this->crc = DFSCrc32(this->crc, bytes, length);
+        this->size += length;
+        if (length >= DFS_BUFFERSIZE) {
+            memcpy(this->tail, bytes + length - DFS_BUFFERSIZE, DFS_BUFFERSIZE);
+        } else {
+            memmove(this->tail, this->tail + length, DFS_BUFFERSIZE - length);
+            memcpy(this->tail + DFS_BUFFERSIZE - length, bytes, length);
+        }
+    }
 
-    struct stat st;
-    size_t file_size;
-    std::uint32_t crc = 0;
-    std::ifstream stream;
-    uint32_t chunk_count = 0;
-    uint32_t chunk_sequence = 0;
-    std::ifstream::pos_type current_position = 0;
-
-    stream.seekg(0, std::ios::beg);
-    if (lstat(filepath.c_str(), &st) != 0) {
-        return 0;
+    /**
+     * Add `length` bytes whose CRC was computed elsewhere, e.g. by
+     * DFSCrc32File. Final needs the file's last min(size, DFS_BUFFERSIZE)
+     * bytes, so those must still go through Update.
+     *
+     * @param range_crc
+     * @param length
+     */
+    void Extend(std::uint32_t range_crc, std::uint64_t length) {
+        this->crc = DFSCrc32Combine(this->crc, range_crc, length);
+        this->size += length;
     }
 
-    file_size = st.st_size;
+    /**
+     * The bytes added so far
+     */
+    std::uint64_t Size() const {
+        return this->size;
+    }
 
-    std::uint32_t buffer_size = DFS_BUFFERSIZE;
+    /**
+     * The checksum of a file holding exactly the bytes added so far
+     *
+     * @return
+     */
+    std::uint32_t Final() const {
+        std::uint64_t buffer_size = DFS_BUFFERSIZE;
+
+        // The crc works better if we have
+        // at least two chunks to work with
+        if (this->size < DFS_BUFFERSIZE) {
+            buffer_size = std::max<std::uint64_t>(this->size / 2, 1);
+        }
 
-    // The crc works better if we have
-    // at least two chunks to work with
-    if (file_size < DFS_BUFFERSIZE) {
-        buffer_size = static_cast<uint32_t>(file_size / 2);
-        if (buffer_size <= 0) {
-            buffer_size = 1;
+        std::uint64_t short_chunk = this->size % buffer_size;
+        if (short_chunk == 0) {
+            return this->crc;
         }
+        // File offsets [size - buffer_size, size - short_chunk) are still
+        // in the buffer after the last read
+        const char* stale = this->tail + DFS_BUFFERSIZE - buffer_size;
+        return DFSCrc32(this->crc, stale, static_cast<size_t>(buffer_size - short_chunk));
     }
 
-    char buffer[buffer_size];
-
-    chunk_count = static_cast<uint32_t>(file_size / buffer_size) +
-                  static_cast<uint32_t>(static_cast<bool>(file_size % buffer_size));
+};
 
-    stream.open(filepath, std::ios::in | std::ios::binary);
+/**
+ * Calculate the crc checksum for a file
+ *
+ * @param filepath
+ * @return
+ */
+inline std::uint32_t dfs_file_checksum(const std::string &filepath) {
 
-    if (!stream.is_open()) {
+    struct stat st;
+    if (lstat(filepath.c_str(), &st) != 0) {
         return 0;
     }
 
-    while(chunk_count != chunk_sequence) {
-        size_t read_size = (file_size - current_position < buffer_size) ?
-                           file_size - current_position :
-                           buffer_size;
-
-        if (!stream.read(buffer, read_size)) {
-            return crc;
-
-        }
-
-        crc = CRC::Calculate(buffer, sizeof(char) * buffer_size, *table, crc);
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
 
-        chunk_sequence++;
-        current_position = stream.tellg();
+    // Everything but the tail is hashed in parallel segments for large
+    // files; the tail goes through Update for the short-chunk quirk
+    std::uint64_t file_size = st.st_size;
+    std::uint64_t tail_size = std::min<std::uint64_t>(file_size, DFS_BUFFERSIZE);
+    DFSFileChecksum checksum;
+    std::uint32_t head_crc;
+    if (!DFSCrc32File(fd, 0, file_size - tail_size, &head_crc)) {
+        close(fd);
+        return 0;
+    }
+    checksum.Extend(head_crc, file_size - tail_size);
 
+    char tail[DFS_BUFFERSIZE];
+    if (pread(fd, tail, tail_size, file_size - tail_size) != static_cast<ssize_t>(tail_size)) {
+        close(fd);
+        return 0;
     }
+    checksum.Update(tail, tail_size);
 
-    return crc;
+    close(fd);
+    return checksum.Final();
 
 }
 
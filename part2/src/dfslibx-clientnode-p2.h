@@ -198,6 +198,15 @@ public:
         // Data we are sending to the server.
         RequestT request;
         request.set_name("");
+        CallbackList<RequestT, ResponseT>(request);
+
+    }
+
+    /**
+     * Sends a prepared CallbackList request to the server
+     */
+    template<typename RequestT, typename ResponseT>
+    void CallbackList(const RequestT& request) {
 
         // Call object to store rpc data
         AsyncClientData<ResponseT>* call_data = new AsyncClientData<ResponseT>;